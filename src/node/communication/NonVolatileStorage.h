@@ -0,0 +1,75 @@
+#ifndef _NONVOLATILESTORAGE_H_
+#define _NONVOLATILESTORAGE_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <omnetpp.h>
+#include "ResourceManager.h"
+#include "SharedRegistry.h"
+
+// Non-volatile memory (FRAM or flash) of a node, which keeps its contents when the node runs out of energy.
+// Modules keep the state they want to survive a brown-out here, as sections of text records (in the same form as
+// RoutingStateSnapshot), and read it back when the node restarts. Records stand in for the fixed size binary
+// entries a mote would store, so the writer gives the size of one.
+// Writing costs energy: only records which have changed since the section was last written are written (as a
+// mote would only update the entries which changed), and the node's resource manager is charged for each byte.
+// Dropping a record is just marking its entry free, which is not charged.
+// Every module which keeps sections opens the node's storage at startup and releases it as in SharedRegistry
+class NonVolatileStorage
+{
+	public:
+
+		static void open(cModule *node)
+		{
+			Registry_t::open(node);
+		}
+
+		static void release(cModule *node)
+		{
+			Registry_t::release(node);
+		}
+
+		// Replaces the contents of the section. writeEnergyPerByte is in Joules (around 2nJ for FRAM, flash is 100 times
+		// more). Returns the number of bytes written
+		static unsigned int write(cModule *node, const std::string &section, const std::vector<std::string> &records,
+			unsigned int recordBytes, double writeEnergyPerByte)
+		{
+			std::vector<std::string> &stored = Registry_t::get(node)[section];
+			std::set<std::string> unchanged(stored.begin(), stored.end());
+			unsigned int bytesWritten = 0;
+			for(unsigned int i = 0; i < records.size(); i++)
+			{
+				if(unchanged.count(records[i]) == 0) {
+					bytesWritten += recordBytes;
+				}
+			}
+			stored = records;
+
+			if(bytesWritten > 0 && writeEnergyPerByte > 0)
+			{
+				check_and_cast<ResourceManager*>(node->getSubmodule("ResourceManager")->getSubmodule("ResourceManager"))
+					->consumeEnergy(bytesWritten * writeEnergyPerByte);
+			}
+			return bytesWritten;
+		}
+
+		// The records last written to the section, or none
+		static std::vector<std::string> read(cModule *node, const std::string &section)
+		{
+			Sections_t &sections = Registry_t::get(node);
+			Sections_t::iterator it = sections.find(section);
+			if(it == sections.end()) {
+				return std::vector<std::string>();
+			}
+			return it->second;
+		}
+
+	private:
+
+		typedef std::map<std::string, std::vector<std::string> > Sections_t;
+		typedef SharedRegistry<NonVolatileStorage, cModule*, Sections_t> Registry_t;
+};
+
+#endif //_NONVOLATILESTORAGE_H_
@@ -0,0 +1,204 @@
+#ifndef _PACKETJOURNEY_H_
+#define _PACKETJOURNEY_H_
+
+#include <map>
+#include <vector>
+#include <omnetpp.h>
+#include "SharedRegistry.h"
+
+// Cross-layer trace of the journey of application packets through the network, for breaking down end-to-end delay.
+// The routing module of the origin starts a journey when the application hands it a packet, then routing and MAC
+// modules along the way stamp the times of each step at their node, and the sink finishes the journey when it
+// delivers the packet. A packet is recognised at every layer and hop by the tree ID of the application packet it
+// carries, which survives encapsulation, dup() and the copies the radio makes. Packets carried inside another
+// packet (e.g. CTP aggregates) are linked to it with carry(), so stamps of the carrier go to each of them.
+// Only the first stamp of an event at a hop is kept, so retries do not move it. Journeys of packets which are never
+// delivered are kept until the end of the run.
+// Journeys are shared by all the modules of a run, which open and release them as in SharedRegistry
+class PacketJourney
+{
+	public:
+
+		enum Event_t
+		{
+			ROUTING_ENQUEUE = 0,	// Arrived at the routing layer of the hop's node (from the application, or the previous hop)
+			ROUTING_DEQUEUE,		// Routing passed the packet to the MAC for the first time
+			MAC_ENQUEUE,			// The MAC buffered the packet
+			MAC_FIRST_TX,			// The MAC started the first transmission
+			MAC_ACK,				// The MAC received the ACK from the next hop
+			NUMBER_OF_EVENTS
+		};
+
+		struct Hop_t
+		{
+			int node;
+			simtime_t times[NUMBER_OF_EVENTS]; // -1 if not stamped
+		};
+
+		struct Journey_t
+		{
+			simtime_t appSend;
+			simtime_t delivered;
+			std::vector<Hop_t> hops;
+
+			// Delays of a hop in seconds, or -1 if a stamp is missing (e.g. the MAC does not stamp journeys).
+			// The hop ends when the next hop (or the sink's application) receives the packet, so retransmission
+			// is the time from the first transmission until a copy got through, including routing retries
+			double queueingDelay(unsigned int hop) const
+			{
+				return between(hops[hop].times[ROUTING_ENQUEUE], hops[hop].times[ROUTING_DEQUEUE]);
+			}
+
+			double macAccessDelay(unsigned int hop) const
+			{
+				return between(hops[hop].times[MAC_ENQUEUE], hops[hop].times[MAC_FIRST_TX]);
+			}
+
+			double retransmissionDelay(unsigned int hop) const
+			{
+				simtime_t hopEnd = hop + 1 < hops.size() ? hops[hop + 1].times[ROUTING_ENQUEUE] : delivered;
+				return between(hops[hop].times[MAC_FIRST_TX], hopEnd);
+			}
+
+			private:
+
+				static double between(simtime_t from, simtime_t to)
+				{
+					if(from < 0 || to < 0) {
+						return -1;
+					}
+					return (to - from).dbl();
+				}
+		};
+
+		static void open()
+		{
+			Registry_t::open(ALL_MODULES);
+		}
+
+		static void release()
+		{
+			Registry_t::release(ALL_MODULES);
+		}
+
+		// Starts the journey of an application packet at its origin, and stamps its arrival at the routing layer
+		static void start(cPacket *appPacket, int node)
+		{
+			Journey_t &journey = journeys()[appPacket->getTreeId()];
+			journey.appSend = appPacket->getCreationTime();
+			journey.delivered = -1;
+			journey.hops.clear();
+			stamp(appPacket, node, ROUTING_ENQUEUE);
+		}
+
+		// The key of the journey of the packet at any layer
+		static long keyOf(cPacket *pkt)
+		{
+			return pkt->getEncapsulationTreeId();
+		}
+
+		static void stamp(cPacket *pkt, int node, Event_t event)
+		{
+			stamp(keyOf(pkt), node, event);
+		}
+
+		static void stamp(long key, int node, Event_t event)
+		{
+			std::map<long, std::vector<long> >::iterator carrier = carriers().find(key);
+			if(carrier != carriers().end())
+			{
+				bool isCarrying = false;
+				for(unsigned int i = 0; i < carrier->second.size(); i++) {
+					isCarrying = stampJourney(carrier->second[i], node, event) || isCarrying;
+				}
+				// The carried packets have all been delivered
+				if(!isCarrying) {
+					carriers().erase(carrier);
+				}
+				return;
+			}
+			stampJourney(key, node, event);
+		}
+
+		// Stamps of the carrier packet are made on the carried packet too, from now on
+		static void carry(cPacket *carrier, cPacket *carried)
+		{
+			carriers()[keyOf(carrier)].push_back(keyOf(carried));
+		}
+
+		// Ends the journey when the sink delivers the packet. Returns false if the packet has no journey, e.g. if it was
+		// started before its origin collected journeys, or is a duplicate which has already been delivered
+		static bool finish(cPacket *pkt, Journey_t &journey)
+		{
+			std::map<long, Journey_t>::iterator it = journeys().find(keyOf(pkt));
+			if(it == journeys().end()) {
+				return false;
+			}
+			journey = it->second;
+			journey.delivered = simTime();
+			journeys().erase(it);
+			return true;
+		}
+
+	private:
+
+		static bool stampJourney(long key, int node, Event_t event)
+		{
+			std::map<long, Journey_t>::iterator it = journeys().find(key);
+			if(it == journeys().end()) {
+				return false;
+			}
+			std::vector<Hop_t> &hops = it->second.hops;
+
+			// Arriving at a node starts a new hop, unless the packet is still at that node (e.g. queued again after a loop)
+			if(event == ROUTING_ENQUEUE)
+			{
+				if(hops.empty() || hops.back().node != node)
+				{
+					Hop_t hop;
+					hop.node = node;
+					for(int i = 0; i < NUMBER_OF_EVENTS; i++) {
+						hop.times[i] = -1;
+					}
+					hop.times[ROUTING_ENQUEUE] = simTime();
+					hops.push_back(hop);
+				}
+				return true;
+			}
+
+			// Other events belong to the latest hop at the node. This may not be the last hop, as the next hop can
+			// receive the packet before the ACK gets back
+			for(int i = hops.size() - 1; i >= 0; i--)
+			{
+				if(hops[i].node == node)
+				{
+					if(hops[i].times[event] < 0) {
+						hops[i].times[event] = simTime();
+					}
+					break;
+				}
+			}
+			return true;
+		}
+
+		struct Journeys_t {
+			std::map<long, Journey_t> journeys;
+			std::map<long, std::vector<long> > carriers;	// Keys of the packets carried by each carrier packet
+		};
+
+		// There is only one set of journeys, shared by every module
+		static const int ALL_MODULES = 0;
+		typedef SharedRegistry<PacketJourney, int, Journeys_t> Registry_t;
+
+		static std::map<long, Journey_t> &journeys()
+		{
+			return Registry_t::get(ALL_MODULES).journeys;
+		}
+
+		static std::map<long, std::vector<long> > &carriers()
+		{
+			return Registry_t::get(ALL_MODULES).carriers;
+		}
+};
+
+#endif //_PACKETJOURNEY_H_
@@ -0,0 +1,152 @@
+#ifndef _PACKETPRIORITY_H_
+#define _PACKETPRIORITY_H_
+
+#include <vector>
+#include <cstring>
+#include <omnetpp.h>
+
+// Priority classes of packets, so that e.g. an alarm reading is not queued behind periodic samples and beacons.
+// An application tags its packet with set() before handing it to the routing layer. Untagged packets (including
+// routing beacons) are ROUTINE.
+// The class is a parameter of the packet object, so it survives dup() and the copies the radio makes. Each layer
+// copies it to its own packet when it encapsulates one (as a couple of header bits would on a mote), and only ever
+// reads it from its own packet: looking inside with getEncapsulatedPacket() would unshare the encapsulated packet.
+class PacketPriority
+{
+	public:
+
+		enum Class_t
+		{
+			ROUTINE = 0,
+			ELEVATED,
+			URGENT,
+			NUMBER_OF_CLASSES
+		};
+
+		static void set(cPacket *pkt, int priorityClass)
+		{
+			if(priorityClass < ROUTINE || priorityClass >= NUMBER_OF_CLASSES) {
+				opp_error("PacketPriority: invalid priority class %d", priorityClass);
+			}
+			if(pkt->hasPar(parameterName())) {
+				pkt->par(parameterName()).setLongValue(priorityClass);
+			}
+			else if(priorityClass != ROUTINE) {
+				pkt->addPar(parameterName()).setLongValue(priorityClass);
+			}
+		}
+
+		static int of(cPacket *pkt)
+		{
+			if(pkt->hasPar(parameterName())) {
+				return pkt->par(parameterName()).longValue();
+			}
+			return ROUTINE;
+		}
+
+		// For a layer encapsulating a packet in its own
+		static void copy(cPacket *from, cPacket *to)
+		{
+			set(to, of(from));
+		}
+
+	private:
+
+		static const char *parameterName()
+		{
+			return "priorityClass";
+		}
+};
+
+// Chooses the priority class a queue serves next, given the classes with packets waiting (as a bit mask, see bit()).
+// Strict: always the highest class waiting.
+// Weighted: rounds in which each class may send up to its weight in packets, higher classes first. A round ends
+// when no class waiting has any of its turns left, so a class gets no credit for time it had nothing to send, and
+// lower classes get a share of the link even when urgent traffic is heavy
+class PriorityScheduler
+{
+	public:
+
+		PriorityScheduler(): weighted(false) { }
+
+		// scheduling is "strict" or "weighted". weights is a space separated list of packets per round for each class,
+		// lowest class first
+		void initialise(const char *scheduling, const char *weights)
+		{
+			if(strcmp(scheduling, "strict") == 0) {
+				weighted = false;
+			}
+			else if(strcmp(scheduling, "weighted") == 0) {
+				weighted = true;
+			}
+			else {
+				opp_error("PriorityScheduler: scheduling must be strict or weighted, not %s", scheduling);
+			}
+
+			classWeights = cStringTokenizer(weights).asIntVector();
+			if(weighted && classWeights.size() != PacketPriority::NUMBER_OF_CLASSES) {
+				opp_error("PriorityScheduler: need one weight for each of the %d priority classes", PacketPriority::NUMBER_OF_CLASSES);
+			}
+			for(unsigned int i = 0; weighted && i < classWeights.size(); i++)
+			{
+				if(classWeights[i] < 1) {
+					opp_error("PriorityScheduler: weights must be at least 1");
+				}
+			}
+			credits = classWeights;
+		}
+
+		static unsigned int bit(int priorityClass)
+		{
+			return 1u << priorityClass;
+		}
+
+		// Returns the class to serve next, or -1 if none are waiting
+		int choose(unsigned int waitingClasses) const
+		{
+			int highestWaitingClass = -1;
+			for(int c = PacketPriority::NUMBER_OF_CLASSES - 1; c >= 0; c--)
+			{
+				if(waitingClasses & bit(c))
+				{
+					if(!weighted || credits[c] > 0) {
+						return c;
+					}
+					if(highestWaitingClass == -1) {
+						highestWaitingClass = c;
+					}
+				}
+			}
+			// Every class waiting has used its turns: the next round starts with the highest
+			return highestWaitingClass;
+		}
+
+		// Called when a packet of the chosen class is taken to be sent
+		void charge(int priorityClass, unsigned int waitingClasses)
+		{
+			if(!weighted) {
+				return;
+			}
+			bool isRoundOver = true;
+			for(int c = 0; c < PacketPriority::NUMBER_OF_CLASSES; c++)
+			{
+				if((waitingClasses & bit(c)) && credits[c] > 0) {
+					isRoundOver = false;
+				}
+			}
+			if(isRoundOver) {
+				credits = classWeights;
+			}
+			if(credits[priorityClass] > 0) {
+				credits[priorityClass]--;
+			}
+		}
+
+	private:
+
+		bool weighted;
+		std::vector<int> classWeights;
+		std::vector<int> credits;
+};
+
+#endif //_PACKETPRIORITY_H_
@@ -0,0 +1,53 @@
+#ifndef _SHAREDREGISTRY_H_
+#define _SHAREDREGISTRY_H_
+
+#include <map>
+
+// State shared between modules for the length of a run (e.g. by all the nodes of a network), one Value_t for each
+// key. It is kept in static data, which outlives a run, but modules (and so any module pointers used as keys) do
+// not: every module which uses an entry must open it at startup and release it when it finishes, and the entry is
+// deleted when its last user releases it.
+// Owner_t is the class keeping the state, so that owners with the same key and value types have separate registries
+template <typename Owner_t, typename Key_t, typename Value_t>
+class SharedRegistry
+{
+	public:
+
+		// The entry for the key, created by its first user
+		static Value_t &open(const Key_t &key)
+		{
+			Entry_t &entry = entries()[key];
+			entry.users++;
+			return entry.value;
+		}
+
+		static void release(const Key_t &key)
+		{
+			typename std::map<Key_t, Entry_t>::iterator it = entries().find(key);
+			if(it != entries().end() && --it->second.users == 0) {
+				entries().erase(it);
+			}
+		}
+
+		// The entry for a key which the caller has opened
+		static Value_t &get(const Key_t &key)
+		{
+			return entries()[key].value;
+		}
+
+	private:
+
+		struct Entry_t {
+			Entry_t(): users(0) { }
+			Value_t value;
+			int users;
+		};
+
+		static std::map<Key_t, Entry_t> &entries()
+		{
+			static std::map<Key_t, Entry_t> registry;
+			return registry;
+		}
+};
+
+#endif //_SHAREDREGISTRY_H_
@@ -0,0 +1,193 @@
+#ifndef _TXPOWERCONTROL_H_
+#define _TXPOWERCONTROL_H_
+
+#include <map>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <omnetpp.h>
+
+// Per-neighbour transmit power control for MACs. Each neighbour starts at the highest power level. Send attempts
+// and ACKs to each neighbour are counted over a window of txPowerWindow attempts, at the end of which the ETX
+// of the window (attempts / ACKs) decides the neighbour's level for the next window:
+// - ETX above the target: one level up (straight to the highest if nothing was ACKed, the link may be lost)
+// - every attempt ACKed: one level down
+// - otherwise: stay
+// MACs whose ACK rate says little about the link use the RSSI target instead (see recordAckedRssi).
+// Broadcasts always use the highest level, so that they (and link estimates based on them) reach every neighbour.
+// The MAC asks for the level before each frame, and only needs to send SET_TX_OUTPUT to the radio when it changes.
+class TxPowerControl
+{
+	public:
+
+		TxPowerControl(): enabled(false), targetEtx(0), windowSize(0), targetRssi(0), isRadioPowerKnown(false), radioPower(0) { }
+
+		// powerLevels is a space separated list of levels in dBm, which must all be valid for the Radio in use
+		void initialise(bool enabled, const char *powerLevels, double targetEtx, int windowSize)
+		{
+			initialiseLevels(enabled, powerLevels);
+			this->targetEtx = targetEtx;
+			this->windowSize = windowSize;
+			if(enabled && (targetEtx < 1 || windowSize < 1)) {
+				opp_error("TxPowerControl: target ETX must be at least 1 and window at least 1 attempt");
+			}
+		}
+
+		// For levels chosen by recordAckedRssi / recordFailure instead of ETX windows. targetRssi is in dBm
+		void initialiseRssiTarget(bool enabled, const char *powerLevels, double targetRssi)
+		{
+			initialiseLevels(enabled, powerLevels);
+			this->targetRssi = targetRssi;
+		}
+
+		bool isEnabled() const { return enabled; }
+
+		// The level (in dBm) to send the next frame to destination at
+		double getTxPower(int destination, bool isBroadcast)
+		{
+			if(isBroadcast) {
+				return levels[0];
+			}
+			return levels[neighbours[destination].levelIndex];
+		}
+
+		// Returns true if the radio has to be told to change to this level (and assumes it will be)
+		bool radioPowerNeedsChanging(double power)
+		{
+			if(isRadioPowerKnown && radioPower == power) {
+				return false;
+			}
+			isRadioPowerKnown = true;
+			radioPower = power;
+			return true;
+		}
+
+		// Returns true if the neighbour's level has changed
+		bool recordAttempt(int destination)
+		{
+			Neighbour_t &neighbour = neighbours[destination];
+			unsigned int previousLevelIndex = neighbour.levelIndex;
+			// The window is closed at the start of the next one, so that the ACK for its last attempt is counted
+			if(neighbour.windowAttempts >= windowSize) {
+				adaptLevel(neighbour);
+			}
+			neighbour.windowAttempts++;
+			return neighbour.levelIndex != previousLevelIndex;
+		}
+
+		void recordAck(int destination)
+		{
+			std::map<int, Neighbour_t>::iterator it = neighbours.find(destination);
+			if(it != neighbours.end() && it->second.windowAcks < it->second.windowAttempts) {
+				it->second.windowAcks++;
+			}
+		}
+
+		// The receiver of an ACKed frame reports the RSSI it received it with. The neighbour's level becomes the lowest
+		// expected to arrive at targetRssi or above, given the path loss at the level the frame was sent at
+		void recordAckedRssi(int destination, double rssi)
+		{
+			Neighbour_t &neighbour = neighbours[destination];
+			double pathLoss = levels[neighbour.levelIndex] - rssi;
+			unsigned int levelIndex = 0;
+			while(levelIndex + 1 < levels.size() && levels[levelIndex + 1] - pathLoss >= targetRssi) {
+				levelIndex++;
+			}
+			neighbour.levelIndex = levelIndex;
+		}
+
+		// Nothing was ACKed: straight to the highest level, the link may be lost
+		void recordFailure(int destination)
+		{
+			neighbours[destination].levelIndex = 0;
+		}
+
+		// Each neighbour's level, one record per neighbour: "<nodeId> <level dBm>". Windows are not included
+		std::vector<std::string> getLevelRecords() const
+		{
+			std::vector<std::string> records;
+			for(std::map<int, Neighbour_t>::const_iterator it = neighbours.begin(); it != neighbours.end(); ++it)
+			{
+				std::ostringstream record;
+				record << it->first << " " << levels[it->second.levelIndex];
+				records.push_back(record.str());
+			}
+			return records;
+		}
+
+		// Neighbours start a new window at their restored level. Levels which aren't in use any more are ignored
+		void restoreLevels(const std::vector<std::string> &records)
+		{
+			for(unsigned int i = 0; i < records.size(); i++)
+			{
+				std::istringstream record(records[i]);
+				int nodeId;
+				double level;
+				if(!(record >> nodeId >> level)) {
+					opp_error("TxPowerControl: malformed level record: %s", records[i].c_str());
+				}
+				std::vector<double>::iterator it = std::find(levels.begin(), levels.end(), level);
+				if(it != levels.end()) {
+					neighbours[nodeId].levelIndex = it - levels.begin();
+				}
+			}
+		}
+
+		// Everything is lost when the node runs out of energy. The radio goes back to its configured level
+		void reset()
+		{
+			neighbours.clear();
+			isRadioPowerKnown = false;
+		}
+
+	private:
+
+		struct Neighbour_t {
+			Neighbour_t(): levelIndex(0), windowAttempts(0), windowAcks(0) { }
+			unsigned int levelIndex;	// Into levels, 0 is the highest power
+			int windowAttempts;
+			int windowAcks;
+		};
+
+		bool enabled;
+		double targetEtx;
+		int windowSize;
+		double targetRssi;
+		std::vector<double> levels;
+		std::map<int, Neighbour_t> neighbours;
+		bool isRadioPowerKnown;
+		double radioPower;
+
+		void initialiseLevels(bool enabled, const char *powerLevels)
+		{
+			this->enabled = enabled;
+			levels = cStringTokenizer(powerLevels).asDoubleVector();
+			// Highest level first
+			std::sort(levels.begin(), levels.end(), std::greater<double>());
+
+			if(enabled && levels.empty()) {
+				opp_error("TxPowerControl: no TX power levels given");
+			}
+		}
+
+		void adaptLevel(Neighbour_t &neighbour)
+		{
+			if(neighbour.windowAcks == 0) {
+				neighbour.levelIndex = 0;
+			}
+			else if((double)neighbour.windowAttempts / neighbour.windowAcks > targetEtx) {
+				if(neighbour.levelIndex > 0) {
+					neighbour.levelIndex--;
+				}
+			}
+			else if(neighbour.windowAcks == neighbour.windowAttempts && neighbour.levelIndex + 1 < levels.size()) {
+				neighbour.levelIndex++;
+			}
+			neighbour.windowAttempts = 0;
+			neighbour.windowAcks = 0;
+		}
+};
+
+#endif //_TXPOWERCONTROL_H_
@@ -1,4 +1,5 @@
 #include "BoxMacTwoController.h"
+#include "BoxMacTwoSender.h"
 
 // Register the module in Omnet++
 Define_Module(BoxMacTwoController);
@@ -10,6 +11,11 @@ const char * BoxMacTwoController::OUTPUT_RECEIVED_ACK = "BoxMac Received ACK";
 const char * BoxMacTwoController::OUTPUT_SENT_ACK = "BoxMac Sent ACK";
 const char * BoxMacTwoController::OUTPUT_IDLE_LISTENING = "BoxMac Idle listening";
 const char * BoxMacTwoController::OUTPUT_TOTAL_SLEEP_DURATION = "BoxMac Total sleep duration";
+const char * BoxMacTwoController::OUTPUT_EARLY_SLEEP = "BoxMac Early sleep after false wakeup";
+const char * BoxMacTwoController::OUTPUT_FAST_FORWARD_DELIVERED = "BoxMac Fast-forward delivered";
+const char * BoxMacTwoController::OUTPUT_FAST_FORWARD_DELIVERY_TIME_ERROR = "BoxMac Fast-forward delivery time error";
+const char * BoxMacTwoController::OUTPUT_FAST_FORWARD_MISSED_DELIVERY = "BoxMac Fast-forward missed delivery";
+const char * BoxMacTwoController::OUTPUT_TX_POWER = "BoxMac TX power";
 
 void BoxMacTwoController::startup()
 {
@@ -23,8 +29,10 @@ void BoxMacTwoController::startup()
 		// Store NED parameters
 		sleepTime = par("sleepTime");
 		receivePeriodAfterCcaBusy = par("receivePeriodAfterCcaBusy");
+		earlySleepAfterFalseWakeup = par("earlySleepAfterFalseWakeup");
 		ackFrameSizeBits = par("ackFrameSizeBits");
 		dataFrameSizeBits = par("dataFrameSizeBits");
+		txPowerControl.initialiseRssiTarget(par("txPowerControl"), par("txPowerLevels"), par("txPowerTargetRssi"));
 
 		// Declare stats outputs
 		declareOutput(OUTPUT_OVERHEARD);
@@ -34,6 +42,12 @@ void BoxMacTwoController::startup()
 		declareOutput(OUTPUT_SENT_ACK);
 		declareOutput(OUTPUT_IDLE_LISTENING);
 		declareOutput(OUTPUT_TOTAL_SLEEP_DURATION);
+		declareOutput(OUTPUT_EARLY_SLEEP);
+		declareOutput(OUTPUT_FAST_FORWARD_DELIVERED);
+		declareOutput(OUTPUT_FAST_FORWARD_MISSED_DELIVERY);
+		declareOutput(OUTPUT_TX_POWER);
+		// The error is at most one occupancy frame (interTransmissionAckReceiveDelay)
+		declareHistogram(OUTPUT_FAST_FORWARD_DELIVERY_TIME_ERROR, 0, 0.01, 10);
 
 		hasStartedUpOnce = true;
 	}
@@ -46,6 +60,8 @@ void BoxMacTwoController::startup()
 	isSleepTimerPaused = false;
 	idleListen = true;
 	sleepStartedAt = -1;
+	broadcastTrainSource = -1;
+	broadcastTrainSequenceNumbers.clear();
 
 	// Start polling CCA
 	startCcaPolling();
@@ -71,6 +87,12 @@ void BoxMacTwoController::handleOutOfEnergy(cMessage *outOfEnergyMsg)
 	isSleepTimerPaused = false;
 	idleListen = true;
 
+	// Any fast-forward trains registered with us are lost
+	clearFastForwardTrains();
+
+	// As are link statistics for TX power control
+	txPowerControl.reset();
+
 	// No need to reinitialise private variables and state set in startup() - startup will be called again when node restarts
 
 	// Signal to sub-modules that we are out of energy
@@ -108,6 +130,8 @@ int BoxMacTwoController::handleControlCommand(cMessage * msg)
 			// Reset flag for idle listen statistics (no messages received addressed to us when listening)
 			// If we hear a message while listening, this flag will be set to false
 			idleListen = true;
+			broadcastTrainSource = -1;
+			broadcastTrainSequenceNumbers.clear();
 			break;
 		}
 
@@ -191,6 +215,7 @@ int BoxMacTwoController::handleControlCommand(cMessage * msg)
 			
 			// The sender has reported that the send has failed to be ACKed by recipient. Inform the Network layer
 			// The network layer is responsible for retrying, and may update it's link quality metrics.
+			recordUnicastTrainOutcome(controlMsg->getValue(), false, 0);
 			RoutingControlMessage *sendFailedMsg = new RoutingControlMessage("routing control msg", NETWORK_CONTROL_COMMAND);
 			sendFailedMsg->setRoutingControlMessageKind(ROUTING_MSG_MAC_SENDING_FAILED_NO_ACK);
 			sendFailedMsg->setValue(controlMsg->getValue()); // The value is the node ID of the node we were trying to send to
@@ -198,6 +223,19 @@ int BoxMacTwoController::handleControlCommand(cMessage * msg)
 			break;
 		}
 
+		case SENDING_ACKED_FAST_FORWARD: {
+
+			// The sender has been ACKed directly by the destination of a fast-forward train. 
+			// Treat this the same as receiving an ACK frame
+			collectOutput(BoxMacTwoController::OUTPUT_RECEIVED_ACK); // Add 1 to stat
+			recordUnicastTrainOutcome(controlMsg->getValue(), true, controlMsg->getRssi());
+			RoutingControlMessage *sendSucceededMsg = new RoutingControlMessage("routing control msg", NETWORK_CONTROL_COMMAND);
+			sendSucceededMsg->setRoutingControlMessageKind(ROUTING_MSG_MAC_SENDING_ACKED);
+			sendSucceededMsg->setValue(controlMsg->getValue()); // The value is the node ID of the node which ACKed
+			toNetworkLayer(sendSucceededMsg);
+			break;
+		}
+
 		default: {
 			opp_error("BoxMacTwoController: Unknown MAC control command kind");
 		}
@@ -222,12 +260,27 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 		return;
 	}
 
+	// Fast-forward occupancy frames stand in for the copies of a unicast train. Receiving one means a copy would have
+	// got through, so the destination takes delivery of the train registered with it by fastForwardTrainStarted.
+	// Anyone else has overheard a train addressed to another node
+	if(macFrame->getIsFastForwardOccupancy()) {
+		if(macFrame->getDestination() == SELF_MAC_ADDRESS) {
+			deliverFastForwardTrain(macFrame, rssi);
+		}
+		else {
+			trace() << "Overheard a fast-forward train addressed to node " << macFrame->getDestination();
+			endListenPeriodEarly();
+		}
+		return;
+	}
+
 	
 	int destination = macFrame->getDestination();
 	int source = macFrame->getSource();
 
 	// If we receive a broadcast message, do not send an ACK - just de-dupe and pass up to network layer
 	if (destination ==  BROADCAST_MAC_ADDRESS) {
+		bool isWholeTrainHeard = hasHeardWholeBroadcastTrain(macFrame);
 		if(isNotDuplicatePacket(macFrame))
 		{
 			trace() << "Received broacast message from " << source << ", passing to Network layer";
@@ -240,6 +293,11 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 		{
 			plotTrace() << "#MAC_REC_BROADCAST_DUP";
 			trace() << "Discarding duplicate broadcast packet " << macFrame->getSequenceNumber() << " from node " << macFrame->getSource();
+			// We already have this broadcast, so the rest of this train is of no use to us - unless the train carries
+			// other coalesced broadcasts whose copies we have missed so far
+			if(isWholeTrainHeard) {
+				endListenPeriodEarly();
+			}
 		}
 		return;
 	}
@@ -267,7 +325,9 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 			// It must be an ACK. Just ignore this
 			trace() << "Overheard an ACK not addressed to me - addressed to node " << destination << ". Ignoring.";
 		}
-		
+
+		// Whatever woke us up is addressed to another node
+		endListenPeriodEarly();
 		return;
 	}
 
@@ -280,6 +340,10 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 			trace() << "Received a data packet from " << source << " addressed to us. Sending ACK";
 			collectOutput(BoxMacTwoController::OUTPUT_RECEIVED_DATA); // Add 1 to stat		
 			
+			// If we are validating fast-forward mode, compare this delivery with the one fast-forward mode would make
+			// on receiving an occupancy frame here
+			validateFastForwardDelivery(macFrame);
+
 			// Set the idle listen flag to false to indicate that this listening period was not idle -
 			// idle listening means waking up to listen, but not receiveing any messages addressed to us
 			idleListen = false;
@@ -293,6 +357,8 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 			ackFrame->setFrameType(BOX_MAC_FRAME_TYPE_ACK);
 			ackFrame->setBitLength(ackFrameSizeBits);
 			ackFrame->setSequenceNumber(currentSequenceNumber++);
+			ackFrame->setAckedFrameRssi(rssi);
+			setTxPowerForFrameTo(source);
 			// Note: we first send the frame to the radio (gets added to the radio buffer)
 			toRadioLayer(ackFrame);
 			// THEN we set to TX. After TXing all packets in buffer, it should automatically go back to previous state (RX)
@@ -314,6 +380,8 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 				trace() << "Not passing duplicate packet " << macFrame->getSequenceNumber() << 
 					" from node " << macFrame->getSource() <<
 					" up to network layer";
+				// We have already handled this frame, and have ACKed it again - no need to keep listening for it
+				endListenPeriodEarly();
 			}
 
 			break;
@@ -324,6 +392,7 @@ void BoxMacTwoController::fromRadioLayer(cPacket * pkt, double rssi, double lqi)
 			collectOutput(BoxMacTwoController::OUTPUT_RECEIVED_ACK); // Add 1 to stat					
 			trace() << "Received ACK from " << source << ". Passing to sender";
 			plotTrace() << "#MAC_REC_ACK";
+			recordUnicastTrainOutcome(source, true, macFrame->getAckedFrameRssi());
 
 			// Pass on the ACK to the Sender module (so it knows it can stop transmitting early if appropriate)
 			// Note we have to send a DUPLICATE - by default VirtualMac will delete the Mac packet when this function returns
@@ -360,6 +429,7 @@ void BoxMacTwoController::fromNetworkLayer(cPacket *netPkt, int destination)
 	macFrame->setSource(SELF_MAC_ADDRESS);
 	macFrame->setDestination(destination);
 	macFrame->setFrameType(BOX_MAC_FRAME_TYPE_DATA);
+	PacketPriority::copy(netPkt, macFrame);
 
 	// Give the packet to the Sender module. It is the Sender's responsibility to buffer packets and send them when appropriate,
 	// it is the controller's responsibility to tell the Sender when it is okay to send
@@ -404,13 +474,7 @@ void BoxMacTwoController::timerFiredCallback(int index)
 		case BOX_MAC_TIMER_LISTEN_PERIOD: {
 			trace() << "Listening period has ended";
 			// We have reached the end of the listening period.
-			
-			if(idleListen) {
-				collectOutput(BoxMacTwoController::OUTPUT_IDLE_LISTENING); // Add 1 to stat
-			}
-
-			//Signal the Sender okay to start sending.
-			signalSenderOkayToSend();
+			endListenPeriod();
 			break;
 		}
 
@@ -420,6 +484,42 @@ void BoxMacTwoController::timerFiredCallback(int index)
 	}
 }
 
+void BoxMacTwoController::endListenPeriod()
+{
+	if(idleListen) {
+		collectOutput(BoxMacTwoController::OUTPUT_IDLE_LISTENING); // Add 1 to stat
+	}
+
+	//Signal the Sender okay to start sending. When it has finished we will go to sleep
+	signalSenderOkayToSend();
+}
+
+void BoxMacTwoController::endListenPeriodEarly()
+{
+	if(!earlySleepAfterFalseWakeup || boxMacState != BOX_MAC_STATE_LISTENING) {
+		return;
+	}
+
+	trace() << "False wakeup - ending listening period early";
+	plotTrace() << "#MAC_EARLY_SLEEP";
+	collectOutput(BoxMacTwoController::OUTPUT_EARLY_SLEEP); // Add 1 to stat
+	cancelTimer(BOX_MAC_TIMER_LISTEN_PERIOD);
+	endListenPeriod();
+}
+
+bool BoxMacTwoController::hasHeardWholeBroadcastTrain(BoxMacTwoPacket *macFrame)
+{
+	// Copies of the broadcasts in a coalesced train take turns, so hearing one of them again only means that the
+	// copies in between were lost
+	if(macFrame->getSource() != broadcastTrainSource)
+	{
+		broadcastTrainSource = macFrame->getSource();
+		broadcastTrainSequenceNumbers.clear();
+	}
+	broadcastTrainSequenceNumbers.insert(macFrame->getSequenceNumber());
+	return (int)broadcastTrainSequenceNumbers.size() >= macFrame->getCoalescedBroadcasts();
+}
+
 void BoxMacTwoController::changeState(int newState)
 {
 	// Implement any state machine logic / transition checks
@@ -458,7 +558,160 @@ void BoxMacTwoController::recordSleepDurationStats()
 	sleepStartedAt = -1;
 }
 
+void BoxMacTwoController::fastForwardTrainStarted(BoxMacTwoPacket *frame, BoxMacTwoSender *sender, simtime_t trainEnd, 
+	simtime_t occupancyFrameDuration, bool isValidationOnly)
+{
+	Enter_Method_Silent();
+	take(frame);
+
+	removeExpiredFastForwardTrains();
+
+	trace() << "Node " << frame->getSource() << " started a fast-forward train for seqNo " << frame->getSequenceNumber() 
+		<< " ending at " << trainEnd;
+
+	FastForwardTrain_t train;
+	train.frame = frame;
+	train.sender = sender;
+	train.trainStart = simTime();
+	train.trainEnd = trainEnd;
+	train.occupancyFrameDuration = occupancyFrameDuration;
+	train.isValidationOnly = isValidationOnly;
+	fastForwardTrains.push_back(train);
+}
+
+void BoxMacTwoController::deliverFastForwardTrain(BoxMacTwoPacket *occupancyFrame, double rssi)
+{
+	removeExpiredFastForwardTrains();
+
+	std::list<FastForwardTrain_t>::iterator it = fastForwardTrains.begin();
+	while(it != fastForwardTrains.end() && (it->isValidationOnly || it->frame->getSource() != occupancyFrame->getSource()
+		|| it->frame->getSequenceNumber() != occupancyFrame->getSequenceNumber()))
+	{
+		++it;
+	}
+	// The sender stops as soon as we take delivery, but a frame it had already handed to its radio may still arrive
+	if(it == fastForwardTrains.end()) {
+		trace() << "Fast-forward train from " << occupancyFrame->getSource() << " seqNo " << occupancyFrame->getSequenceNumber()
+			<< " already delivered, ignoring occupancy frame";
+		return;
+	}
+
+	// Remove the train from the list before ACKing, because the sender may start its next train straight away
+	BoxMacTwoPacket *macFrame = it->frame;
+	BoxMacTwoSender *sender = it->sender;
+	fastForwardTrains.erase(it);
+
+	trace() << "Taking delivery of fast-forward train from " << macFrame->getSource() << " seqNo " << macFrame->getSequenceNumber();
+	collectOutput(BoxMacTwoController::OUTPUT_RECEIVED_DATA);
+	collectOutput(BoxMacTwoController::OUTPUT_FAST_FORWARD_DELIVERED);
+	idleListen = false;
+
+	// The ACK is given to the sender directly - it is transmitting occupancy frames, so could not hear one anyway
+	plotTrace() << "#MAC_SEND_ACK";
+	collectOutput(BoxMacTwoController::OUTPUT_SENT_ACK);
+	sender->fastForwardTrainAcked(SELF_MAC_ADDRESS, macFrame->getSequenceNumber(), rssi);
+
+	if(isNotDuplicatePacket(macFrame))
+	{
+		plotTrace() << "#MAC_REC_UNICAST";
+		toNetworkLayer(decapsulatePacket(macFrame));
+	}
+	else
+	{
+		plotTrace() << "#MAC_REC_UNICAST_DUP";
+		trace() << "Not passing duplicate packet " << macFrame->getSequenceNumber() << 
+			" from node " << macFrame->getSource() << " up to network layer";
+	}
+	delete macFrame;
+}
+
+void BoxMacTwoController::validateFastForwardDelivery(BoxMacTwoPacket *macFrame)
+{
+	for(std::list<FastForwardTrain_t>::iterator it = fastForwardTrains.begin(); it != fastForwardTrains.end(); ++it)
+	{
+		if(it->isValidationOnly && it->frame->getSource() == macFrame->getSource()
+			&& it->frame->getSequenceNumber() == macFrame->getSequenceNumber())
+		{
+			// Fast-forward mode takes delivery (deliverFastForwardTrain) when we receive an occupancy frame, which is 
+			// at the end of the one on air when this copy was received. Occupancy frames are back to back from the
+			// start of the train
+			double framesSent = ceil((simTime() - it->trainStart).dbl() / it->occupancyFrameDuration.dbl());
+			simtime_t fastForwardDeliveryTime = it->trainStart + it->occupancyFrameDuration * std::max(framesSent, 1.0);
+			if(fastForwardDeliveryTime > it->trainEnd) {
+				// The train would have ended before that occupancy frame was received
+				collectOutput(BoxMacTwoController::OUTPUT_FAST_FORWARD_MISSED_DELIVERY);
+			}
+			else {
+				collectHistogram(BoxMacTwoController::OUTPUT_FAST_FORWARD_DELIVERY_TIME_ERROR, 
+					(fastForwardDeliveryTime - simTime()).dbl());
+			}
+			delete it->frame;
+			fastForwardTrains.erase(it);
+			return;
+		}
+	}
+}
+
+void BoxMacTwoController::removeExpiredFastForwardTrains()
+{
+	std::list<FastForwardTrain_t>::iterator it = fastForwardTrains.begin();
+	while(it != fastForwardTrains.end())
+	{
+		if(it->trainEnd < simTime())
+		{
+			delete it->frame;
+			it = fastForwardTrains.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void BoxMacTwoController::clearFastForwardTrains()
+{
+	while(!fastForwardTrains.empty()) {
+		delete fastForwardTrains.front().frame;
+		fastForwardTrains.pop_front();
+	}
+}
+
+void BoxMacTwoController::setTxPowerForFrameTo(int destination)
+{
+	Enter_Method_Silent();
+
+	if(!txPowerControl.isEnabled()) {
+		return;
+	}
+
+	double txPower = txPowerControl.getTxPower(destination, destination == BROADCAST_MAC_ADDRESS);
+	if(txPowerControl.radioPowerNeedsChanging(txPower))
+	{
+		trace() << "Setting TX power to " << txPower << "dBm";
+		toRadioLayer(createRadioCommand(SET_TX_OUTPUT, txPower));
+	}
+	if(destination != BROADCAST_MAC_ADDRESS) {
+		collectOutput(OUTPUT_TX_POWER, (std::to_string((int)txPower) + "dBm").c_str());
+	}
+}
+
+void BoxMacTwoController::recordUnicastTrainOutcome(int destination, bool isAcked, double ackedFrameRssi)
+{
+	// How many copies a train takes to be ACKed depends on when the destination wakes up, not on the link, so the
+	// level is chosen from the RSSI of the copy which got through
+	if(!txPowerControl.isEnabled()) {
+		return;
+	}
+	if(isAcked) {
+		txPowerControl.recordAckedRssi(destination, ackedFrameRssi);
+	}
+	else {
+		txPowerControl.recordFailure(destination);
+	}
+}
+
 void BoxMacTwoController::finishSpecific()
 {
-	
+	clearFastForwardTrains();
 }
\ No newline at end of file
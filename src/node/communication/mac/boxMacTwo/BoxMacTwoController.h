@@ -1,6 +1,8 @@
 #ifndef _BOXMACTWOCONTROLLER_H_
 #define _BOXMACTWOCONTROLLER_H_
 
+#include <list>
+#include <set>
 // Header for the virtual base Castalia MAC module 
 #include "VirtualMac.h"
 #include "BoxMacControlMessage_m.h"
@@ -8,6 +10,8 @@
 #include "CcaControlMessage_m.h"
 #include "SenderControlMessage_m.h"
 #include "RoutingControlMessage_m.h"
+#include "TxPowerControl.h"
+#include "PacketPriority.h"
 
 enum boxMacState {
 	BOX_MAC_STATE_STARTUP = 1,
@@ -25,6 +29,19 @@ enum boxMacControllerTimers {
 	BOX_MAC_TIMER_LISTEN_PERIOD = 2
 };
 
+class BoxMacTwoSender;
+
+// A unicast train addressed to this node which a neighbour's Sender has registered with us in fast-forward 
+// (or fast-forward validation) mode
+struct FastForwardTrain_t {
+	BoxMacTwoPacket *frame;
+	BoxMacTwoSender *sender;
+	simtime_t trainStart;
+	simtime_t trainEnd;
+	simtime_t occupancyFrameDuration;	// Airtime of each occupancy frame, which are sent back to back from trainStart
+	bool isValidationOnly;
+};
+
 class BoxMacTwoController : public VirtualMac
 {
 	private:
@@ -33,6 +50,7 @@ class BoxMacTwoController : public VirtualMac
 
 		double sleepTime;					// in ms
 		double receivePeriodAfterCcaBusy;		// in ms
+		bool earlySleepAfterFalseWakeup;
 		int ackFrameSizeBits;
 		int dataFrameSizeBits;
 
@@ -44,19 +62,39 @@ class BoxMacTwoController : public VirtualMac
 		static const char *OUTPUT_SENT_ACK;
 		static const char *OUTPUT_IDLE_LISTENING;
 		static const char *OUTPUT_TOTAL_SLEEP_DURATION;
+		static const char *OUTPUT_EARLY_SLEEP;
+		static const char *OUTPUT_FAST_FORWARD_DELIVERED;
+		static const char *OUTPUT_FAST_FORWARD_DELIVERY_TIME_ERROR;
+		static const char *OUTPUT_FAST_FORWARD_MISSED_DELIVERY;
+		static const char *OUTPUT_TX_POWER;
 
 		int boxMacState;
 		simtime_t sleepTimerTimeLeft;
 		bool isSleepTimerPaused;
 		bool idleListen;
 		double sleepStartedAt;
+		// Broadcasts heard in this listening period from the node whose broadcast train we are in, used to tell when
+		// we have heard every broadcast coalesced into the train
+		int broadcastTrainSource;
+		std::set<unsigned int> broadcastTrainSequenceNumbers;
+		std::list<FastForwardTrain_t> fastForwardTrains;
+		// Per-neighbour TX power, chosen from the RSSI reported in ACKs of unicast trains to each neighbour
+		TxPowerControl txPowerControl;
 
 		//=========== Private member functions ===========
 		void startCcaPolling();
 		void signalSenderOkayToSend();
 		void signalSenderNotOkayToSend();
+		void endListenPeriod();
+		void endListenPeriodEarly();
+		bool hasHeardWholeBroadcastTrain(BoxMacTwoPacket *macFrame);
 		void changeState(int newState);
 		void recordSleepDurationStats();
+		void deliverFastForwardTrain(BoxMacTwoPacket *occupancyFrame, double rssi);
+		void validateFastForwardDelivery(BoxMacTwoPacket *macFrame);
+		void removeExpiredFastForwardTrains();
+		void clearFastForwardTrains();
+		void recordUnicastTrainOutcome(int destination, bool isAcked, double ackedFrameRssi);
 
 	protected:
 
@@ -68,6 +106,17 @@ class BoxMacTwoController : public VirtualMac
 		int handleControlCommand(cMessage *msg);
 		void timerFiredCallback(int index);
 		void handleOutOfEnergy(cMessage *outOfEnergyMsg);
+
+	public:
+
+		// Called directly by a neighbour's BoxMacTwoSender when it starts a fast-forward unicast train addressed to us.
+		// We take ownership of the frame.
+		void fastForwardTrainStarted(BoxMacTwoPacket *frame, BoxMacTwoSender *sender, simtime_t trainEnd, 
+			simtime_t occupancyFrameDuration, bool isValidationOnly);
+
+		// Called directly by our Sender just before it sends a frame, so that the radio is set to the right TX power 
+		// before the frame reaches it. Does nothing unless TX power control is enabled
+		void setTxPowerForFrameTo(int destination);
 };
 
 #endif //_BOXMACTWOCONTROLLER_H_
\ No newline at end of file
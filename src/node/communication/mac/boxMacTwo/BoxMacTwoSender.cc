@@ -11,23 +11,40 @@ const char * BoxMacTwoSender::OUTPUT_BACKOFF_CONGESTION = "BoxMac Backoff conges
 const char * BoxMacTwoSender::OUTPUT_MSG_NOT_ACKED = "BoxMac Msg not acked";
 const char * BoxMacTwoSender::OUTPUT_MESSAGES_IN_UNICAST_MESSAGE_TRAIN = "BoxMac Messages in unicast train";
 const char * BoxMacTwoSender::OUTPUT_UNICAST_MESSAGE_TRAIN_DURATION = "BoxMac Message train duration";
+const char * BoxMacTwoSender::OUTPUT_COALESCED_BROADCASTS = "BoxMac Coalesced broadcasts";
+const char * BoxMacTwoSender::OUTPUT_PRIORITY_DROP = "BoxMac Priority drop";
 
 void BoxMacTwoSender::initialize()
 {
 	// Store NED parameters
-	initialBackoffMin = par("initialBackoffMin");
-	initialBackoffRange = par("initialBackoffMax").doubleValue() - par("initialBackoffMin").doubleValue();
-	congestionBackoffMin = par("congestionBackoffMin");
-	congestionBackoffRange = par("congestionBackoffMax").doubleValue() - par("congestionBackoffMin").doubleValue();
-	maxMessageBufferSize = par("maxMessageBufferSize");
-	interTransmissionAckReceiveDelay = par("interTransmissionAckReceiveDelay");
-	interTransmissionBroadcastDelay = par("interTransmissionBroadcastDelay");
-	waitForRxTransitionDelayTime = par("waitForRxTransitionDelayTime");
+	BoxMacTwoSenderParameters parameters;
+	parameters.initialBackoffMin = par("initialBackoffMin");
+	parameters.initialBackoffMax = par("initialBackoffMax");
+	parameters.congestionBackoffMin = par("congestionBackoffMin");
+	parameters.congestionBackoffMax = par("congestionBackoffMax");
+	parameters.maxMessageBufferSize = par("maxMessageBufferSize");
+	parameters.interTransmissionAckReceiveDelay = par("interTransmissionAckReceiveDelay");
+	parameters.interTransmissionBroadcastDelay = par("interTransmissionBroadcastDelay");
+	parameters.waitForRxTransitionDelayTime = par("waitForRxTransitionDelayTime");
+	parameters.fastForwardUnicastTrains = par("fastForwardUnicastTrains");
+	parameters.validateFastForwardTrains = par("validateFastForwardTrains");
+	parameters.phyDataRate = par("phyDataRate");
+	parameters.coalesceBroadcastTrains = par("coalesceBroadcastTrains");
+	parameters.lplWakeIntervalSendPadding = par("lplWakeIntervalSendPadding");
+	parameters.packetPriorities = par("packetPriorities");
+	parameters.priorityBackoffScale = par("priorityBackoffScale");
+
+	// The validation switch runs the full model, so it overrides fast-forward mode
+	if(parameters.validateFastForwardTrains) {
+		parameters.fastForwardUnicastTrains = false;
+	}
 
 	// We need to get the sleepTime parameter from the controller, add the padding and 
 	// use this as the total transmission-train time such that the repeated transmissions cover a whole sleep interval plus a margin
-	transmissionTimeToOverlapLplWakeInterval = getParentModule()->getSubmodule("Controller")->par("sleepTime").doubleValue()
-	+ par("lplWakeIntervalSendPadding").doubleValue();
+	parameters.sleepTime = getParentModule()->getSubmodule("Controller")->par("sleepTime");
+
+	// Use the block shared by all nodes with this configuration. Derived timings are calculated once, here
+	params = &BoxMacTwoSenderParameters::getSharedInstance(parameters);
 
 	// Initialise variables
 	initialisePrivateVariables();
@@ -64,15 +81,52 @@ void BoxMacTwoSender::initialize()
 		opp_error("Error getting a valid reference to radio module");
 	}
 
+	controller = check_and_cast <BoxMacTwoController*>(getParentModule()->getSubmodule("Controller"));
+
 	// Set the timer drift for the timer service. If we do not do this all timers will return immediately!
 	setTimerDrift(resMgrModule->getCPUClockDrift());
 
+	// A fast-forward train is sent as back to back occupancy frames, one every copy interval of the full model
+	// (phyDataRate is in kbps). The Radio adds phyFrameOverhead to each frame, so take it off here: a frame's airtime
+	// must not exceed the interval, otherwise frames would pile up in the Radio's buffer and outlast the train.
+	// The Radio also drops frames longer than its maxPhyFrameSize, which would leave the channel silent, so check they fit
+	fastForwardFrameBits = 0;
+	if(params->fastForwardUnicastTrains)
+	{
+		int maxPhyFrameSize = radioModule->par("maxPhyFrameSize");
+		int phyFrameOverhead = radioModule->par("phyFrameOverhead");
+		fastForwardFrameBits = (int64)floor(params->interTransmissionAckReceiveDelay * params->phyDataRate * 1000) - phyFrameOverhead * 8;
+		if(fastForwardFrameBits <= 0) {
+			opp_error("BoxMacTwoSender: interTransmissionAckReceiveDelay is too short to send fast-forward occupancy frames "
+				"(it must be longer than the Radio's phyFrameOverhead at phyDataRate)");
+		}
+		if(fastForwardFrameBits / 8 + phyFrameOverhead > maxPhyFrameSize) {
+			opp_error("BoxMacTwoSender: fast-forward occupancy frames of %d bytes (interTransmissionAckReceiveDelay at phyDataRate, "
+				"including PHY overhead) do not fit the Radio's maxPhyFrameSize of %d bytes",
+				(int)(fastForwardFrameBits / 8 + phyFrameOverhead), maxPhyFrameSize);
+		}
+	}
+
+	collectPacketJourneys = par("collectPacketJourneys");
+	if(collectPacketJourneys) {
+		PacketJourney::open();
+	}
+	nodeId = getParentModule() // MAC module
+		->getParentModule() // Communication module
+		->getParentModule() // Node module
+		->getIndex();
+	if(params->packetPriorities) {
+		priorityScheduler.initialise(par("priorityScheduling"), par("priorityWeights"));
+	}
+
 	// Declare outputs
 	declareOutput(OUTPUT_SENT_UNICAST);
 	declareOutput(OUTPUT_SENT_BROADCAST);
 	declareOutput(OUTPUT_BACKOFF_INITIAL);
 	declareOutput(OUTPUT_BACKOFF_CONGESTION);
 	declareOutput(OUTPUT_MSG_NOT_ACKED);
+	declareOutput(OUTPUT_COALESCED_BROADCASTS);
+	declareOutput(OUTPUT_PRIORITY_DROP);
 	declareHistogram(OUTPUT_UNICAST_MESSAGE_TRAIN_DURATION, 0, 0.6, 20);
 	declareHistogram(OUTPUT_MESSAGES_IN_UNICAST_MESSAGE_TRAIN, 0, 100, 20);
 }
@@ -85,6 +139,7 @@ void BoxMacTwoSender::initialisePrivateVariables()
 	hasSendingLplWakeIntervalExpired = false;
 	countNumberOfMessagesSentInTrain = 0;
 	trainStartTime = -1;
+	nextBroadcastCopyIndex = 0;
 }
 
 void BoxMacTwoSender::handleMessage(cMessage *msg)
@@ -127,6 +182,9 @@ void BoxMacTwoSender::handleMessage(cMessage *msg)
 						cancelTimer(BOX_MAC_SENDER_TIMER_LPL_WAKE_INTERVAL);
 						cancelTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY);
 						cancelTimer(BOX_MAC_SENDER_TIMER_BACKOFF);
+						cancelTimer(BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY);
+						// The train will be restarted from scratch, so put back any broadcasts it was carrying
+						returnCoalescedBroadcastsToQueue();
 						changeState(BOX_MAC_SENDER_STATE_IDLE);
 					}
 					else{
@@ -151,7 +209,8 @@ void BoxMacTwoSender::handleMessage(cMessage *msg)
 				case BOX_MAC_FRAME_TYPE_DATA: {
 					trace() << "Received data packet for transmission to " << macFrame->getDestination();
 
-					if(sendQueue.size() >= maxMessageBufferSize)
+					if(sendQueue.size() + coalescedBroadcasts.size() >= params->maxMessageBufferSize
+						&& !(params->packetPriorities && dropLowerPriorityBroadcast(PacketPriority::of(macFrame))))
 					{
 						trace() << "WARNING: send buffer full, discarding packet";
 						plotTrace() << "#MAC_BUFFER_OVERFLOW";
@@ -161,6 +220,9 @@ void BoxMacTwoSender::handleMessage(cMessage *msg)
 					{
 						// Add to the queue
 						//plotTrace() << "#MAC_BUFFERED";
+						if(collectPacketJourneys) {
+							PacketJourney::stamp(macFrame, nodeId, PacketJourney::MAC_ENQUEUE);
+						}
 						sendQueue.push(macFrame);
 						trace() << "Added to queue - queue size now " << sendQueue.size();
 					}
@@ -194,6 +256,9 @@ void BoxMacTwoSender::handleMessage(cMessage *msg)
 						{
 							collectUnicastMessageTrainStats();
 						}
+						if(collectPacketJourneys) {
+							PacketJourney::stamp(sendQueue.front(), nodeId, PacketJourney::MAC_ACK);
+						}
 
 						// Cancel running transmission timers for this current message train
 						cancelTimer(BOX_MAC_SENDER_TIMER_LPL_WAKE_INTERVAL);
@@ -253,6 +318,12 @@ void BoxMacTwoSender::startSendingNextMessageTrainInQueue()
 	}
 	else
 	{
+		// Choose which packet the train is for, unless one is already part way through (only when going from idle or
+		// after the last train has finished)
+		if(params->packetPriorities && (sendState == BOX_MAC_SENDER_STATE_IDLE || sendState == BOX_MAC_SENDER_STATE_START_NEXT_TRAIN)) {
+			moveNextPriorityPacketToFront();
+		}
+
 		//trace() << "Queue size " << sendQueue.size() << ", so signalling controller that we're going to send";
 		// Signal the controller that we're sending
 		BoxMacControlMessage *sendingMsg = new BoxMacControlMessage("Mac control command", MAC_CONTROL_COMMAND); 
@@ -283,6 +354,11 @@ void BoxMacTwoSender::advanceMessageSendState()
 				{
 					collectOutput(OUTPUT_SENT_BROADCAST);
 					plotTrace() << "#MAC_SEND_BROADCAST";
+
+					// Take any other queued broadcasts along in this train
+					if(params->coalesceBroadcastTrains) {
+						coalesceQueuedBroadcasts();
+					}
 				}
 				else
 				{
@@ -293,8 +369,8 @@ void BoxMacTwoSender::advanceMessageSendState()
 				//trace() << "State: Starting the next message train";
 				// Set a timer for the total transmission-train time allowed for the train
 				hasSendingLplWakeIntervalExpired = false; // Reset the timer expired flag in case it has been set on an earlier transmission
-				//trace() << "Setting total LP period send timer to " << transmissionTimeToOverlapLplWakeInterval;
-				setTimer(BOX_MAC_SENDER_TIMER_LPL_WAKE_INTERVAL, transmissionTimeToOverlapLplWakeInterval);
+				//trace() << "Setting total LP period send timer to " << params->transmissionTimeToOverlapLplWakeInterval();
+				setTimer(BOX_MAC_SENDER_TIMER_LPL_WAKE_INTERVAL, params->transmissionTimeToOverlapLplWakeInterval());
 				// Now we can send the first message in the train. Set the state
 				changeState(BOX_MAC_SENDER_STATE_START_NEXT_MSG_IN_TRAIN);
 				// and call this function again
@@ -312,7 +388,7 @@ void BoxMacTwoSender::advanceMessageSendState()
 					// Do initial backoff
 					collectOutput(BoxMacTwoSender::OUTPUT_BACKOFF_INITIAL);
 				
-					double initialBackoffTime = initialBackoffMin + dblrand() * initialBackoffRange;
+					double initialBackoffTime = params->initialBackoffMin + dblrand() * getBackoffRange(params->initialBackoffRange());
 					//plotTrace() << "#MAC_BACKOFF_I Doing initial backoff for " << initialBackoffTime << " sim time";
 					//trace() << "Setting initial backoff timer for " << initialBackoffTime;
 					setTimer(BOX_MAC_SENDER_TIMER_BACKOFF, initialBackoffTime);
@@ -347,6 +423,8 @@ void BoxMacTwoSender::advanceMessageSendState()
 					else
 					{
 						trace() << "State: Finished broadcasting message";
+						// Any broadcasts which shared the train have been sent too
+						deleteCoalescedBroadcasts();
 					}
 
 					// Remove the message from the queue and delete it. We're done with it.
@@ -374,10 +452,37 @@ void BoxMacTwoSender::advanceMessageSendState()
 					case CLEAR:{
 
 						BoxMacTwoPacket *packetToSend = sendQueue.front();
+
+						// A broadcast train may be carrying several broadcasts, which take it in turns
+						if(packetToSend->getDestination() == BROADCAST_MAC_ADDRESS) {
+							packetToSend = getNextBroadcastCopyToSend();
+						}
+
+						// In fast-forward mode the whole unicast train is simulated as one occupied-channel interval
+						if(params->fastForwardUnicastTrains && packetToSend->getDestination() != BROADCAST_MAC_ADDRESS)
+						{
+							startFastForwardTrain(packetToSend);
+							break;
+						}
+
+						// When validating fast-forward mode, let the destination know about the train at its first copy (when
+						// fast-forward mode would start sending occupancy frames), so it can compare the delivery times
+						if(params->validateFastForwardTrains && packetToSend->getDestination() != BROADCAST_MAC_ADDRESS
+							&& countNumberOfMessagesSentInTrain == 0)
+						{
+							getControllerOfNode(packetToSend->getDestination())->fastForwardTrainStarted(packetToSend->dup(), this,
+								trainStartTime + params->transmissionTimeToOverlapLplWakeInterval() + params->interTransmissionAckReceiveDelay, 
+								params->interTransmissionAckReceiveDelay, true);
+						}
+
 						trace() << "CCA clear. Transmitting BoxMac packet type " << packetToSend->getFrameType()
 							<< " seqNo " << packetToSend->getSequenceNumber() << " to " << packetToSend->getDestination();
 						// Send a DUPLICATE of the next message in the queue to the radio. We need to send
 						// duplicates because we will need to send multiple times. 
+						controller->setTxPowerForFrameTo(packetToSend->getDestination());
+						if(collectPacketJourneys) {
+							PacketJourney::stamp(packetToSend, nodeId, PacketJourney::MAC_FIRST_TX);
+						}
 						send(packetToSend->dup(), "toBoxMacController");
 
 						// THEN turn the radio to TX mode so it sends the message (it will automatically turn back to RX after send)
@@ -393,12 +498,12 @@ void BoxMacTwoSender::advanceMessageSendState()
 						// If this is a broadcast transmission, we wait a short time as we are not listening for an ACK
 						if(packetToSend->getDestination() == BROADCAST_MAC_ADDRESS) 
 						{
-							setTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY, interTransmissionBroadcastDelay);
+							setTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY, params->interTransmissionBroadcastDelay);
 						}
 						// Otherwise it is unicast - we wait a longer period as we are listening for an ACK
 						else 
 						{					
-							setTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY, interTransmissionAckReceiveDelay);
+							setTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY, params->interTransmissionAckReceiveDelay);
 						}
 						
 						changeState(BOX_MAC_SENDER_STATE_TRANSMITTING);
@@ -415,7 +520,7 @@ void BoxMacTwoSender::advanceMessageSendState()
 						//plotTrace() << "#MAC_CANT_SEND_CCA_BUSY";
 
 						collectOutput(BoxMacTwoSender::OUTPUT_BACKOFF_CONGESTION);				
-						double congestionBackoffTime = congestionBackoffMin + dblrand() * congestionBackoffRange;
+						double congestionBackoffTime = params->congestionBackoffMin + dblrand() * getBackoffRange(params->congestionBackoffRange());
 						//plotTrace() << "#MAC_BACKOFF_C CCA busy. Doing congestion backoff for " << congestionBackoffTime << " sim time";
 						setTimer(BOX_MAC_SENDER_TIMER_BACKOFF, congestionBackoffTime);
 						changeState(BOX_MAC_SENDER_STATE_BACKING_OFF_CONGESTION);
@@ -427,7 +532,7 @@ void BoxMacTwoSender::advanceMessageSendState()
 					// CS_NOT_VALID means that the radio is not in RX. Shouldn't happen!
 					case CS_NOT_VALID: {
 						trace() << "WARNING - Polled CCA, but radio not in RX mode. This will happen if the controller happens to be in the middle of sending an ACK. Okay as long as it doesn't happen a lot";
-						setTimer(BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY, waitForRxTransitionDelayTime);
+						setTimer(BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY, params->waitForRxTransitionDelayTime);
 						changeState(BOX_MAC_SENDER_STATE_WAITING_FOR_RX_TRANSITION_DELAY);
 						break;
 					}
@@ -435,7 +540,7 @@ void BoxMacTwoSender::advanceMessageSendState()
 					// CS_NOT_VALID_YET means we are in RX, just not long enough
 					case CS_NOT_VALID_YET:{
 						trace() << "WARNING - Polled CCA, but radio not in RX mode for long enough. This may be because the backoff was quite short. Probably okay as long as it doesn't happen a lot";
-						setTimer(BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY, waitForRxTransitionDelayTime);
+						setTimer(BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY, params->waitForRxTransitionDelayTime);
 						changeState(BOX_MAC_SENDER_STATE_WAITING_FOR_RX_TRANSITION_DELAY);
 						break;
 					}
@@ -495,12 +600,290 @@ void BoxMacTwoSender::timerFiredCallback(int index)
 			break;
 		}
 
+		case BOX_MAC_SENDER_TIMER_FAST_FORWARD_FRAME: {
+			// The last occupancy frame has been sent. Keep the channel occupied until the train would have ended
+			if(!hasSendingLplWakeIntervalExpired)
+			{
+				sendFastForwardFrame();
+				setTimer(BOX_MAC_SENDER_TIMER_FAST_FORWARD_FRAME, params->interTransmissionAckReceiveDelay);
+			}
+			// Then wait for the destination to take delivery of the last one. If it doesn't, when this timer fires
+			// advanceMessageSendState will report the send as failed, exactly as in the full model
+			else
+			{
+				setTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY, params->interTransmissionAckReceiveDelay);
+			}
+			break;
+		}
+
 		default: {
 			opp_error("Unknown timer type");
 		}
 	}
 }
 
+void BoxMacTwoSender::coalesceQueuedBroadcasts()
+{
+	// Move every broadcast behind the front of the queue into coalescedBroadcasts,
+	// keeping the order of everything else in the queue
+	std::queue<BoxMacTwoPacket*> remainingQueue;
+	remainingQueue.push(sendQueue.front());
+	sendQueue.pop();
+
+	while(!sendQueue.empty())
+	{
+		BoxMacTwoPacket *pkt = sendQueue.front();
+		sendQueue.pop();
+		if(pkt->getDestination() == BROADCAST_MAC_ADDRESS)
+		{
+			coalescedBroadcasts.push_back(pkt);
+			collectOutput(OUTPUT_SENT_BROADCAST);
+			collectOutput(OUTPUT_COALESCED_BROADCASTS);
+		}
+		else
+		{
+			remainingQueue.push(pkt);
+		}
+	}
+	sendQueue = remainingQueue;
+	nextBroadcastCopyIndex = 0;
+
+	if(!coalescedBroadcasts.empty()) {
+		trace() << "Coalesced " << coalescedBroadcasts.size() << " queued broadcasts into this broadcast train";
+	}
+}
+
+void BoxMacTwoSender::moveNextPriorityPacketToFront()
+{
+	// Broadcasts which are coalesced into the train are taken from behind the front afterwards, whatever their class
+	unsigned int waitingClasses = 0;
+	std::queue<BoxMacTwoPacket*> remainingQueue = sendQueue;
+	while(!remainingQueue.empty())
+	{
+		waitingClasses |= PriorityScheduler::bit(PacketPriority::of(remainingQueue.front()));
+		remainingQueue.pop();
+	}
+
+	int priorityClass = priorityScheduler.choose(waitingClasses);
+	priorityScheduler.charge(priorityClass, waitingClasses);
+	if(PacketPriority::of(sendQueue.front()) == priorityClass) {
+		return;
+	}
+
+	// Move the first packet of the class to the front, keeping the order of everything else in the queue
+	BoxMacTwoPacket *nextPkt = NULL;
+	while(!sendQueue.empty())
+	{
+		BoxMacTwoPacket *pkt = sendQueue.front();
+		sendQueue.pop();
+		if(nextPkt == NULL && PacketPriority::of(pkt) == priorityClass) {
+			nextPkt = pkt;
+		}
+		else {
+			remainingQueue.push(pkt);
+		}
+	}
+	sendQueue.push(nextPkt);
+	while(!remainingQueue.empty())
+	{
+		sendQueue.push(remainingQueue.front());
+		remainingQueue.pop();
+	}
+	trace() << "Next train is for a packet of priority class " << priorityClass;
+}
+
+bool BoxMacTwoSender::dropLowerPriorityBroadcast(int priorityClass)
+{
+	// Makes room for a packet of the given class by dropping the newest queued broadcast of the lowest class below it.
+	// Unicasts are not dropped, as the routing layer is waiting for the outcome of each one. Nor is the packet at the
+	// front of the queue if its train has started
+	BoxMacTwoPacket *droppedPkt = NULL;
+	int droppedClass = priorityClass;
+	std::queue<BoxMacTwoPacket*> remainingQueue = sendQueue;
+	bool isFront = true;
+	while(!remainingQueue.empty())
+	{
+		BoxMacTwoPacket *pkt = remainingQueue.front();
+		remainingQueue.pop();
+		bool isInTrain = isFront && sendState != BOX_MAC_SENDER_STATE_IDLE;
+		isFront = false;
+		if(!isInTrain && pkt->getDestination() == BROADCAST_MAC_ADDRESS && PacketPriority::of(pkt) <= droppedClass
+			&& PacketPriority::of(pkt) < priorityClass)
+		{
+			droppedPkt = pkt;
+			droppedClass = PacketPriority::of(pkt);
+		}
+	}
+	if(droppedPkt == NULL) {
+		return false;
+	}
+
+	while(!sendQueue.empty())
+	{
+		BoxMacTwoPacket *pkt = sendQueue.front();
+		sendQueue.pop();
+		if(pkt != droppedPkt) {
+			remainingQueue.push(pkt);
+		}
+	}
+	sendQueue = remainingQueue;
+
+	trace() << "Send buffer full, dropping broadcast of priority class " << droppedClass << " to make room for priority class " << priorityClass;
+	collectOutput(OUTPUT_PRIORITY_DROP, droppedClass);
+	cancelAndDelete(droppedPkt);
+	return true;
+}
+
+double BoxMacTwoSender::getBackoffRange(double range)
+{
+	// With packet priorities, higher classes back off within a smaller part of the range, so usually win contention
+	if(params->packetPriorities) {
+		return range * pow(params->priorityBackoffScale, PacketPriority::of(sendQueue.front()));
+	}
+	return range;
+}
+
+void BoxMacTwoSender::returnCoalescedBroadcastsToQueue()
+{
+	if(coalescedBroadcasts.empty() || sendQueue.empty()) {
+		return;
+	}
+
+	// Put them back directly behind the front of the queue, where they will be picked up again when the train restarts
+	std::queue<BoxMacTwoPacket*> restoredQueue;
+	restoredQueue.push(sendQueue.front());
+	sendQueue.pop();
+	for(std::vector<BoxMacTwoPacket*>::iterator it = coalescedBroadcasts.begin(); it != coalescedBroadcasts.end(); ++it) {
+		restoredQueue.push(*it);
+	}
+	while(!sendQueue.empty())
+	{
+		restoredQueue.push(sendQueue.front());
+		sendQueue.pop();
+	}
+	sendQueue = restoredQueue;
+	coalescedBroadcasts.clear();
+	nextBroadcastCopyIndex = 0;
+}
+
+void BoxMacTwoSender::deleteCoalescedBroadcasts()
+{
+	for(std::vector<BoxMacTwoPacket*>::iterator it = coalescedBroadcasts.begin(); it != coalescedBroadcasts.end(); ++it) {
+		cancelAndDelete(*it);
+	}
+	coalescedBroadcasts.clear();
+	nextBroadcastCopyIndex = 0;
+}
+
+BoxMacTwoPacket *BoxMacTwoSender::getNextBroadcastCopyToSend()
+{
+	// Index 0 is the message at the front of the queue, the rest are the coalesced broadcasts
+	BoxMacTwoPacket *pkt = (nextBroadcastCopyIndex == 0) ? sendQueue.front() : coalescedBroadcasts[nextBroadcastCopyIndex - 1];
+	nextBroadcastCopyIndex = (nextBroadcastCopyIndex + 1) % (coalescedBroadcasts.size() + 1);
+	pkt->setCoalescedBroadcasts(coalescedBroadcasts.size() + 1);
+	return pkt;
+}
+
+void BoxMacTwoSender::startFastForwardTrain(BoxMacTwoPacket *packetToSend)
+{
+	// The rest of the train is sent as back to back occupancy frames, one for each copy interval of the full model,
+	// without the backoffs, CCA checks and ACK waits in between. Neighbours waking up during the train see a busy
+	// channel and receive the frames (with the usual losses and collisions), as they would the copies of the full train
+	trace() << "CCA clear. Fast-forwarding unicast train for seqNo " << packetToSend->getSequenceNumber()
+		<< " to " << packetToSend->getDestination();
+
+	// Register the train with the destination. It takes delivery when it receives one of the occupancy frames before
+	// the train ends, and calls fastForwardTrainAcked
+	simtime_t trainEnd = trainStartTime + params->transmissionTimeToOverlapLplWakeInterval() + params->interTransmissionAckReceiveDelay;
+	getControllerOfNode(packetToSend->getDestination())->fastForwardTrainStarted(packetToSend->dup(), this, trainEnd, 
+		params->interTransmissionAckReceiveDelay, false);
+
+	if(collectPacketJourneys) {
+		PacketJourney::stamp(packetToSend, nodeId, PacketJourney::MAC_FIRST_TX);
+	}
+	sendFastForwardFrame();
+	setTimer(BOX_MAC_SENDER_TIMER_FAST_FORWARD_FRAME, params->interTransmissionAckReceiveDelay);
+	changeState(BOX_MAC_SENDER_STATE_TRANSMITTING);
+}
+
+void BoxMacTwoSender::sendFastForwardFrame()
+{
+	// Fast-forward trains are only for unicasts, so the train's packet is always the one at the front of the queue
+	BoxMacTwoPacket *occupancyFrame = sendQueue.front()->dup();
+	occupancyFrame->setIsFastForwardOccupancy(true);
+	// The length is fixed, whatever the packet's own length, so that the frame's airtime is exactly one copy interval
+	occupancyFrame->setBitLength(fastForwardFrameBits);
+
+	controller->setTxPowerForFrameTo(occupancyFrame->getDestination());
+	send(occupancyFrame, "toBoxMacController");
+	RadioControlCommand *txCmd = new RadioControlCommand("Radio control command", RADIO_CONTROL_COMMAND);
+	txCmd->setRadioControlCommandKind(SET_STATE);
+	txCmd->setState(TX);
+	send(txCmd, "toBoxMacController");
+
+	// For stats collection: each occupancy frame stands for one copy of the full model
+	countNumberOfMessagesSentInTrain++;
+}
+
+void BoxMacTwoSender::fastForwardTrainAcked(int destination, unsigned int sequenceNumber, double rssi)
+{
+	Enter_Method_Silent();
+
+	// We may have since run out of energy, or given up on the train - in which case the ACK is too late
+	if(sendState != BOX_MAC_SENDER_STATE_TRANSMITTING || sendQueue.empty() 
+		|| sendQueue.front()->getDestination() != destination || sendQueue.front()->getSequenceNumber() != sequenceNumber)
+	{
+		trace() << "WARNING - fast-forward train to " << destination << " was ACKed but is no longer being sent. Ignoring";
+		return;
+	}
+
+	trace() << "Fast-forward train was ACKed by " << destination;
+	plotTrace() << "#MAC_REC_ACK";
+
+	// Let the controller inform the network layer, as it would for a received ACK frame
+	BoxMacControlMessage *ackedMsg = new BoxMacControlMessage("Mac control command", MAC_CONTROL_COMMAND); 
+	ackedMsg->setMacControlCommandKind(SENDING_ACKED_FAST_FORWARD);
+	ackedMsg->setValue(destination);
+	ackedMsg->setRssi(rssi);
+	send(ackedMsg, "toBoxMacController");
+
+	if(collectPacketJourneys) {
+		PacketJourney::stamp(sendQueue.front(), nodeId, PacketJourney::MAC_ACK);
+	}
+
+	// The rest is the same as receiving an ACK frame. No more occupancy frames are sent: the one the destination
+	// received has finished, and at most the next one (one copy interval) is still with the radio
+	collectUnicastMessageTrainStats();
+	cancelTimer(BOX_MAC_SENDER_TIMER_LPL_WAKE_INTERVAL);
+	cancelTimer(BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY);
+	cancelTimer(BOX_MAC_SENDER_TIMER_FAST_FORWARD_FRAME);
+	cancelAndDelete(sendQueue.front());
+	sendQueue.pop();
+	changeState(BOX_MAC_SENDER_STATE_START_NEXT_TRAIN);
+	startSendingNextMessageTrainInQueue();
+}
+
+BoxMacTwoController *BoxMacTwoSender::getControllerOfNode(int nodeId)
+{
+	// MAC addresses are node indexes, so we can find the destination's controller directly from the network module.
+	// The destination may not be a node with a BoxMac, so check each step of the way
+	cModule *module = getParentModule()	// MAC compound module
+		->getParentModule()	// Communication module
+		->getParentModule()	// Node module
+		->getParentModule()	// Network module
+		->getSubmodule("node", nodeId);
+	const char *path[] = {"Communication", "MAC", "Controller"};
+	for(unsigned int i = 0; module && i < sizeof(path) / sizeof(path[0]); i++) {
+		module = module->getSubmodule(path[i]);
+	}
+
+	BoxMacTwoController *controller = dynamic_cast <BoxMacTwoController*>(module);
+	if(!controller) {
+		opp_error("BoxMacTwoSender: Error getting a valid reference to the BoxMac controller of node %d", nodeId);
+	}
+	return controller;
+}
+
 void BoxMacTwoSender::collectUnicastMessageTrainStats()
 {
 	collectHistogram(BoxMacTwoSender::OUTPUT_MESSAGES_IN_UNICAST_MESSAGE_TRAIN, countNumberOfMessagesSentInTrain);
@@ -533,6 +916,9 @@ void BoxMacTwoSender::changeState(int newState)
 
 void BoxMacTwoSender::clearSendQueue()
 {
+	deleteCoalescedBroadcasts();
+
+
 	// Remove any packets left in sendQueue
 	while (!sendQueue.empty()) {
 		BoxMacTwoPacket *pkt = sendQueue.front();
@@ -544,4 +930,8 @@ void BoxMacTwoSender::clearSendQueue()
 void BoxMacTwoSender::finishSpecific()
 {
 	clearSendQueue();
+
+	if(collectPacketJourneys) {
+		PacketJourney::release();
+	}
 }
\ No newline at end of file
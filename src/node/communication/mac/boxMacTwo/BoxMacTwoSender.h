@@ -2,6 +2,8 @@
 #define _BOXMACTWOSENDER_H_
 
 #include <queue>
+#include <vector>
+#include <algorithm>
 #include <math.h>       /* ceil */
 #include "CastaliaModule.h"
 #include "Radio.h"
@@ -9,6 +11,10 @@
 #include "SenderControlMessage_m.h"
 #include "BoxMacTwoPacket_m.h"
 #include "BoxMacControlMessage_m.h"
+#include "BoxMacTwoController.h"
+#include "BoxMacTwoSenderParameters.h"
+#include "PacketJourney.h"
+#include "PacketPriority.h"
 
 enum boxMacSenderControllerDirectiveType {
 	BOX_MAC_SENDER_DIRECTIVE_OKAY_TO_SEND = 1,
@@ -30,24 +36,16 @@ enum boxMacSenderTimers {
 	BOX_MAC_SENDER_TIMER_LPL_WAKE_INTERVAL = 1,
 	BOX_MAC_SENDER_TIMER_INTER_TRANSMISSION_DELAY = 2,
 	BOX_MAC_SENDER_TIMER_BACKOFF = 3,
-	BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY = 4
+	BOX_MAC_SENDER_TIMER_WAIT_FOR_RADIO_RX_TRANSITION_DELAY = 4,
+	BOX_MAC_SENDER_TIMER_FAST_FORWARD_FRAME = 5
 };
 
 class BoxMacTwoSender : public CastaliaModule, public TimerService
 {
 	private:
 		//=========== Private NED file parameters ============
-		// See NED file for comments
-
-		double initialBackoffMin;
-		double initialBackoffRange;
-		double congestionBackoffMin;
-		double congestionBackoffRange;
-		double transmissionTimeToOverlapLplWakeInterval;
-		double interTransmissionAckReceiveDelay;
-		double interTransmissionBroadcastDelay;
-		std::queue<BoxMacTwoPacket*>::size_type maxMessageBufferSize;
-		double waitForRxTransitionDelayTime;
+		// Shared by all nodes with the same configuration - see BoxMacTwoSenderParameters::getSharedInstance
+		const BoxMacTwoSenderParameters *params;
 
 		//=========== Private member variables ============
 		static const char *OUTPUT_SENT_UNICAST;
@@ -57,6 +55,8 @@ class BoxMacTwoSender : public CastaliaModule, public TimerService
 		static const char *OUTPUT_MSG_NOT_ACKED;
 		static const char *OUTPUT_MESSAGES_IN_UNICAST_MESSAGE_TRAIN;
 		static const char *OUTPUT_UNICAST_MESSAGE_TRAIN_DURATION;
+		static const char *OUTPUT_COALESCED_BROADCASTS;
+		static const char *OUTPUT_PRIORITY_DROP;
 
 		bool hasSendingLplWakeIntervalExpired;
 		int numberOfSendsDone;
@@ -66,10 +66,28 @@ class BoxMacTwoSender : public CastaliaModule, public TimerService
 		double trainStartTime;
 		std::queue<BoxMacTwoPacket*> sendQueue;
 
+		// Broadcasts taken out of the send queue to share the broadcast train of the message at the front of the queue.
+		// Copies of the front message and these are sent alternately.
+		std::vector<BoxMacTwoPacket*> coalescedBroadcasts;
+		unsigned int nextBroadcastCopyIndex;
+
 		// A pointer to the Radio module object. Used to directly call isChannelClear.
 		// See comment in startup function for explanation.
 		Radio *radioModule;
 
+		// Our own controller, which sets the radio's TX power before each frame we send
+		BoxMacTwoController *controller;
+
+		// For stamping the journeys of packets traced by the routing layer
+		bool collectPacketJourneys;
+		int nodeId;
+
+		// Chooses the priority class of the next train, with packet priorities
+		PriorityScheduler priorityScheduler;
+
+		// Length of each occupancy frame of a fast-forward train, which covers one copy interval of the full model
+		int64 fastForwardFrameBits;
+
 
 		//=========== Private member functions ===========
 		void initialisePrivateVariables();
@@ -78,6 +96,16 @@ class BoxMacTwoSender : public CastaliaModule, public TimerService
 		void finishedSending();
 		void clearSendQueue();
 		void collectUnicastMessageTrainStats();
+		BoxMacTwoController *getControllerOfNode(int nodeId);
+		void startFastForwardTrain(BoxMacTwoPacket *packetToSend);
+		void sendFastForwardFrame();
+		void coalesceQueuedBroadcasts();
+		void returnCoalescedBroadcastsToQueue();
+		void deleteCoalescedBroadcasts();
+		BoxMacTwoPacket *getNextBroadcastCopyToSend();
+		void moveNextPriorityPacketToFront();
+		bool dropLowerPriorityBroadcast(int priorityClass);
+		double getBackoffRange(double range);
 
 	protected:
 
@@ -87,6 +115,11 @@ class BoxMacTwoSender : public CastaliaModule, public TimerService
 		void handleMessage(cMessage *msg);
 		void timerFiredCallback(int index);
 		void changeState(int newState);
+
+	public:
+
+		// Called directly by the destination's BoxMacTwoController when it accepts a fast-forward train from us
+		void fastForwardTrainAcked(int destination, unsigned int sequenceNumber, double rssi);
 };
 
 #endif //_BOXMACTWOSENDER_H_
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef _BOXMACTWOSENDERPARAMETERS_H_
+#define _BOXMACTWOSENDERPARAMETERS_H_
+
+#include <list>
+
+// Sender parameters which are the same for every node using the same configuration. BoxMacTwoSender fills one in
+// from its NED parameters and swaps it for the shared, immutable block returned by getSharedInstance.
+// See BoxMacTwoSender.ned for comments on the parameters themselves.
+struct BoxMacTwoSenderParameters {
+
+	double initialBackoffMin;
+	double initialBackoffMax;
+	double congestionBackoffMin;
+	double congestionBackoffMax;
+	double sleepTime;	// The Controller's sleep time
+	double lplWakeIntervalSendPadding;
+	double interTransmissionAckReceiveDelay;
+	double interTransmissionBroadcastDelay;
+	unsigned int maxMessageBufferSize;
+	double waitForRxTransitionDelayTime;
+	bool fastForwardUnicastTrains;
+	bool validateFastForwardTrains;
+	double phyDataRate;
+	bool coalesceBroadcastTrains;
+	bool packetPriorities;
+	double priorityBackoffScale;
+
+	// Derived values, worked out once by calculateDerivedTimings
+	double initialBackoffRange() const { return m_initialBackoffRange; }
+	double congestionBackoffRange() const { return m_congestionBackoffRange; }
+	double transmissionTimeToOverlapLplWakeInterval() const { return m_transmissionTimeToOverlapLplWakeInterval; }
+
+	void calculateDerivedTimings()
+	{
+		m_initialBackoffRange = initialBackoffMax - initialBackoffMin;
+		m_congestionBackoffRange = congestionBackoffMax - congestionBackoffMin;
+		// The repeated transmissions in a train cover a whole sleep interval plus a margin
+		m_transmissionTimeToOverlapLplWakeInterval = sleepTime + lplWakeIntervalSendPadding;
+	}
+
+	bool operator==(const BoxMacTwoSenderParameters &other) const
+	{
+		return initialBackoffMin == other.initialBackoffMin
+			&& initialBackoffMax == other.initialBackoffMax
+			&& congestionBackoffMin == other.congestionBackoffMin
+			&& congestionBackoffMax == other.congestionBackoffMax
+			&& sleepTime == other.sleepTime
+			&& lplWakeIntervalSendPadding == other.lplWakeIntervalSendPadding
+			&& interTransmissionAckReceiveDelay == other.interTransmissionAckReceiveDelay
+			&& interTransmissionBroadcastDelay == other.interTransmissionBroadcastDelay
+			&& maxMessageBufferSize == other.maxMessageBufferSize
+			&& waitForRxTransitionDelayTime == other.waitForRxTransitionDelayTime
+			&& fastForwardUnicastTrains == other.fastForwardUnicastTrains
+			&& validateFastForwardTrains == other.validateFastForwardTrains
+			&& phyDataRate == other.phyDataRate
+			&& coalesceBroadcastTrains == other.coalesceBroadcastTrains
+			&& packetPriorities == other.packetPriorities
+			&& priorityBackoffScale == other.priorityBackoffScale;
+	}
+
+	// Returns the shared block for this configuration (creating it, with its derived timings, the first time it is seen)
+	static const BoxMacTwoSenderParameters &getSharedInstance(BoxMacTwoSenderParameters parameters)
+	{
+		// std::list never moves its elements, so references handed out stay valid
+		static std::list<BoxMacTwoSenderParameters> sharedInstances;
+
+		for(std::list<BoxMacTwoSenderParameters>::const_iterator it = sharedInstances.begin(); it != sharedInstances.end(); ++it)
+		{
+			if(*it == parameters) {
+				return *it;
+			}
+		}
+
+		parameters.calculateDerivedTimings();
+		sharedInstances.push_back(parameters);
+		return sharedInstances.back();
+	}
+
+	private:
+		double m_initialBackoffRange;
+		double m_congestionBackoffRange;
+		double m_transmissionTimeToOverlapLplWakeInterval;
+};
+
+#endif //_BOXMACTWOSENDERPARAMETERS_H_
@@ -5,6 +5,12 @@ Define_Module(RicerMac);
 void RicerMac::startup()
 {
 	trace() << "Startup";
+
+	// Only a restart (after running out of energy) has retained state to restore
+	if(hasStartedUpOnce && nvRetainNeighbours)
+	{
+		txPowerControl.restoreLevels(NonVolatileStorage::read(getParentModule()->getParentModule(), "ricerNeighbours"));
+	}
 	
 	if(!hasStartedUpOnce)
 	{
@@ -27,41 +33,66 @@ void RicerMac::startup()
 		declareOutput("Ricer packet ACKed");
 		declareOutput("Ricer sleep time");
 		declareOutput("Ricer wait to send time");
-
-		macParameters.waitForRxTransitionDelayTime = par("waitForRxTransitionDelayTime");
-		macParameters.waitForSleepTransitionDelayTime = par("waitForSleepTransitionDelayTime");
-		macParameters.binaryExponentialBackoffSlotDuration = par("binaryExponentialBackoffSlotDuration");
-		macParameters.binaryExponentialBackoffMaxExponent = par("binaryExponentialBackoffMaxExponent");
-		macParameters.sendDataBackoffMin = par("sendDataBackoffMin");
-		macParameters.sendDataBackoffMax = par("sendDataBackoffMax");
-		macParameters.phyDataRate = par("phyDataRate");
-		macParameters.macBufferSize = par("macBufferSize");
-		macParameters.wakeForReceiveInterval = par("wakeForReceiveInterval");
-		macParameters.wakeForReceiveIntervalJitter = par("wakeForReceiveIntervalJitter");
-		macParameters.maxSendRetries = par("maxSendRetries");
-		macParameters.waitforRadioTxCompleteAfterInvalidCcaResult = par("waitforRadioTxCompleteAfterInvalidCcaResult");
-		macParameters.selfNodeId = self;
-		macParameters.ricerAckRtrFrameSizeBits = par("ricerAckRtrFrameSizeBits");
-		macParameters.ricerRtrFrameSizeBits = par("ricerRtrFrameSizeBits");
-		macParameters.ricerDataFrameSizeBits = par("ricerDataFrameSizeBits");
-		macParameters.waitForDataAndAckResponseMultiplier = par("waitForDataAndAckResponseMultiplier");
+		declareOutput("Ricer TX power");
+		declareOutput("Ricer priority drop");
+
+		RicerMacParameters parameters;
+		parameters.waitForRxTransitionDelayTime = par("waitForRxTransitionDelayTime");
+		parameters.waitForSleepTransitionDelayTime = par("waitForSleepTransitionDelayTime");
+		parameters.binaryExponentialBackoffSlotDuration = par("binaryExponentialBackoffSlotDuration");
+		parameters.binaryExponentialBackoffMaxExponent = par("binaryExponentialBackoffMaxExponent");
+		parameters.sendDataBackoffMin = par("sendDataBackoffMin");
+		parameters.sendDataBackoffMax = par("sendDataBackoffMax");
+		parameters.phyDataRate = par("phyDataRate");
+		parameters.macBufferSize = par("macBufferSize");
+		parameters.wakeForReceiveInterval = par("wakeForReceiveInterval");
+		parameters.wakeForReceiveIntervalJitter = par("wakeForReceiveIntervalJitter");
+		parameters.maxSendRetries = par("maxSendRetries");
+		parameters.waitforRadioTxCompleteAfterInvalidCcaResult = par("waitforRadioTxCompleteAfterInvalidCcaResult");
+		parameters.ricerAckRtrFrameSizeBits = par("ricerAckRtrFrameSizeBits");
+		parameters.ricerRtrFrameSizeBits = par("ricerRtrFrameSizeBits");
+		parameters.ricerDataFrameSizeBits = par("ricerDataFrameSizeBits");
+		parameters.waitForDataAndAckResponseMultiplier = par("waitForDataAndAckResponseMultiplier");
+		parameters.packetPriorities = par("packetPriorities");
+		parameters.priorityBackoffScale = par("priorityBackoffScale");
 
 		// Get packet overheads for all other layers - we need this so we can predict how long
 		// a transmission will last (used when determining how long to wait for data after sending RTR) 
-		macParameters.phyFrameOverheadBytes = getParentModule() // Communication module
+		parameters.phyFrameOverheadBytes = getParentModule() // Communication module
 			->getSubmodule("Radio")->par("phyFrameOverhead");
 
-		macParameters.networkDataFrameOverheadBits = getParentModule() // Communication module
+		parameters.networkDataFrameOverheadBits = getParentModule() // Communication module
 			->getSubmodule("Routing")->par("networkDataFrameOverheadBits");
 
-		macParameters.applicationPacketOverheadBytes = getParentModule() // Communication module
+		parameters.applicationPacketOverheadBytes = getParentModule() // Communication module
 			->getParentModule() // Node module
 			->getSubmodule("Application")->par("packetHeaderOverhead");
 
+		// Use the block shared by all nodes with this configuration. Derived timings are calculated once, here
+		macParameters = &RicerMacParameters::getSharedInstance(parameters);
+
+		txPowerControl.initialise(par("txPowerControl"), par("txPowerLevels"), par("txPowerTargetEtx"), par("txPowerWindow"));
+		// The neighbours' TX power levels are the only state kept, so there is nothing to keep without TX power control
+		nvRetainNeighbours = par("nvRetainNeighbours");
+		if(nvRetainNeighbours && !txPowerControl.isEnabled()) {
+			opp_error("RicerMac: nvRetainNeighbours needs txPowerControl, as the neighbours' TX power levels are what is kept");
+		}
+		if(nvRetainNeighbours) {
+			NonVolatileStorage::open(getParentModule()->getParentModule());
+		}
+		nvWriteEnergyPerByte = par("nvWriteEnergyPerByte").doubleValue() * 1e-9; // nJ to J
+		collectPacketJourneys = par("collectPacketJourneys");
+		if(collectPacketJourneys) {
+			PacketJourney::open();
+		}
 	}
+	journeyOfDataSentTo.clear();
 	
 
-	macContext.initialiseContext(this, macParameters);
+	macContext.initialiseContext(this, *macParameters, self);
+	if(macParameters->packetPriorities) {
+		macContext.initialisePriorityScheduler(par("priorityScheduling"), par("priorityWeights"));
+	}
 	macContext.startup();
 }
 
@@ -193,7 +224,7 @@ void RicerMac::fromNetworkLayer(cPacket *netPkt, int destination)
 	trace() << "Received packet from network layer to send";
 	RicerMacPacket *macPacket = new RicerMacPacket("Ricer mac packet", MAC_LAYER_PACKET);
 	// Important: set bit length before encapsulation
-	macPacket->setBitLength(macParameters.ricerDataFrameSizeBits);
+	macPacket->setBitLength(macParameters->ricerDataFrameSizeBits);
 	// Important: *FIRST* encapsulate the packet THEN set its dest and source
 	// (encapsulate sets the destination to default broadcast)
 	// encapusulate also increments / sets the sequence number
@@ -201,6 +232,7 @@ void RicerMac::fromNetworkLayer(cPacket *netPkt, int destination)
 	macPacket->setSource(SELF_MAC_ADDRESS);
 	macPacket->setDestination(destination);
 	macPacket->setFrameType(RICER_MAC_FRAME_TYPE_DATA);
+	PacketPriority::copy(netPkt, macPacket);
 
 	// Note: destination may be BROADCAST_MAC_ADDRESS
 	// However, in this MAC, broadcasts are handled as a series of unicasts to any node which sends a RTR beacon.
@@ -216,6 +248,10 @@ void RicerMac::fromNetworkLayer(cPacket *netPkt, int destination)
 		macPacket->setIsDataForBroadcast(false);
 	}
 
+	if(collectPacketJourneys) {
+		PacketJourney::stamp(macPacket, self, PacketJourney::MAC_ENQUEUE);
+	}
+
 	if(!macContext.bufferPacketFromNetLayer(macPacket))
 	{
 		trace() << "WARNING - Unable to buffer packet, so dropping";
@@ -239,6 +275,9 @@ void RicerMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi)
 		{
 			trace() << "Received ACK/RTR beacon from radio layer from node " << ricerMacPacket->getSource();
 			plotTrace() << "#MAC_REC_ACK_RTR " << ricerMacPacket->getSource();
+			if(txPowerControl.isEnabled() && ricerMacPacket->getAckForNode() == self) {
+				txPowerControl.recordAck(ricerMacPacket->getSource());
+			}
 			break;
 		}
 		case RICER_MAC_FRAME_TYPE_DATA:
@@ -264,7 +303,9 @@ void RicerMac::fromRadioLayer(cPacket *pkt, double rssi, double lqi)
 
 void RicerMac::decapsulateAndPassToNetLayer(RicerMacPacket *packet)
 {
-	if(packet->getEncapsulatedPacket() == NULL)
+	// Note: hasEncapsulatedPacket rather than getEncapsulatedPacket, which would unshare (deep copy)
+	// the net packet if it is still shared with other copies of the MAC packet
+	if(!packet->hasEncapsulatedPacket())
 	{
 		opp_error("Asked to decapsulate mac packet and pass encapsulated net packet to net layer, but packet has no encapsulated packet");
 	}
@@ -282,8 +323,9 @@ void RicerMac::sendReadyToReceiveBeacon()
 	readyToReceiveBeacon->setSource(self);
 	readyToReceiveBeacon->setDestination(BROADCAST_MAC_ADDRESS);
 	readyToReceiveBeacon->setFrameType(RICER_MAC_FRAME_TYPE_RTR_BEACON);
-	readyToReceiveBeacon->setBitLength(macParameters.ricerRtrFrameSizeBits);
+	readyToReceiveBeacon->setBitLength(macParameters->ricerRtrFrameSizeBits);
 
+	setTxPowerForFrameTo(BROADCAST_MAC_ADDRESS, true);
 	toRadioLayer(readyToReceiveBeacon);
 	// THEN we set to TX. After TXing all packets in buffer, it should automatically go back to previous state
 	toRadioLayer(createRadioCommand(SET_STATE, TX));
@@ -306,8 +348,9 @@ void RicerMac::sendAckReadyToReceiveTo(int nodeIdToAck)
 	ackAndReadyToReceiveBeacon->setFrameType(RICER_MAC_FRAME_TYPE_ACK_RTR_BEACON);
 	ackAndReadyToReceiveBeacon->setDestination(BROADCAST_MAC_ADDRESS);
 	ackAndReadyToReceiveBeacon->setAckForNode(nodeIdToAck);
-	ackAndReadyToReceiveBeacon->setBitLength(macParameters.ricerAckRtrFrameSizeBits);
+	ackAndReadyToReceiveBeacon->setBitLength(macParameters->ricerAckRtrFrameSizeBits);
 
+	setTxPowerForFrameTo(BROADCAST_MAC_ADDRESS, true);
 	toRadioLayer(ackAndReadyToReceiveBeacon);
 	// THEN we set to TX. After TXing all packets in buffer, it should automatically go back to previous state
 	toRadioLayer(createRadioCommand(SET_STATE, TX));
@@ -328,16 +371,47 @@ void RicerMac::sendData(RicerMacPacket* macPacket)
 		collectStats("Ricer send packet breakdown", "data unicast");
 	}
 
+	// Data frames are always sent to a single node (broadcasts are sent as a series of unicasts) and are always ACKed
+	if(txPowerControl.isEnabled() && txPowerControl.recordAttempt(macPacket->getDestination()) && nvRetainNeighbours) {
+		NonVolatileStorage::write(getParentModule()->getParentModule(), "ricerNeighbours", txPowerControl.getLevelRecords(),
+			NV_NEIGHBOUR_RECORD_BYTES, nvWriteEnergyPerByte);
+	}
+	setTxPowerForFrameTo(macPacket->getDestination(), false);
+
+	if(collectPacketJourneys)
+	{
+		PacketJourney::stamp(macPacket, self, PacketJourney::MAC_FIRST_TX);
+		journeyOfDataSentTo[macPacket->getDestination()] = PacketJourney::keyOf(macPacket);
+	}
+
 	// Send to radio layer
 	toRadioLayer(macPacket);
 	// THEN we set to TX. After TXing all packets in buffer, it should automatically go back to previous state
 	toRadioLayer(createRadioCommand(SET_STATE, TX));
 }
 
+void RicerMac::setTxPowerForFrameTo(int destination, bool isBroadcast)
+{
+	if(!txPowerControl.isEnabled()) {
+		return;
+	}
+
+	double txPower = txPowerControl.getTxPower(destination, isBroadcast);
+	if(txPowerControl.radioPowerNeedsChanging(txPower))
+	{
+		trace() << "Setting TX power to " << txPower << "dBm";
+		toRadioLayer(createRadioCommand(SET_TX_OUTPUT, txPower));
+	}
+	if(!isBroadcast) {
+		collectOutput("Ricer TX power", (std::to_string((int)txPower) + "dBm").c_str());
+	}
+}
+
 void RicerMac::handleOutOfEnergy(cMessage *outOfEnergyMsg)
 {
 	trace() << "Out of energy!";
 	macContext.clearAllState();
+	txPowerControl.reset();
 	cancelAllTimers();
 	pausedTimers.clear();
 	cancelAndDelete(outOfEnergyMsg);
@@ -406,6 +480,9 @@ void RicerMac::reportSendingSucceededToNode(int nodeIdSentTo)
 {
 	trace() << "Passing sending succeeded control message to net layer";
 	plotTrace() << "#MAC_UNICAST_SUCCEEDED";
+	if(collectPacketJourneys && journeyOfDataSentTo.count(nodeIdSentTo) > 0) {
+		PacketJourney::stamp(journeyOfDataSentTo[nodeIdSentTo], self, PacketJourney::MAC_ACK);
+	}
 	RoutingControlMessage *sendAckedMsg = new RoutingControlMessage("routing control msg", NETWORK_CONTROL_COMMAND);
 	sendAckedMsg->setRoutingControlMessageKind(ROUTING_MSG_MAC_SENDING_ACKED);
 	sendAckedMsg->setValue(nodeIdSentTo); // The value is the node ID of the node we were trying to send to
@@ -417,4 +494,11 @@ void RicerMac::finishSpecific()
 	collectOutput("Ricer packets left in buffer", "Unicast", macContext.howManyUnicastPacketsInBuffer());
 	collectOutput("Ricer packets left in buffer", "Broadcast", macContext.howManyBroadcastPacketsInBuffer());
 	macContext.clearAllState();
+
+	if(hasStartedUpOnce && nvRetainNeighbours) {
+		NonVolatileStorage::release(getParentModule()->getParentModule());
+	}
+	if(hasStartedUpOnce && collectPacketJourneys) {
+		PacketJourney::release();
+	}
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <omnetpp.h>
 #include <string>
+#include <map>
 #include "VirtualMac.h"
 #include "RicerStateContext.h"
 #include "Radio.h"
@@ -11,18 +12,36 @@
 #include "CastaliaMessages.h"
 #include "RicerMacTimers.h"
 #include "RoutingControlMessage_m.h"
+#include "TxPowerControl.h"
+#include "NonVolatileStorage.h"
+#include "PacketJourney.h"
+#include "PacketPriority.h"
 
 class RicerMac : public VirtualMac, public RicerMacInterface
 {
 	private:
 		RicerStateContext macContext;
-		RicerMacParameters macParameters;
+		// Shared by all nodes with the same configuration - see RicerMacParameters::getSharedInstance
+		const RicerMacParameters *macParameters;
 
 		// Map to hold paused timers. The key (int) is the timer ID (from the RicerMacTimer enum)
 		// the value is the remaining time left on the paused timer.
 		// If a timer does not exist in the map, it is not paused.
 		std::map<int, double> pausedTimers;
 
+		// Per-neighbour TX power, chosen from the ACK rate of data frames sent to each neighbour
+		TxPowerControl txPowerControl;
+		void setTxPowerForFrameTo(int destination, bool isBroadcast);
+
+		// Neighbours' TX power levels kept in non-volatile memory
+		bool nvRetainNeighbours;
+		double nvWriteEnergyPerByte;
+		static const unsigned int NV_NEIGHBOUR_RECORD_BYTES = 3;
+
+		// Journey of the data frame last sent to each neighbour, to stamp when it is ACKed
+		bool collectPacketJourneys;
+		std::map<int, long> journeyOfDataSentTo;
+
 	protected:
 		// Methods we are overriding from VirtualMac
 		void startup();
@@ -1,6 +1,11 @@
 #ifndef _RICERMACPARAMETERS_H_
 #define _RICERMACPARAMETERS_H_
 
+#include <list>
+
+// MAC parameters which are the same for every node using the same configuration. Nodes do not keep their own copy:
+// RicerMac fills one in at startup and swaps it for the shared, immutable block returned by getSharedInstance.
+// Node specific values (e.g. the node's own ID) do not belong here.
 struct RicerMacParameters {
 
 	double waitForRxTransitionDelayTime;
@@ -10,7 +15,6 @@ struct RicerMacParameters {
 	double sendDataBackoffMin;
 	double sendDataBackoffMax;
 	double phyDataRate;
-	int selfNodeId;
 	int macBufferSize;
 	double wakeForReceiveInterval;
 	double wakeForReceiveIntervalJitter;
@@ -23,51 +27,99 @@ struct RicerMacParameters {
 	int networkDataFrameOverheadBits;
 	int applicationPacketOverheadBytes;
 	int waitForDataAndAckResponseMultiplier;
+	bool packetPriorities;
+	double priorityBackoffScale;
+
+	// Derived timings and frame lengths. These are used on every frame, so are worked out
+	// once by calculateDerivedTimings rather than on every call
+	double listenForDataTotalDwellTime() const { return m_listenForDataTotalDwellTime; }
+	double waitForAckTime() const { return m_waitForAckTime; }
+	int totalDataFrameLengthBits() const { return m_totalDataFrameLengthBits; }
+	int totalRicerBeaconFrameLengthBits() const { return m_totalRicerBeaconFrameLengthBits; }
+	int totalRicerAckFrameLengthBits() const { return m_totalRicerAckFrameLengthBits; }
 
-	double listenForDataTotalDwellTime()
+	void calculateDerivedTimings()
 	{
+		m_totalDataFrameLengthBits =
+			(phyFrameOverheadBytes * 8) // Physical layer
+			+ ricerDataFrameSizeBits // MAC layer
+			+ networkDataFrameOverheadBits // ROuting layer
+			+ (applicationPacketOverheadBytes * 8); // Application layer
+
+		m_totalRicerBeaconFrameLengthBits =
+			(phyFrameOverheadBytes * 8) // Physical layer
+			+ ricerRtrFrameSizeBits; // MAC layer
+
+		m_totalRicerAckFrameLengthBits =
+			(phyFrameOverheadBytes * 8) // Physical layer
+			+ ricerAckRtrFrameSizeBits; // MAC layer
+
 		// Max possible time it takes to receive a data packet back from a node after sending a ready-to-receive beacon is:
-		return sendDataBackoffMax + // The total max time it may have backed off
-			(((totalDataFrameLengthBits() / 8)  // Plus add up the total bytes for data packet 
-			 +(totalRicerBeaconFrameLengthBits() / 8))  //and beacon
+		m_listenForDataTotalDwellTime = sendDataBackoffMax + // The total max time it may have backed off
+			(((m_totalDataFrameLengthBits / 8)  // Plus add up the total bytes for data packet
+			 +(m_totalRicerBeaconFrameLengthBits / 8))  //and beacon
 										// and add on how long it takes in seconds to transmit these bytes
 			/ (1000*phyDataRate/8.0))	// PhyDataRate is in kilobits per second (hence 1000* and divide by 8 to get bytes)
 			* waitForDataAndAckResponseMultiplier;						// Plus extra for turnaround time, radio state transitions etc.
-	}
 
-	double waitForAckTime()
-	{
 		// Time it takes to receive an ACK in response to a data packet is:
-		return sendDataBackoffMax + // The total max time it may have backed off
-			(((totalDataFrameLengthBits() / 8)  // Plus add up the total bytes for data packet 
-			 +(totalRicerAckFrameLengthBits() / 8))  //and beacon
+		m_waitForAckTime = sendDataBackoffMax + // The total max time it may have backed off
+			(((m_totalDataFrameLengthBits / 8)  // Plus add up the total bytes for data packet
+			 +(m_totalRicerAckFrameLengthBits / 8))  //and beacon
 										// and add on how long it takes in seconds to transmit these bytes
 			/ (1000*phyDataRate/8.0))	// PhyDataRate is in kilobits per second (hence 1000* and divide by 8 to get bytes)
 			* waitForDataAndAckResponseMultiplier;						// Plus extra for turnaround time, radio state transitions etc.
 	}
 
-	int totalDataFrameLengthBits()
+	bool operator==(const RicerMacParameters &other) const
 	{
-		return 
-			(phyFrameOverheadBytes * 8) // Physical layer
-			+ ricerDataFrameSizeBits // MAC layer
-			+ networkDataFrameOverheadBits // ROuting layer
-			+ (applicationPacketOverheadBytes * 8); // Application layer
+		return waitForRxTransitionDelayTime == other.waitForRxTransitionDelayTime
+			&& waitForSleepTransitionDelayTime == other.waitForSleepTransitionDelayTime
+			&& binaryExponentialBackoffSlotDuration == other.binaryExponentialBackoffSlotDuration
+			&& binaryExponentialBackoffMaxExponent == other.binaryExponentialBackoffMaxExponent
+			&& sendDataBackoffMin == other.sendDataBackoffMin
+			&& sendDataBackoffMax == other.sendDataBackoffMax
+			&& phyDataRate == other.phyDataRate
+			&& macBufferSize == other.macBufferSize
+			&& wakeForReceiveInterval == other.wakeForReceiveInterval
+			&& wakeForReceiveIntervalJitter == other.wakeForReceiveIntervalJitter
+			&& maxSendRetries == other.maxSendRetries
+			&& waitforRadioTxCompleteAfterInvalidCcaResult == other.waitforRadioTxCompleteAfterInvalidCcaResult
+			&& ricerAckRtrFrameSizeBits == other.ricerAckRtrFrameSizeBits
+			&& ricerRtrFrameSizeBits == other.ricerRtrFrameSizeBits
+			&& ricerDataFrameSizeBits == other.ricerDataFrameSizeBits
+			&& phyFrameOverheadBytes == other.phyFrameOverheadBytes
+			&& networkDataFrameOverheadBits == other.networkDataFrameOverheadBits
+			&& applicationPacketOverheadBytes == other.applicationPacketOverheadBytes
+			&& waitForDataAndAckResponseMultiplier == other.waitForDataAndAckResponseMultiplier
+			&& packetPriorities == other.packetPriorities
+			&& priorityBackoffScale == other.priorityBackoffScale;
 	}
 
-	int totalRicerBeaconFrameLengthBits()
+	// Returns the shared block for this configuration (creating it, with its derived timings, the first time it is seen)
+	static const RicerMacParameters &getSharedInstance(RicerMacParameters parameters)
 	{
-		return 
-			(phyFrameOverheadBytes * 8) // Physical layer
-			+ ricerRtrFrameSizeBits; // MAC layer
-	}
+		// std::list never moves its elements, so references handed out stay valid
+		static std::list<RicerMacParameters> sharedInstances;
 
-	int totalRicerAckFrameLengthBits()
-	{
-		return 
-			(phyFrameOverheadBytes * 8) // Physical layer
-			+ ricerAckRtrFrameSizeBits; // MAC layer
+		for(std::list<RicerMacParameters>::const_iterator it = sharedInstances.begin(); it != sharedInstances.end(); ++it)
+		{
+			if(*it == parameters) {
+				return *it;
+			}
+		}
+
+		parameters.calculateDerivedTimings();
+		sharedInstances.push_back(parameters);
+		return sharedInstances.back();
 	}
+
+	private:
+		double m_listenForDataTotalDwellTime;
+		double m_waitForAckTime;
+		int m_totalDataFrameLengthBits;
+		int m_totalRicerBeaconFrameLengthBits;
+		int m_totalRicerAckFrameLengthBits;
 };
 
-#endif //_RICERMACPARAMETERS_H_
\ No newline at end of file
+#endif //_RICERMACPARAMETERS_H_
@@ -14,12 +14,14 @@ void RicerStateContext::initialisePrivateVariables()
 	m_needToSendReadyToReceiveBeacon = false;
 	m_needToWakeToSendNewPacket = false;
 	m_needToWakeForReceive = false;
+	m_packetBeingSent = nullptr;
 }
 
-void RicerStateContext::initialiseContext(RicerMacInterface *moduleInterface, RicerMacParameters parameters)
+void RicerStateContext::initialiseContext(RicerMacInterface *moduleInterface, const RicerMacParameters &parameters, int selfNodeId)
 {
 	macModuleInterface = moduleInterface;
-	macParameters = parameters;
+	macParameters = &parameters;
+	this->selfNodeId = selfNodeId;
 	binaryExponentialBackoff.initialise(
 		parameters.binaryExponentialBackoffSlotDuration, 
 		parameters.binaryExponentialBackoffMaxExponent,
@@ -27,6 +29,11 @@ void RicerStateContext::initialiseContext(RicerMacInterface *moduleInterface, Ri
 	//macModuleInterface->log("Initialised context");
 }
 
+void RicerStateContext::initialisePriorityScheduler(const char *scheduling, const char *weights)
+{
+	m_priorityScheduler.initialise(scheduling, weights);
+}
+
 void RicerStateContext::clearAllState()
 {
 	while(!m_txBuffer.empty()) 
@@ -73,9 +80,14 @@ int RicerStateContext::howManyBroadcastPacketsInBuffer()
 	return count;
 }
 
-RicerMacParameters RicerStateContext::getMacParameters()
+const RicerMacParameters &RicerStateContext::getMacParameters()
+{
+	return *macParameters;
+}
+
+int RicerStateContext::getSelfNodeId()
 {
-	return macParameters;
+	return selfNodeId;
 }
 
 std::string RicerStateContext::getCurrentStateName()
@@ -147,7 +159,8 @@ void RicerStateContext::fromRadioLayer(RicerMacPacket *packet)
 
 bool RicerStateContext::bufferPacketFromNetLayer(RicerMacPacket *packet)
 {
-	if (m_txBuffer.size() >= macParameters.macBufferSize) 
+	if (m_txBuffer.size() >= macParameters->macBufferSize
+		&& !(macParameters->packetPriorities && dropLowerPriorityBroadcast(PacketPriority::of(packet))))
 	{
 		log("WARNING - MAC buffer full");
 		macModuleInterface->collectStats("Ricer buffer overflow");
@@ -193,7 +206,16 @@ RicerMacPacket* RicerStateContext::getCopyOfNextBroadcastOrUnicastWaitingToSendT
 	}
 	else
 	{
+		// A new choice (rather than a retry of the packet being sent) uses up one of its class's turns
+		if(macParameters->packetPriorities && queueItem->packet != m_packetBeingSent)
+		{
+			m_priorityScheduler.charge(PacketPriority::of(queueItem->packet), getPriorityClassesWaitingToSendTo(nodeId));
+			m_packetBeingSent = queueItem->packet;
+		}
+
 		//macModuleInterface->log("Found message waiting for node " + std::to_string(nodeId) + ", returning duplicate");
+		// Only the MAC header is copied: OMNeT reference counts the encapsulated net packet, which
+		// stays shared with the buffered packet until someone decapsulates it
 		return queueItem->packet->dup();
 	}
 }
@@ -218,19 +240,96 @@ BufferedMacPacketQueueItem* RicerStateContext::getNextBroadcastOrUnicastQueueIte
 {
 	vector<BufferedMacPacketQueueItem>::iterator it;
 
+	if(!macParameters->packetPriorities)
+	{
+		for(it = m_txBuffer.begin(); it != m_txBuffer.end(); it++)
+		{
+			if(isWaitingToSendTo(*it, nodeId))
+			{
+				return &(*it);
+			}
+		}
+		return nullptr;
+	}
+
+	// The packet being sent, if it is for this node, otherwise the first packet for it of the class the scheduler chooses
+	BufferedMacPacketQueueItem *firstOfClass[PacketPriority::NUMBER_OF_CLASSES] = {};
 	for(it = m_txBuffer.begin(); it != m_txBuffer.end(); it++)
 	{
-		// If there is a broadcast packet in the queue
-		// AND we have not already sent the broadcast to the specified node,
-		if(((*it).packet->getIsDataForBroadcast() &&
-			(*it).sentBroadcastToNodes.find(nodeId) == (*it).sentBroadcastToNodes.end()) ||
-		// or there is a unicast packet addressed to the specified node
-		   packetIsAddressedToNode((*it).packet, nodeId))
+		if(isWaitingToSendTo(*it, nodeId))
+		{
+			if((*it).packet == m_packetBeingSent)
+			{
+				return &(*it);
+			}
+			int priorityClass = PacketPriority::of((*it).packet);
+			if(firstOfClass[priorityClass] == nullptr)
+			{
+				firstOfClass[priorityClass] = &(*it);
+			}
+		}
+	}
+	int priorityClass = m_priorityScheduler.choose(getPriorityClassesWaitingToSendTo(nodeId));
+	return priorityClass == -1 ? nullptr : firstOfClass[priorityClass];
+}
+
+// Note: this is a private function
+bool RicerStateContext::isWaitingToSendTo(const BufferedMacPacketQueueItem &queueItem, int nodeId)
+{
+	// If there is a broadcast packet in the queue
+	// AND we have not already sent the broadcast to the specified node,
+	return (queueItem.packet->getIsDataForBroadcast() &&
+		queueItem.sentBroadcastToNodes.find(nodeId) == queueItem.sentBroadcastToNodes.end()) ||
+	// or there is a unicast packet addressed to the specified node
+		packetIsAddressedToNode(queueItem.packet, nodeId);
+}
+
+// Note: this is a private function
+unsigned int RicerStateContext::getPriorityClassesWaitingToSendTo(int nodeId)
+{
+	unsigned int waitingClasses = 0;
+	vector<BufferedMacPacketQueueItem>::iterator it;
+
+	for(it = m_txBuffer.begin(); it != m_txBuffer.end(); it++)
+	{
+		if(isWaitingToSendTo(*it, nodeId))
 		{
-			return &(*it);
+			waitingClasses |= PriorityScheduler::bit(PacketPriority::of((*it).packet));
 		}
 	}
-	return nullptr;
+	return waitingClasses;
+}
+
+// Note: this is a private function
+bool RicerStateContext::dropLowerPriorityBroadcast(int priorityClass)
+{
+	// Makes room for a packet of the given class by dropping the newest broadcast of the lowest class below it.
+	// Unicasts are not dropped, as the network layer is waiting for the outcome of each one. Nor is the packet being sent
+	vector<BufferedMacPacketQueueItem>::iterator it;
+	vector<BufferedMacPacketQueueItem>::iterator dropIt = m_txBuffer.end();
+	int droppedClass = priorityClass;
+
+	for(it = m_txBuffer.begin(); it != m_txBuffer.end(); it++)
+	{
+		int queuedClass = PacketPriority::of((*it).packet);
+		if((*it).packet->getIsDataForBroadcast() && (*it).packet != m_packetBeingSent
+			&& queuedClass <= droppedClass && queuedClass < priorityClass)
+		{
+			dropIt = it;
+			droppedClass = queuedClass;
+		}
+	}
+	if(dropIt == m_txBuffer.end())
+	{
+		return false;
+	}
+
+	RicerMacPacket *pktToRemove = (*dropIt).packet;
+	m_txBuffer.erase(dropIt);
+	macModuleInterface->cleanUpAndRemoveMessage(pktToRemove);
+	log("MAC buffer full, dropped broadcast of priority class " + std::to_string(droppedClass) + " to make room for priority class " + std::to_string(priorityClass));
+	macModuleInterface->collectStats("Ricer priority drop");
+	return true;
 }
 
 RicerMacPacket* RicerStateContext::peekAtNextUnicastPacket()
@@ -253,6 +352,18 @@ void RicerStateContext::recordHaveSentBroadcastPacketToNode(int nodeSentTo)
 {
 	vector<BufferedMacPacketQueueItem>::iterator it;
 
+	// With packet priorities, the broadcast sent is the one being sent, not necessarily the first
+	if(macParameters->packetPriorities && m_packetBeingSent != nullptr && m_packetBeingSent->getIsDataForBroadcast())
+	{
+		BufferedMacPacketQueueItem *queueItem = getNextBroadcastOrUnicastQueueItemWaitingToSendTo(nodeSentTo);
+		if(queueItem != nullptr && queueItem->packet == m_packetBeingSent)
+		{
+			queueItem->sentBroadcastToNodes.insert(nodeSentTo);
+			m_packetBeingSent = nullptr;
+			return;
+		}
+	}
+
 	for(it = m_txBuffer.begin(); it != m_txBuffer.end(); it++)
 	{
 		// If there is a broadcast packet in the queue
@@ -276,9 +387,12 @@ void RicerStateContext::unicastPacketHasBeenSentToNodeSoRemoveFromQueue(int node
 
 	for(it = m_txBuffer.begin(); it != m_txBuffer.end(); )
 	{
-		if(packetIsAddressedToNode((*it).packet, nodeSentTo))
+		// With packet priorities, the packet sent is the one being sent, not necessarily the first for the node
+		if(packetIsAddressedToNode((*it).packet, nodeSentTo) && (!macParameters->packetPriorities ||
+			m_packetBeingSent == nullptr || !packetIsAddressedToNode(m_packetBeingSent, nodeSentTo) || (*it).packet == m_packetBeingSent))
 		{
 			RicerMacPacket *pktToRemove = (*it).packet;
+			m_packetBeingSent = nullptr;
 			it = m_txBuffer.erase(it);
 			macModuleInterface->cleanUpAndRemoveMessage(pktToRemove);
 			//macModuleInterface->log("Removed unicast packet from queue");
@@ -329,6 +443,10 @@ vector<int> RicerStateContext::dropPacketsAboveMaxSendAttempts()
 			{
 				RicerMacPacket *pktToRemove = (*it).packet;
 				it = m_txBuffer.erase(it); // also increments ++it
+				if(pktToRemove == m_packetBeingSent)
+				{
+					m_packetBeingSent = nullptr;
+				}
 				macModuleInterface->cleanUpAndRemoveMessage(pktToRemove);
 				macModuleInterface->log("Dropped broadcast which has already been sent");
 			}
@@ -345,6 +463,10 @@ vector<int> RicerStateContext::dropPacketsAboveMaxSendAttempts()
 				RicerMacPacket *pktToRemove = (*it).packet;
 				nodeIdsOfDroppedUnicastPackets.push_back((*it).packet->getDestination());
 				it = m_txBuffer.erase(it); // also increments ++it
+				if(pktToRemove == m_packetBeingSent)
+				{
+					m_packetBeingSent = nullptr;
+				}
 				macModuleInterface->cleanUpAndRemoveMessage(pktToRemove);
 				macModuleInterface->log("Dropped unicast packet which reached max send retries of " + std::to_string(getMacParameters().maxSendRetries));
 				macModuleInterface->collectStats("Ricer dropped packet");
@@ -20,6 +20,7 @@
 #include "RicerMacTimers.h"
 #include "BinaryExponentialBackoff.h"
 #include "RandomNumberOmnetImpl.h"
+#include "PacketPriority.h"
 
 struct BufferedMacPacketQueueItem
 {
@@ -34,7 +35,8 @@ class RicerStateContext : RicerStateContextInterface
 {
 	private:
 		RicerMacInterface *macModuleInterface;
-		RicerMacParameters macParameters;
+		const RicerMacParameters *macParameters;
+		int selfNodeId;
 		RicerState *currentState;
 		RicerStateSleep stateSleep;
 		RicerStateInitiateReceive stateInitiateReceive;
@@ -51,7 +53,15 @@ class RicerStateContext : RicerStateContextInterface
 		bool m_needToWakeToSendNewPacket;
 		bool m_needToWakeForReceive;
 
+		// With packet priorities, the class of packet to send to each node which sends us an RTR beacon is chosen by
+		// the scheduler. The chosen packet is kept until its send has finished, so that the ACK is matched to it
+		PriorityScheduler m_priorityScheduler;
+		RicerMacPacket *m_packetBeingSent;
+
 		BufferedMacPacketQueueItem* getNextBroadcastOrUnicastQueueItemWaitingToSendTo(int nodeId);
+		bool isWaitingToSendTo(const BufferedMacPacketQueueItem &queueItem, int nodeId);
+		unsigned int getPriorityClassesWaitingToSendTo(int nodeId);
+		bool dropLowerPriorityBroadcast(int priorityClass);
 		bool packetIsAddressedToNode(RicerMacPacket *macPacket, int nodeId);
 		void initialisePrivateVariables();
 
@@ -59,7 +69,8 @@ class RicerStateContext : RicerStateContextInterface
 		// Constructor
 		RicerStateContext();
 
-		void initialiseContext(RicerMacInterface *moduleInterface, RicerMacParameters parameters);
+		void initialiseContext(RicerMacInterface *moduleInterface, const RicerMacParameters &parameters, int selfNodeId);
+		void initialisePriorityScheduler(const char *scheduling, const char *weights);
 		void clearAllState();
 		int howManyUnicastPacketsInBuffer();
 		int howManyBroadcastPacketsInBuffer();
@@ -74,7 +85,8 @@ class RicerStateContext : RicerStateContextInterface
 		void timerFired(RicerMacTimer timer);
 		void resetBackoff();
 		double getNextBackoff();
-		RicerMacParameters getMacParameters();
+		const RicerMacParameters &getMacParameters();
+		int getSelfNodeId();
 		void fromRadioLayer(RicerMacPacket *packet);
 		bool bufferPacketFromNetLayer(RicerMacPacket *packet);
 		bool hasMessagesToSend();
@@ -15,7 +15,7 @@ class RicerStateContextInterface
 {
 	public:
 
-		virtual void initialiseContext(RicerMacInterface *moduleInterface, RicerMacParameters parameters) = 0;
+		virtual void initialiseContext(RicerMacInterface *moduleInterface, const RicerMacParameters &parameters, int selfNodeId) = 0;
 		virtual void clearAllState() = 0;
 		virtual int howManyUnicastPacketsInBuffer() = 0;
 		virtual int howManyBroadcastPacketsInBuffer() = 0;
@@ -30,7 +30,8 @@ class RicerStateContextInterface
 		virtual void timerFired(RicerMacTimer timer) = 0;
 		virtual void resetBackoff() = 0;
 		virtual double getNextBackoff() = 0;
-		virtual RicerMacParameters getMacParameters() = 0;
+		virtual const RicerMacParameters &getMacParameters() = 0;
+		virtual int getSelfNodeId() = 0;
 		virtual void fromRadioLayer(RicerMacPacket *packet) = 0;
 		virtual bool bufferPacketFromNetLayer(RicerMacPacket *packet) = 0;
 		virtual bool hasMessagesToSend() = 0;
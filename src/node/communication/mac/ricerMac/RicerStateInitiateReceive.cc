@@ -31,7 +31,7 @@ void RicerStateInitiateReceive::fromRadioLayer(RicerStateContextInterface *conte
 				// with BROADCAST_MAC_ADDRESS as destination.
 				throw std::runtime_error("Ricer Data type packet should never be sent to BROADCAST?");
 			}
-			else if(packet->getDestination() == context->getMacParameters().selfNodeId)
+			else if(packet->getDestination() == context->getSelfNodeId())
 			{
 				throw std::runtime_error("Received a data packet before ready-to-receive beacon has been sent!");
 			}
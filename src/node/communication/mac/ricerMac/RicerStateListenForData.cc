@@ -30,7 +30,7 @@ void RicerStateListenForData::fromRadioLayer(RicerStateContextInterface *context
 				// with BROADCAST_MAC_ADDRESS as destination.
 				throw std::runtime_error("Ricer Data type packet should never be sent to BROADCAST_MAC_ADDRESS");
 			}
-			else if(packet->getDestination() == context->getMacParameters().selfNodeId)
+			else if(packet->getDestination() == context->getSelfNodeId())
 			{
 				context->log("Received packet addressed to us. Cancelling receive timer, passing to net layer");
 				moduleInterface->collectStats("Ricer sent RTR and received data");
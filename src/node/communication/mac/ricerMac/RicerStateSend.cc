@@ -20,6 +20,12 @@ void RicerStateSend::start(RicerStateContextInterface *context, RicerMacInterfac
 
 	// Calculate a single random backoff
 	double backoffRange = context->getMacParameters().sendDataBackoffMax - context->getMacParameters().sendDataBackoffMin;
+	// With packet priorities, higher classes back off within a smaller part of the range, so usually win contention
+	if(context->getMacParameters().packetPriorities)
+	{
+		int priorityClass = PacketPriority::of(context->peekAtNextBroadcastOrUnicastWaitingToSendTo(context->getReceivedBeaconFromNodeToSendTo()));
+		backoffRange *= pow(context->getMacParameters().priorityBackoffScale, priorityClass);
+	}
 	double randomSendBackoff = context->getMacParameters().sendDataBackoffMin +
 	 							(context->getRandomDouble() * backoffRange);
 	//double randomSendBackoff = context->getRandomDouble() * context->getMacParameters().sendDataBackoffMax;
@@ -43,7 +49,7 @@ void RicerStateSend::fromRadioLayer(RicerStateContextInterface *context, RicerMa
 				// with BROADCAST_MAC_ADDRESS as destination.
 				throw std::runtime_error("Ricer Data type packet should never be sent to BROADCAST?");
 			}
-			else if(packet->getDestination() == context->getMacParameters().selfNodeId)
+			else if(packet->getDestination() == context->getSelfNodeId())
 			{
 				throw std::runtime_error("Unexpected data packet addressed to this node in state send");
 			}
@@ -61,7 +67,7 @@ void RicerStateSend::fromRadioLayer(RicerStateContextInterface *context, RicerMa
 
 		case RICER_MAC_FRAME_TYPE_ACK_RTR_BEACON:
 		{
-			if(packet->getAckForNode() == context->getMacParameters().selfNodeId)
+			if(packet->getAckForNode() == context->getSelfNodeId())
 			{
 				if(moduleInterface->isTimerRunning(RICER_MAC_TIMER_WAIT_FOR_ACK))
 				{
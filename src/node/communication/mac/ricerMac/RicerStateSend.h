@@ -1,7 +1,9 @@
 #ifndef _RICERSTATESEND_H_
 #define _RICERSTATESEND_H_
 
+#include <cmath>
 #include "RicerState.h"
+#include "PacketPriority.h"
 
 class RicerStateSend : public RicerState
 {
@@ -40,7 +40,7 @@ void RicerStateSleep::fromRadioLayer(RicerStateContextInterface *context, RicerM
 	context->log(std::string("WARNING: Received message from radio layer in sleep mode. This should only possible ") +
 		std::string("if a message arrives during the small time it takes for radio to transition to sleep mode."));
 
-	if(packet->getDestination() == context->getMacParameters().selfNodeId)
+	if(packet->getDestination() == context->getSelfNodeId())
 	{
 		// This should never happen. Packets should only be sent to this node after this 
 		// node has sent a ready-to-receive beacon (and node is in listen-for-data state)
@@ -82,7 +82,7 @@ void RicerStateWaitToSend::fromRadioLayer(RicerStateContextInterface *context, R
 				// with BROADCAST_MAC_ADDRESS as destination.
 				throw std::runtime_error("Ricer Data type packet should never be sent to BROADCAST?");
 			}
-			else if(packet->getDestination() == context->getMacParameters().selfNodeId)
+			else if(packet->getDestination() == context->getSelfNodeId())
 			{
 				//throw std::runtime_error("Unexpected data packet addressed to this node in state wait-to-send");
 				// Edge case
@@ -110,7 +110,7 @@ void RicerStateWaitToSend::fromRadioLayer(RicerStateContextInterface *context, R
 		{
 			// If the ACK is addressed to this node, something has gone wrong - we are not expecting to receive an ACK
 			// when waiting to send
-			if(packet->getAckForNode() == context->getMacParameters().selfNodeId)
+			if(packet->getAckForNode() == context->getSelfNodeId())
 			{
 				throw std::runtime_error("Unexpected ACK when waiting to send. Should have received this when in Send state?");
 			}
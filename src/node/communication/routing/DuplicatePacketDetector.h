@@ -0,0 +1,85 @@
+#ifndef _DUPLICATEPACKETDETECTOR_H_
+#define _DUPLICATEPACKETDETECTOR_H_
+
+#include <vector>
+#include <unordered_map>
+
+// Duplicate packet detection for collection routing (CTP / MMBCR), where a duplicate is a packet with the same
+// origin, packet kind, sequence number and hop count as one seen recently.
+// Keeps a fixed size ring of the last CAPACITY packets for each origin. Origins below the dense origin count
+// (normally the number of nodes in the network) are held in a flat array indexed by origin, so checking a packet
+// does not allocate. Any other (sparse) origin IDs fall back to a hash map.
+template <unsigned int CAPACITY>
+class DuplicatePacketDetector
+{
+	public:
+
+		// Sizes the flat array for origins 0 .. denseOriginCount-1, and forgets all packets seen
+		void initialise(unsigned int denseOriginCount)
+		{
+			denseOrigins.assign(denseOriginCount, OriginHistory());
+			sparseOrigins.clear();
+		}
+
+		// Returns true if the packet is a duplicate. Otherwise records the packet (replacing the oldest packet
+		// recorded for the origin, if its ring is full) and returns false
+		bool isDuplicateOtherwiseRecord(int origin, int packetKind, unsigned int seqNo, unsigned int hopCount)
+		{
+			OriginHistory &history = getHistory(origin);
+
+			for(unsigned int i = 0; i < history.count; i++)
+			{
+				const Entry &entry = history.entries[i];
+				if(entry.seqNo == seqNo && entry.hopCount == hopCount && entry.packetKind == packetKind) {
+					return true;
+				}
+			}
+
+			Entry &entry = history.entries[history.next];
+			entry.packetKind = packetKind;
+			entry.seqNo = seqNo;
+			entry.hopCount = hopCount;
+			history.next = (history.next + 1) % CAPACITY;
+			if(history.count < CAPACITY) {
+				history.count++;
+			}
+			return false;
+		}
+
+		// Forgets all packets seen, keeping the flat array allocated
+		void clear()
+		{
+			for(typename std::vector<OriginHistory>::iterator it = denseOrigins.begin(); it != denseOrigins.end(); ++it) {
+				*it = OriginHistory();
+			}
+			sparseOrigins.clear();
+		}
+
+	private:
+
+		struct Entry {
+			int packetKind;
+			unsigned int seqNo;
+			unsigned int hopCount;
+		};
+
+		struct OriginHistory {
+			OriginHistory(): count(0), next(0) { }
+			Entry entries[CAPACITY];
+			unsigned int count;
+			unsigned int next;
+		};
+
+		std::vector<OriginHistory> denseOrigins;
+		std::unordered_map<int, OriginHistory> sparseOrigins;
+
+		OriginHistory &getHistory(int origin)
+		{
+			if(origin >= 0 && origin < (int)denseOrigins.size()) {
+				return denseOrigins[origin];
+			}
+			return sparseOrigins[origin];
+		}
+};
+
+#endif //_DUPLICATEPACKETDETECTOR_H_
@@ -0,0 +1,150 @@
+#ifndef _INDEXEDMINHEAP_H_
+#define _INDEXEDMINHEAP_H_
+
+#include <vector>
+#include <utility>
+
+// Binary min-heap of node IDs ordered by a key, with the position of every node ID held in a flat array indexed
+// by ID, so a node's key can be inserted, changed or removed in O(log n) without searching the heap.
+// Equal keys are ordered by node ID (lowest first). For a max-heap, use the negated key.
+class IndexedMinHeap
+{
+	public:
+
+		bool contains(int nodeId) const
+		{
+			return nodeId >= 0 && nodeId < (int)positions.size() && positions[nodeId] != -1;
+		}
+
+		unsigned int size() const { return heap.size(); }
+
+		// Inserts the node, or moves it to its new position if it is already in the heap
+		void update(int nodeId, double key)
+		{
+			if(nodeId >= (int)positions.size()) {
+				positions.resize(nodeId + 1, -1);
+			}
+
+			int position = positions[nodeId];
+			if(position == -1)
+			{
+				heap.push_back(std::make_pair(key, nodeId));
+				positions[nodeId] = heap.size() - 1;
+				siftUp(heap.size() - 1);
+			}
+			else
+			{
+				heap[position].first = key;
+				siftUp(position);
+				siftDown(positions[nodeId]);
+			}
+		}
+
+		void remove(int nodeId)
+		{
+			if(!contains(nodeId)) {
+				return;
+			}
+
+			int position = positions[nodeId];
+			positions[nodeId] = -1;
+			int last = heap.size() - 1;
+			if(position != last)
+			{
+				// Move the last entry into the gap, then restore the heap order around it
+				int movedNodeId = heap[last].second;
+				heap[position] = heap[last];
+				positions[movedNodeId] = position;
+				heap.pop_back();
+				siftUp(position);
+				siftDown(positions[movedNodeId]);
+			}
+			else
+			{
+				heap.pop_back();
+			}
+		}
+
+		void clear()
+		{
+			for(unsigned int i = 0; i < heap.size(); i++) {
+				positions[heap[i].second] = -1;
+			}
+			heap.clear();
+		}
+
+		// Returns the node ID with the lowest key, ignoring excludedNodeId (which may be -1 to exclude nothing).
+		// Returns -1 if there is no such node. Only the root and its children need to be looked at.
+		int top(int excludedNodeId = -1) const
+		{
+			if(heap.empty()) {
+				return -1;
+			}
+			if(heap[0].second != excludedNodeId) {
+				return heap[0].second;
+			}
+			if(heap.size() == 1) {
+				return -1;
+			}
+			if(heap.size() == 2 || heap[1] < heap[2]) {
+				return heap[1].second;
+			}
+			return heap[2].second;
+		}
+
+		double getKey(int nodeId) const { return heap[positions[nodeId]].first; }
+
+		// Node ID of the entry at a position in the heap (0 .. size()-1), e.g. for choosing a random entry
+		int getNodeIdAt(unsigned int position) const { return heap[position].second; }
+
+	private:
+
+		// (key, node ID) pairs, compared by key then node ID
+		std::vector<std::pair<double, int> > heap;
+		// Position of each node ID in the heap, -1 if not in the heap
+		std::vector<int> positions;
+
+		void swapEntries(int a, int b)
+		{
+			std::swap(heap[a], heap[b]);
+			positions[heap[a].second] = a;
+			positions[heap[b].second] = b;
+		}
+
+		void siftUp(int position)
+		{
+			while(position > 0)
+			{
+				int parent = (position - 1) / 2;
+				if(!(heap[position] < heap[parent])) {
+					break;
+				}
+				swapEntries(position, parent);
+				position = parent;
+			}
+		}
+
+		void siftDown(int position)
+		{
+			int size = heap.size();
+			while(true)
+			{
+				int smallest = position;
+				int left = 2 * position + 1;
+				int right = left + 1;
+				if(left < size && heap[left] < heap[smallest]) {
+					smallest = left;
+				}
+				if(right < size && heap[right] < heap[smallest]) {
+					smallest = right;
+				}
+				if(smallest == position) {
+					break;
+				}
+				swapEntries(position, smallest);
+				position = smallest;
+			}
+		}
+};
+
+#endif //_INDEXEDMINHEAP_H_
@@ -0,0 +1,96 @@
+#ifndef _ROUTINGSTATESNAPSHOT_H_
+#define _ROUTINGSTATESNAPSHOT_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <omnetpp.h>
+#include "SharedRegistry.h"
+
+// Snapshot file of converged routing state, so that later runs over the same topology can start from it instead
+// of converging from empty tables. All nodes of a network share one text file with one record per line:
+//   <nodeId> <section> <fields...>
+// The section says which protocol state the record holds (e.g. "parent", "ctpRoute", "ctpLink") and the fields
+// are written and parsed by that protocol. Records of a node's section are returned in the order they were saved.
+// Modules open and release files as in SharedRegistry. The file is read once, when first loaded from, and truncated
+// when first saved to, in each run
+class RoutingStateSnapshot
+{
+	public:
+
+		static void open(const std::string &fileName)
+		{
+			Registry_t::open(fileName);
+		}
+
+		static void release(const std::string &fileName)
+		{
+			Registry_t::release(fileName);
+		}
+
+		// The records of a section saved by the node, or none if the file has no such records
+		static std::vector<std::string> load(const std::string &fileName, int nodeId, const std::string &section)
+		{
+			File_t &file = Registry_t::get(fileName);
+			if(!file.isLoaded) {
+				parse(fileName, file);
+			}
+			std::map<std::pair<int, std::string>, std::vector<std::string> >::iterator it =
+				file.records.find(std::make_pair(nodeId, section));
+			if(it == file.records.end()) {
+				return std::vector<std::string>();
+			}
+			return it->second;
+		}
+
+		// Appends the records of a section for the node
+		static void save(const std::string &fileName, int nodeId, const std::string &section, const std::vector<std::string> &records)
+		{
+			File_t &file = Registry_t::get(fileName);
+			std::ofstream out(fileName.c_str(), file.isTruncated ? std::ios::app : std::ios::trunc);
+			if(!out) {
+				opp_error("RoutingStateSnapshot: unable to write snapshot file %s", fileName.c_str());
+			}
+			file.isTruncated = true;
+			for(unsigned int i = 0; i < records.size(); i++) {
+				out << nodeId << " " << section << " " << records[i] << "\n";
+			}
+		}
+
+	private:
+
+		struct File_t {
+			File_t(): isLoaded(false), isTruncated(false) { }
+			bool isLoaded;
+			bool isTruncated;
+			std::map<std::pair<int, std::string>, std::vector<std::string> > records;
+		};
+
+		typedef SharedRegistry<RoutingStateSnapshot, std::string, File_t> Registry_t;
+
+		static void parse(const std::string &fileName, File_t &file)
+		{
+			std::ifstream in(fileName.c_str());
+			if(!in) {
+				opp_error("RoutingStateSnapshot: unable to read snapshot file %s", fileName.c_str());
+			}
+			std::string line;
+			while(std::getline(in, line))
+			{
+				std::istringstream fields(line);
+				int nodeId;
+				std::string section;
+				if(!(fields >> nodeId >> section)) {
+					continue;
+				}
+				std::string record;
+				std::getline(fields >> std::ws, record);
+				file.records[std::make_pair(nodeId, section)].push_back(record);
+			}
+			file.isLoaded = true;
+		}
+};
+
+#endif //_ROUTINGSTATESNAPSHOT_H_
@@ -0,0 +1,166 @@
+#ifndef _CTPFAIRQUEUE_H_
+#define _CTPFAIRQUEUE_H_
+
+#include <map>
+#include <deque>
+#include "CtpRoutingPacket_m.h"
+
+// Deficit round robin (DRR) scheduler for packets waiting to be sent by the CTP controller, with one flow per
+// origin (so our own packets are one flow, and each node in our subtree is another). Each flow in turn may send
+// up to quantumBits (plus any deficit carried over from its last turn), so a busy child cannot starve our own
+// packets or quieter children.
+// The buffer is split between local packets (generated by this node) and forwarded packets. When the forwarded
+// share is full, a packet is dropped from the longest forwarded flow, so busy flows lose packets before quiet ones.
+class CtpFairQueue
+{
+	public:
+
+		CtpFairQueue(): localFlowId(-1), localCapacity(0), forwardedCapacity(0), quantumBits(0), localSize(0),
+			forwardedSize(0) { }
+
+		// localFlowId is the flow of our own packets (our node ID), the only flow counted as local
+		void initialise(int localFlowId, unsigned int localCapacity, unsigned int forwardedCapacity, int quantumBits)
+		{
+			this->localFlowId = localFlowId;
+			this->localCapacity = localCapacity;
+			this->forwardedCapacity = forwardedCapacity;
+			this->quantumBits = quantumBits;
+		}
+
+		unsigned int size() const { return localSize + forwardedSize; }
+
+		// Adds the packet to its flow. If there is no room, returns the packet which has been dropped to make room
+		// (which may be the new packet), which the caller must delete. Otherwise returns NULL
+		CtpRoutingPacket *enqueue(CtpRoutingPacket *pkt, int flowId)
+		{
+			CtpRoutingPacket *droppedPkt = NULL;
+			bool isLocal = flowId == localFlowId;
+
+			if(isLocal && localSize >= localCapacity) {
+				// Tail drop within our own packets
+				return pkt;
+			}
+
+			if(!isLocal && forwardedSize >= forwardedCapacity)
+			{
+				// Drop from the longest forwarded flow, unless that is the new packet's flow
+				int longestFlowId = findLongestForwardedFlow();
+				if(longestFlowId == -1 || flows[longestFlowId].packets.size() <= flows[flowId].packets.size()) {
+					return pkt;
+				}
+				Flow &longestFlow = flows[longestFlowId];
+				droppedPkt = longestFlow.packets.back();
+				longestFlow.packets.pop_back();
+				forwardedSize--;
+				if(longestFlow.packets.empty()) {
+					removeFromActiveFlows(longestFlowId);
+				}
+			}
+
+			Flow &flow = flows[flowId];
+			if(flow.packets.empty())
+			{
+				// The flow joins the end of the round
+				flow.deficitBits = 0;
+				flow.turnStarted = false;
+				activeFlowIds.push_back(flowId);
+			}
+			flow.packets.push_back(pkt);
+			if(isLocal) {
+				localSize++;
+			}
+			else {
+				forwardedSize++;
+			}
+
+			return droppedPkt;
+		}
+
+		// Removes and returns the next packet to send, or NULL if there are none
+		CtpRoutingPacket *dequeue()
+		{
+			while(!activeFlowIds.empty())
+			{
+				int flowId = activeFlowIds.front();
+				Flow &flow = flows[flowId];
+
+				if(!flow.turnStarted)
+				{
+					flow.deficitBits += quantumBits;
+					flow.turnStarted = true;
+				}
+
+				CtpRoutingPacket *pkt = flow.packets.front();
+				if(pkt->getBitLength() <= flow.deficitBits)
+				{
+					flow.deficitBits -= pkt->getBitLength();
+					flow.packets.pop_front();
+					if(flowId == localFlowId) {
+						localSize--;
+					}
+					else {
+						forwardedSize--;
+					}
+					if(flow.packets.empty()) {
+						activeFlowIds.pop_front();
+					}
+					return pkt;
+				}
+
+				// Not enough deficit left for the flow's next packet: its turn is over
+				flow.turnStarted = false;
+				activeFlowIds.pop_front();
+				activeFlowIds.push_back(flowId);
+			}
+			return NULL;
+		}
+
+	private:
+
+		struct Flow {
+			Flow(): deficitBits(0), turnStarted(false) { }
+			std::deque<CtpRoutingPacket*> packets;
+			int64 deficitBits;
+			bool turnStarted;
+		};
+
+		int localFlowId;
+		unsigned int localCapacity;
+		unsigned int forwardedCapacity;
+		int quantumBits;
+		unsigned int localSize;
+		unsigned int forwardedSize;
+		std::map<int, Flow> flows;
+		// Flows with packets waiting, in round robin order. The front flow is the one whose turn it is
+		std::deque<int> activeFlowIds;
+
+		int findLongestForwardedFlow()
+		{
+			int longestFlowId = -1;
+			unsigned int longestFlowSize = 0;
+			for(std::deque<int>::iterator it = activeFlowIds.begin(); it != activeFlowIds.end(); ++it)
+			{
+				Flow &flow = flows[*it];
+				if(*it != localFlowId && flow.packets.size() > longestFlowSize)
+				{
+					longestFlowId = *it;
+					longestFlowSize = flow.packets.size();
+				}
+			}
+			return longestFlowId;
+		}
+
+		void removeFromActiveFlows(int flowId)
+		{
+			for(std::deque<int>::iterator it = activeFlowIds.begin(); it != activeFlowIds.end(); ++it)
+			{
+				if(*it == flowId)
+				{
+					activeFlowIds.erase(it);
+					return;
+				}
+			}
+		}
+};
+
+#endif //_CTPFAIRQUEUE_H_
@@ -0,0 +1,128 @@
+#ifndef _CTPNEIGHBOURTABLE_H_
+#define _CTPNEIGHBOURTABLE_H_
+
+#include <vector>
+
+// Everything CTP knows about one neighbour. The link estimator's state and the table manager's routing
+// table entry are held together, so a beacon updates its sender's state with a single lookup
+struct CtpNeighbour_t {
+	// default Constructor: no link estimate, and not in the routing table (-1 means invalid)
+	CtpNeighbour_t(): lastBeaconSeqNoReceived(-1), inWindowFirstSeqNo(0), inWindowLastSeqNo(0), inWindowBeaconsReceived(0),
+		previousInLq(-1), previousEtx(-1), outWindowMessagesSent(0), outWindowMessagesAcked(0),
+		isInRoutingTable(false), nodeMultihopEtxToRoot(-1), etxLinkQualityToNode(-1), parentNodeId(-1), isCongested(false) { }
+
+	// Link estimator state
+	int lastBeaconSeqNoReceived;			// Used to detect and drop duplicate beacons
+	// Window of incoming beacons. Only the first and last seqNo and the count are needed to work out the incoming LQ
+	unsigned int inWindowFirstSeqNo;
+	unsigned int inWindowLastSeqNo;
+	unsigned int inWindowBeaconsReceived;
+	double previousInLq;
+	double previousEtx;
+	// Window of outgoing messages. Only the count and number ACKed are needed to work out the outgoing LQ
+	unsigned int outWindowMessagesSent;
+	unsigned int outWindowMessagesAcked;
+
+	// Table manager (routing table) state. Only valid while isInRoutingTable is set
+	bool isInRoutingTable;
+	double nodeMultihopEtxToRoot;
+	double etxLinkQualityToNode;
+	int parentNodeId;
+	bool isCongested;	// The congestion flag from the node's latest beacon / data packet
+
+	void clearLinkEstimate()
+	{
+		lastBeaconSeqNoReceived = -1;
+		inWindowFirstSeqNo = 0;
+		inWindowLastSeqNo = 0;
+		inWindowBeaconsReceived = 0;
+		previousInLq = -1;
+		previousEtx = -1;
+		outWindowMessagesSent = 0;
+		outWindowMessagesAcked = 0;
+	}
+
+	void clearRoutingInfo()
+	{
+		isInRoutingTable = false;
+		nodeMultihopEtxToRoot = -1;
+		etxLinkQualityToNode = -1;
+		parentNodeId = -1;
+		isCongested = false;
+	}
+};
+
+// Neighbour table shared by the CTP link estimator and table manager. Owned by the table manager, which the
+// link estimator gets it from at initialisation. Entries are held in a contiguous array indexed by node ID
+// (node IDs are 0 .. numNodes-1), so there is one entry for every node whether or not it is a neighbour, and
+// the routing table is the set of entries with isInRoutingTable set.
+class CtpNeighbourTable
+{
+	public:
+
+		CtpNeighbourTable(): routingTableSize(0) { }
+
+		// Allocates an entry for every node in the network
+		void initialise(unsigned int numNodes)
+		{
+			neighbours.assign(numNodes, CtpNeighbour_t());
+			routingTableSize = 0;
+		}
+
+		// Returns the entry for a node. The array grows if the node ID is outside the network, which
+		// invalidates any other entry references held by the caller
+		CtpNeighbour_t &getNeighbour(int nodeId)
+		{
+			if(nodeId >= (int)neighbours.size()) {
+				neighbours.resize(nodeId + 1);
+			}
+			return neighbours[nodeId];
+		}
+
+		// Number of node IDs in the table (not the number of neighbours), for iterating over entries
+		int size() const { return neighbours.size(); }
+
+		// Routing table membership
+		bool isInRoutingTable(int nodeId) const
+		{
+			return nodeId >= 0 && nodeId < (int)neighbours.size() && neighbours[nodeId].isInRoutingTable;
+		}
+		unsigned int getRoutingTableSize() const { return routingTableSize; }
+		void addToRoutingTable(int nodeId)
+		{
+			CtpNeighbour_t &neighbour = getNeighbour(nodeId);
+			if(!neighbour.isInRoutingTable) {
+				routingTableSize++;
+			}
+			neighbour.clearRoutingInfo();
+			neighbour.isInRoutingTable = true;
+		}
+		void removeFromRoutingTable(int nodeId)
+		{
+			if(isInRoutingTable(nodeId)) {
+				neighbours[nodeId].clearRoutingInfo();
+				routingTableSize--;
+			}
+		}
+
+		// For simulating loss of state when the node runs out of energy. Each submodule clears its own state
+		void clearLinkEstimates()
+		{
+			for(unsigned int i = 0; i < neighbours.size(); i++) {
+				neighbours[i].clearLinkEstimate();
+			}
+		}
+		void clearRoutingTable()
+		{
+			for(unsigned int i = 0; i < neighbours.size(); i++) {
+				neighbours[i].clearRoutingInfo();
+			}
+			routingTableSize = 0;
+		}
+
+	private:
+		std::vector<CtpNeighbour_t> neighbours;
+		unsigned int routingTableSize;
+};
+
+#endif //_CTPNEIGHBOURTABLE_H_
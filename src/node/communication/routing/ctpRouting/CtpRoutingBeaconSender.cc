@@ -3,6 +3,8 @@
 // Register the module with Omnet
 Define_Module(CtpRoutingBeaconSender);
 
+const char * CtpRoutingBeaconSender::OUTPUT_BEACONS_SUPPRESSED = "CtpRouting beacons suppressed";
+
 void CtpRoutingBeaconSender::initialize()
 {
 	// Store NED parameters
@@ -10,12 +12,17 @@ void CtpRoutingBeaconSender::initialize()
 	trickleFrequencyCoefficientMin = par("trickleFrequencyCoefficientMin");
 	staticFrequency = par("staticFrequency");
 	beaconFrameSizeBits = par("beaconFrameSizeBits");
+	trickleRedundancyConstant = par("trickleRedundancyConstant");
+	trickleConsistencyTolerance = par("trickleConsistencyTolerance");
 	
 	// Initialise private variables
 	currentBeaconSequenceNumber = 0;
 	currentMultihopEtxToRoot = -1;	// -1 represents invalid
 	currentParentNodeId = -1;		// -1 represents no parent
+	parentMultihopEtxToRoot = -1;
 	setPullFlag = false;
+	consistentBeaconsHeard = 0;
+	isCongested = false;
 	
 	// We just need this temporarily in order to set the clock drift on the timer service for this module
 	ResourceManager *resMgrModule = check_and_cast <ResourceManager*>(
@@ -32,6 +39,9 @@ void CtpRoutingBeaconSender::initialize()
 	// Set the timer drift for the timer service. If we do not do this all timers will return immediately!
 	setTimerDrift(resMgrModule->getCPUClockDrift());
 
+	// Declare stats outputs
+	declareOutput(OUTPUT_BEACONS_SUPPRESSED);
+
 	// Get the Node ID - we need this for setting the origin / source of beacons
 	selfNodeId = getParentModule() // Routing container module
 		->getParentModule()  // Communication module
@@ -58,36 +68,33 @@ void CtpRoutingBeaconSender::handleMessage(cMessage *msg)
 			switch(controlMsg->getBeaconSenderControlMessageKind())
 			{
 				case BEACON_SENDER_UPDATE_MULTIHOP_ETX_TO_ROOT: {
-					trace() << "New multihop ETX to root: " << controlMsg->getMultihopEtxToRoot();
-					currentMultihopEtxToRoot = controlMsg->getMultihopEtxToRoot();
+					updateMultihopEtxToRoot(controlMsg->getMultihopEtxToRoot());
 					break;
 				}
 
 				case BEACON_SENDER_NEW_PARENT: {
-					trace() << "Updating parent, trickle reset";
-					currentParentNodeId = controlMsg->getParentNodeId();
-					// Also reset trickle
-					resetTrickle();
+					updateParent(controlMsg->getParentNodeId());
 					break;
 				}
 
 				case BEACON_SENDER_RESET_TRICKLE: {
-					trace() << "Trickle reset";
-					// Reset trickle send interval
-					resetTrickle();
+					requestTrickleReset(false);
 					break;
 				}
 
-				// Note: this event is called on bootup by the controller to initiate beacon sending
-				case BEACON_SENDER_RESET_TRICKLE_AND_PULL: {
-					trace() << "Trickle reset and pull";
-
-					// Indicate that the next beacon to be sent should set the pull flag
-					setPullFlag = true;
+				case BEACON_SENDER_UPDATE_CONGESTION: {
+					updateCongestion(controlMsg->getCongested());
+					break;
+				}
 
-					// Reset trickle send interval
-					resetTrickle();
+				case BEACON_SENDER_BEACON_HEARD: {
+					beaconHeard(controlMsg->getNodeId(), controlMsg->getParentNodeId(), controlMsg->getMultihopEtxToRoot());
+					break;
+				}
 
+				// Note: this event is called on bootup by the controller to initiate beacon sending
+				case BEACON_SENDER_RESET_TRICKLE_AND_PULL: {
+					requestTrickleReset(true);
 					break;
 				}
 
@@ -100,17 +107,7 @@ void CtpRoutingBeaconSender::handleMessage(cMessage *msg)
 
 		case OUT_OF_ENERGY:
 		{
-			// We need to simulate what happens when a node runs out of energy - all state will be lost
-
-			// Reinitialise private variables
-			// DO NOT RESET currentBeaconSequenceNumber - no need, and will break duplicate packet checking when other nodes restart
-			currentMultihopEtxToRoot = -1;	// -1 represents invalid
-			currentParentNodeId = -1;		// -1 represents no parent
-			setPullFlag = false;
-			// Reset trickle coefficient
-			trickleFrequencyCoefficientCurrent = trickleFrequencyCoefficientMin;
-			// Cancel any pending timers
-			cancelAllTimers();
+			outOfEnergy();
 			break;
 		}
 
@@ -123,6 +120,67 @@ void CtpRoutingBeaconSender::handleMessage(cMessage *msg)
 	cancelAndDelete(msg);
 }
 
+void CtpRoutingBeaconSender::updateMultihopEtxToRoot(double multihopEtxToRoot)
+{
+	Enter_Method_Silent();
+	trace() << "New multihop ETX to root: " << multihopEtxToRoot;
+	currentMultihopEtxToRoot = multihopEtxToRoot;
+}
+
+void CtpRoutingBeaconSender::updateParent(int parentNodeId)
+{
+	Enter_Method_Silent();
+	trace() << "Updating parent, trickle reset";
+	currentParentNodeId = parentNodeId;
+	parentMultihopEtxToRoot = -1;
+	// Also reset trickle
+	resetTrickle();
+}
+
+void CtpRoutingBeaconSender::requestTrickleReset(bool setPull)
+{
+	Enter_Method_Silent();
+	if(setPull)
+	{
+		trace() << "Trickle reset and pull";
+		// Indicate that the next beacon to be sent should set the pull flag
+		setPullFlag = true;
+	}
+	else
+	{
+		trace() << "Trickle reset";
+	}
+
+	// Reset trickle send interval
+	resetTrickle();
+}
+
+void CtpRoutingBeaconSender::updateCongestion(bool congested)
+{
+	Enter_Method_Silent();
+	trace() << "Congestion flag in beacons is now " << congested;
+	isCongested = congested;
+}
+
+void CtpRoutingBeaconSender::outOfEnergy()
+{
+	Enter_Method_Silent();
+	// We need to simulate what happens when a node runs out of energy - all state will be lost
+
+	// Reinitialise private variables
+	// DO NOT RESET currentBeaconSequenceNumber - no need, and will break duplicate packet checking when other nodes restart
+	currentMultihopEtxToRoot = -1;	// -1 represents invalid
+	currentParentNodeId = -1;		// -1 represents no parent
+	parentMultihopEtxToRoot = -1;
+	setPullFlag = false;
+	isCongested = false;
+	consistentBeaconsHeard = 0;
+	// Reset trickle coefficient
+	trickleFrequencyCoefficientCurrent = trickleFrequencyCoefficientMin;
+	// Cancel any pending timers
+	cancelAllTimers();
+}
+
 void CtpRoutingBeaconSender::resetTrickle()
 {
 	// Cancel any pending beacon timer
@@ -142,13 +200,16 @@ void CtpRoutingBeaconSender::sendNextBeacon()
 	// Calculate the next sending interval
 	calculateSendingInterval();
 
+	// Start counting consistent beacons for the next interval
+	consistentBeaconsHeard = 0;
+
 	// Send the beacon
 	
 	CtpRoutingPacket *beacon = new CtpRoutingPacket("CTP beacon", NETWORK_LAYER_PACKET);
 	beacon->setRoutingPacketKind(CTP_ROUTING_PACKET_TYPE_BEACON);
 	beacon->setDestination(BROADCAST_NETWORK_ADDRESS);
 	beacon->setSource(std::to_string(selfNodeId).c_str());
-	beacon->setOrigin(std::to_string(selfNodeId).c_str());
+	beacon->setOrigin(selfNodeId);
 	beacon->setHopCount(0);
 	beacon->setSequenceNumber(currentBeaconSequenceNumber++);
 	beacon->setMultihopEtxToRoot(currentMultihopEtxToRoot);
@@ -156,6 +217,8 @@ void CtpRoutingBeaconSender::sendNextBeacon()
 	// Set the node ID of the sending node (this node)
 	// Used to make sure two nodes do not select each other as parents
 	beacon->setParentNodeId(currentParentNodeId);
+	// Tell children if our forwarding queue is congested
+	beacon->setCongestionFlag(isCongested);
 
 	// Set the pull flag if necessary
 	if(setPullFlag)
@@ -182,6 +245,67 @@ void CtpRoutingBeaconSender::sendNextBeacon()
 	advanceNextTrickleStep();
 }
 
+bool CtpRoutingBeaconSender::isNextBeaconRedundant()
+{
+	// A beacon with the pull flag is never suppressed
+	return trickleRedundancyConstant > 0 && !setPullFlag && consistentBeaconsHeard >= trickleRedundancyConstant;
+}
+
+void CtpRoutingBeaconSender::suppressNextBeacon()
+{
+	trace() << "Suppressing beacon, heard " << consistentBeaconsHeard << " consistent beacons this interval";
+	plotTrace() << "#ROU_SUPPRESS_BEACON";
+	collectOutput(OUTPUT_BEACONS_SUPPRESSED);
+
+	// The beacon sequence number is not advanced, so neighbours' link estimators do not count a lost beacon
+
+	// Carry on with the next interval as if the beacon had been sent
+	calculateSendingInterval();
+	consistentBeaconsHeard = 0;
+	setTimer(BEACON_SENDER_TIMER_SEND_NEXT_BEACON, trickleSendingIntervalCurrent);
+	advanceNextTrickleStep();
+}
+
+void CtpRoutingBeaconSender::beaconHeard(int fromNodeId, int sendersParentNodeId, double multihopEtxToRoot)
+{
+	Enter_Method_Silent();
+	if(trickleRedundancyConstant <= 0) {
+		return;
+	}
+
+	// Inconsistencies which matter to routing reset trickle, so that neighbours soon hear our up to date route. 
+	// A plain MH-ETX mismatch is not one: nodes at different depths always advertise different MH-ETXs.
+	// Our parent's MH-ETX moving beyond the tolerance moves ours with it
+	if(fromNodeId == currentParentNodeId)
+	{
+		bool hasParentMoved = parentMultihopEtxToRoot != -1 
+			&& fabs(multihopEtxToRoot - parentMultihopEtxToRoot) > trickleConsistencyTolerance;
+		parentMultihopEtxToRoot = multihopEtxToRoot;
+		if(hasParentMoved)
+		{
+			trace() << "Parent " << fromNodeId << " now advertises MH-ETX " << multihopEtxToRoot << ", trickle reset";
+			resetTrickle();
+			return;
+		}
+	}
+	// A child routing through us must have a higher MH-ETX than ours, otherwise it has out of date information about us
+	if(sendersParentNodeId == selfNodeId && currentMultihopEtxToRoot != -1 && multihopEtxToRoot != -1
+		&& multihopEtxToRoot < currentMultihopEtxToRoot)
+	{
+		trace() << "Child " << fromNodeId << " advertises MH-ETX " << multihopEtxToRoot << " lower than ours, trickle reset";
+		resetTrickle();
+		return;
+	}
+
+	// Otherwise, a neighbour's beacon is consistent if it advertises the same MH-ETX as us (within the tolerance)
+	if(currentMultihopEtxToRoot != -1
+		&& multihopEtxToRoot != -1
+		&& fabs(multihopEtxToRoot - currentMultihopEtxToRoot) <= trickleConsistencyTolerance)
+	{
+		consistentBeaconsHeard++;
+	}
+}
+
 void CtpRoutingBeaconSender::calculateSendingInterval()
 {
 	// The interval used in the Trickle algorithm is a random value
@@ -211,7 +335,14 @@ void CtpRoutingBeaconSender::timerFiredCallback(int index)
 {
 	switch(index) {
 		case BEACON_SENDER_TIMER_SEND_NEXT_BEACON: {
-			sendNextBeacon();
+			if(isNextBeaconRedundant())
+			{
+				suppressNextBeacon();
+			}
+			else
+			{
+				sendNextBeacon();
+			}
 			break;
 		}
 
@@ -19,8 +19,11 @@ class CtpRoutingBeaconSender : public CastaliaModule, public TimerService
 		double trickleFrequencyCoefficientMax;
 		double trickleFrequencyCoefficientMin;
 		int beaconFrameSizeBits;
+		int trickleRedundancyConstant;
+		double trickleConsistencyTolerance;
 
 		// Other private variables:
+		static const char *OUTPUT_BEACONS_SUPPRESSED;
 		double trickleFrequencyCoefficientCurrent;
 		double trickleSendingIntervalCurrent;
 		bool staticFrequency;
@@ -28,14 +31,30 @@ class CtpRoutingBeaconSender : public CastaliaModule, public TimerService
 		int currentBeaconSequenceNumber;
 		double currentMultihopEtxToRoot;
 		int currentParentNodeId;
+		double parentMultihopEtxToRoot;	// As last advertised in our parent's beacons, -1 if not heard yet
 		bool setPullFlag;
+		int consistentBeaconsHeard;
+		bool isCongested;
 		
 		// Private member functions:
 		void resetTrickle();
 		void sendNextBeacon();
+		void suppressNextBeacon();
+		bool isNextBeaconRedundant();
 		void calculateSendingInterval();
 		void advanceNextTrickleStep();
 
+	public:
+
+		// Direct calls from the other CTP submodules (used instead of control messages when the
+		// CtpRouting directSubmoduleCalls parameter is set)
+		void updateMultihopEtxToRoot(double multihopEtxToRoot);
+		void updateParent(int parentNodeId);
+		void requestTrickleReset(bool setPull);
+		void updateCongestion(bool congested);
+		void beaconHeard(int fromNodeId, int sendersParentNodeId, double multihopEtxToRoot);
+		void outOfEnergy();
+
 	protected:
 		
 		// Virtual methods from CastaliaModule / TimerService class
@@ -1,4 +1,8 @@
 #include "CtpRoutingController.h"
+#include "CtpRoutingBeaconSender.h"
+#include "CtpRoutingLinkEstimator.h"
+#include "CtpRoutingTableManager.h"
+#include <algorithm>
 
 // Register the module in Omnet++
 Define_Module(CtpRoutingController);
@@ -8,9 +12,24 @@ const char * CtpRoutingController::OUTPUT_CTP_DROPPED_OUT_OF_ENERGY = "CtpRoutin
 const char * CtpRoutingController::OUTPUT_CTP_SENDING_RETRY = "CtpRouting retrying send";
 const char * CtpRoutingController::OUTPUT_CTP_FORWARDING = "CtpRouting received packet for forwarding";
 const char * CtpRoutingController::OUTPUT_CTP_HOP_COUNT = "CtpRouting hop count";
+const char * CtpRoutingController::OUTPUT_CTP_CONGESTION_BACKOFF = "CtpRouting backed off for congested parent";
+const char * CtpRoutingController::OUTPUT_CTP_DELIVERED_TO_ROOT = "CtpRouting delivered to root";
+const char * CtpRoutingController::OUTPUT_CTP_AGGREGATE_SIZE = "CtpRouting packets per aggregate";
+const char * CtpRoutingController::OUTPUT_CTP_FAIR_QUEUE_DROP = "CtpRouting fair queue overflow";
+const char * CtpRoutingController::OUTPUT_CTP_PRIORITY_QUEUE_DROP = "CtpRouting priority queue overflow";
+const char * CtpRoutingController::OUTPUT_CTP_NV_BYTES_WRITTEN = "CtpRouting non-volatile bytes written";
+const char * CtpRoutingController::OUTPUT_CTP_JOURNEY_END_TO_END = "CtpRouting journey end-to-end delay";
+const char * CtpRoutingController::OUTPUT_CTP_JOURNEY_DELAY_BY_NODE = "CtpRouting journey delay by node";
+const char * CtpRoutingController::OUTPUT_CTP_JOURNEY_DELAY_BY_HOP = "CtpRouting journey delay by hop";
+const char * CtpRoutingController::OUTPUT_CTP_PARENT_FAILOVER = "CtpRouting parent failover";
+const char * CtpRoutingController::OUTPUT_CTP_PULL_RESETS_SUPPRESSED = "CtpRouting pull resets suppressed";
+const char * CtpRoutingController::OUTPUT_CTP_RESTART_ROUTE_DISCOVERY = "CtpRouting restart route discovery";
 
 void CtpRoutingController::startup()
 {
+	// Only a restart (after running out of energy) has retained state to restore
+	bool isRestart = hasStartedUpOnce;
+
 	// Check if we have already started up once already
 	if(!hasStartedUpOnce)
 	{
@@ -22,17 +41,131 @@ void CtpRoutingController::startup()
 		repairLoopWaitTimeRange = par("repairLoopWaitTimeMax").doubleValue() - par("repairLoopWaitTimeMin").doubleValue();
 		implementRetries = par("implementRetries");
 		delayBeforeRouteDiscoveryPropagation = par("delayBeforeRouteDiscoveryPropagation");
+		useSnoopedDataForRouting = par("useSnoopedDataForRouting");
+		congestionSignalling = par("congestionSignalling");
+		congestionBufferThreshold = (unsigned int) ceil(par("congestionBufferFraction").doubleValue() * (int) par("netBufferSize"));
+		congestionBackoffMin = par("congestionBackoffMin");
+		congestionBackoffRange = par("congestionBackoffMax").doubleValue() - par("congestionBackoffMin").doubleValue();
+		aggregateForwardedPackets = par("aggregateForwardedPackets");
+		aggregationMaxPackets = par("aggregationMaxPackets");
+		aggregationMaxDelay = par("aggregationMaxDelay");
+		aggregatedPacketRecordBits = par("aggregatedPacketRecordBits");
+		fairQueueing = par("fairQueueing");
+		if(fairQueueing)
+		{
+			unsigned int localCapacity = (unsigned int) ceil(par("localBufferFraction").doubleValue() * netBufferSize);
+			fairQueue.initialise(self, localCapacity, netBufferSize - localCapacity, par("fairQueueQuantumBits"));
+		}
+		packetPriorities = par("packetPriorities");
+		if(packetPriorities)
+		{
+			if(fairQueueing) {
+				opp_error("CTP fair queueing and packet priorities cannot both be enabled");
+			}
+			priorityScheduler.initialise(par("priorityScheduling"), par("priorityWeights"));
+			std::vector<std::string> applicationIds = cStringTokenizer(par("urgentApplicationIds")).asVector();
+			urgentApplicationIds.insert(applicationIds.begin(), applicationIds.end());
+		}
+		loadRoutingSnapshotFile = par("loadRoutingSnapshotFile").stringValue();
+		saveRoutingSnapshotFile = par("saveRoutingSnapshotFile").stringValue();
+		saveRoutingSnapshotTime = par("saveRoutingSnapshotTime");
+		if(saveRoutingSnapshotFile != "" && saveRoutingSnapshotTime < 0) {
+			opp_error("saveRoutingSnapshotTime must be set to save a routing snapshot");
+		}
+		nvStateRetention = par("nvStateRetention");
+		nvRetainRoutes = false;
+		nvRetainLinks = false;
+		std::vector<std::string> retainedState = cStringTokenizer(par("nvRetainedState")).asVector();
+		for(unsigned int i = 0; i < retainedState.size(); i++)
+		{
+			if(retainedState[i] == "routes") {
+				nvRetainRoutes = true;
+			}
+			else if(retainedState[i] == "links") {
+				nvRetainLinks = true;
+			}
+			else {
+				opp_error("Unknown CTP retained state '%s', expected routes and / or links", retainedState[i].c_str());
+			}
+		}
+		nvCheckpointInterval = par("nvCheckpointInterval");
+		nvWriteEnergyPerByte = par("nvWriteEnergyPerByte").doubleValue() * 1e-9; // nJ to J
+		collectPacketJourneys = par("collectPacketJourneys");
+		parentFailoverThreshold = par("parentFailoverThreshold");
+		parentFailoverHoldTime = par("parentFailoverHoldTime");
+		passiveListenTime = par("passiveListenTime");
+		restartJitterPerNeighbour = par("restartJitterPerNeighbour");
+		restartJitterMax = par("restartJitterMax");
+		// The routing table is cleared when we run out of energy, so the jitter can only be scaled by the number of
+		// neighbours if they are heard again while listening, or restored from non-volatile memory
+		if(restartJitterPerNeighbour > 0 && passiveListenTime <= 0 && !(nvStateRetention && nvRetainRoutes)) {
+			opp_error("restartJitterPerNeighbour needs passiveListenTime, or nvStateRetention of routes, to count neighbours after a restart");
+		}
+		maxPullResetsPerWindow = par("maxPullResetsPerWindow");
+		pullResetWindow = par("pullResetWindow");
+		if(collectPacketJourneys) {
+			PacketJourney::open();
+		}
 
 		// The net data frame overhead is in the containing compound module, so it can be defined in the base module
 		// and used in other routing modules
 		networkDataFrameOverheadBits = getParentModule()->par("networkDataFrameOverheadBits");
 
+		// The direct call switch is in the containing compound module, as it applies to all CTP submodules
+		directSubmoduleCalls = getParentModule()->par("directSubmoduleCalls");
+		beaconSender = check_and_cast<CtpRoutingBeaconSender*>(getParentModule()->getSubmodule("BeaconSender"));
+		// The beacon sender only needs to hear about neighbours' beacons if it suppresses redundant beacons
+		trickleSuppression = (int) beaconSender->par("trickleRedundancyConstant") > 0;
+		linkEstimator = check_and_cast<CtpRoutingLinkEstimator*>(getParentModule()->getSubmodule("LinkEstimator"));
+		tableManager = check_and_cast<CtpRoutingTableManager*>(getParentModule()->getSubmodule("TableManager"));
+		node = getParentModule() // Routing module
+			->getParentModule() // Communication module
+			->getParentModule(); // Node module
+		if(nvStateRetention) {
+			NonVolatileStorage::open(node);
+		}
+
+		// Node IDs are 0 .. numNodes-1, so size the duplicate detection buffer to hold all of them in a flat array
+		duplicateDetectionBuffer.initialise(getParentModule() // Routing module
+			->getParentModule() // Communication module
+			->getParentModule() // Node module
+			->getParentModule() // Network module
+			->par("numNodes"));
+
 		// Declare stats outputs
 		declareOutput(OUTPUT_CTP_DROPPED_AFTER_MAX_RETRIES);
 		declareOutput(OUTPUT_CTP_DROPPED_OUT_OF_ENERGY);
 		declareOutput(OUTPUT_CTP_SENDING_RETRY);
 		declareOutput(OUTPUT_CTP_FORWARDING);
 		declareHistogram(OUTPUT_CTP_HOP_COUNT, 1, 10, 10);
+		declareOutput(OUTPUT_CTP_CONGESTION_BACKOFF);
+		declareOutput(OUTPUT_CTP_DELIVERED_TO_ROOT);
+		declareHistogram(OUTPUT_CTP_AGGREGATE_SIZE, 2, 10, 8);
+		declareOutput(OUTPUT_CTP_FAIR_QUEUE_DROP);
+		declareOutput(OUTPUT_CTP_PRIORITY_QUEUE_DROP);
+		declareOutput(OUTPUT_CTP_NV_BYTES_WRITTEN);
+		declareOutput(OUTPUT_CTP_JOURNEY_END_TO_END);
+		declareOutput(OUTPUT_CTP_JOURNEY_DELAY_BY_NODE);
+		declareOutput(OUTPUT_CTP_JOURNEY_DELAY_BY_HOP);
+		declareOutput(OUTPUT_CTP_PARENT_FAILOVER);
+		declareOutput(OUTPUT_CTP_PULL_RESETS_SUPPRESSED);
+		declareOutput(OUTPUT_CTP_RESTART_ROUTE_DISCOVERY);
+
+		// DO NOT RESET THE AGGREGATE SEQUENCE NUMBER ON RESTART, for the same reason as the packet sequence number
+		aggregateSequenceNumber = 0;
+
+		// A snapshot is only restored at the very first startup: a restart after running out of energy loses
+		// everything, as usual. Restored by a timer because on first startup this is called during initialisation,
+		// before the other submodules have been initialised
+		if(loadRoutingSnapshotFile != "")
+		{
+			RoutingStateSnapshot::open(loadRoutingSnapshotFile);
+			setTimer(CTP_ROUTING_CONTROLLER_TIMER_RESTORE_SNAPSHOT, 0);
+		}
+		if(saveRoutingSnapshotFile != "")
+		{
+			RoutingStateSnapshot::open(saveRoutingSnapshotFile);
+		}
 
 		hasStartedUpOnce = true;
 	}
@@ -46,10 +179,45 @@ void CtpRoutingController::startup()
 	currentParentNodeId = -1; 		// -1 indicates invalid / no parent
 	currentMultihopEtxToRoot = -1; 	// -1 indicates invalid / no parent
 	currentPacketSendingAttempts = 0;
+	setPullFlagOnNextDataPacket = false;
+	isCongested = false;
+	parentIsCongested = false;
+	congestionBackoffComplete = false;
+	aggregationBufferBits = 0;
+	routeRestoredOnRestart = false;
+	consecutiveSendFailures = 0;
+	fallbackParentNodeId = -1;
+	fallbackPathEtx = -1;
+	listenedBeforePull = false;
+	pullResetWindowStart = -1;
+	pullResetsInWindow = 0;
+
+	if(nvStateRetention)
+	{
+		if(isRestart)
+		{
+			routeRestoredOnRestart = restoreRoutingState(
+				nvRetainLinks ? NonVolatileStorage::read(node, "ctpLink") : std::vector<std::string>(),
+				nvRetainRoutes ? NonVolatileStorage::read(node, "ctpRoute") : std::vector<std::string>());
+		}
+		setTimer(CTP_ROUTING_CONTROLLER_TIMER_NV_CHECKPOINT, nvCheckpointInterval);
+	}
 
+	// On a restart, optionally listen for routes before pulling (see scheduleRouteDiscoveryAfterRestartJitter for
+	// the rest of the restart storm control). A route restored from non-volatile memory is not pulled for anyway
+	if(isRestart && !routeRestoredOnRestart && passiveListenTime > 0)
+	{
+		trace() << "Restarted, listening for routes for " << passiveListenTime << "s before pulling";
+		listenedBeforePull = true;
+		setTimer(CTP_ROUTING_CONTROLLER_TIMER_PASSIVE_LISTEN, passiveListenTime);
+	}
+	else if(isRestart && restartJitterPerNeighbour > 0)
+	{
+		scheduleRouteDiscoveryAfterRestartJitter();
+	}
 	// An optional delay before initiating route discovery and propogation with beacons
 	// May be useful, e.g. to enable time / beacon synced MAC layers to settle 
-	if (delayBeforeRouteDiscoveryPropagation == 0)
+	else if (delayBeforeRouteDiscoveryPropagation == 0)
 	{
 		initiateRouteDiscoveryAndPropagation();
 	}
@@ -57,6 +225,57 @@ void CtpRoutingController::startup()
 	{
 		setTimer(CTP_ROUTING_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION, delayBeforeRouteDiscoveryPropagation);
 	}
+
+	// (Re)schedule the snapshot, unless we restarted after it was due
+	if(saveRoutingSnapshotFile != "" && saveRoutingSnapshotTime >= simTime().dbl())
+	{
+		setTimer(CTP_ROUTING_CONTROLLER_TIMER_SAVE_SNAPSHOT, saveRoutingSnapshotTime - simTime().dbl());
+	}
+}
+
+bool CtpRoutingController::restoreRoutingState(const std::vector<std::string> &linkRecords, const std::vector<std::string> &routeRecords)
+{
+	// Link estimates first, so that they are in place when the routing table is restored and a parent chosen
+	linkEstimator->restoreLinkEstimates(linkRecords);
+	return tableManager->restoreRoutingTable(routeRecords);
+}
+
+void CtpRoutingController::restoreRoutingSnapshot()
+{
+	restoreRoutingState(RoutingStateSnapshot::load(loadRoutingSnapshotFile, self, "ctpLink"),
+		RoutingStateSnapshot::load(loadRoutingSnapshotFile, self, "ctpRoute"));
+}
+
+void CtpRoutingController::writeNonVolatileCheckpoint()
+{
+	unsigned int bytesWritten = 0;
+	if(nvRetainRoutes)
+	{
+		bytesWritten += NonVolatileStorage::write(node, "ctpRoute", tableManager->getRoutingTableRecords(),
+			NV_ROUTE_RECORD_BYTES, nvWriteEnergyPerByte);
+	}
+	if(nvRetainLinks)
+	{
+		bytesWritten += NonVolatileStorage::write(node, "ctpLink", linkEstimator->getLinkEstimateRecords(),
+			NV_LINK_RECORD_BYTES, nvWriteEnergyPerByte);
+	}
+	if(bytesWritten > 0)
+	{
+		trace() << "Wrote " << bytesWritten << " bytes of routing state to non-volatile memory";
+		collectOutput(OUTPUT_CTP_NV_BYTES_WRITTEN, "", bytesWritten);
+	}
+}
+
+void CtpRoutingController::saveRoutingSnapshot()
+{
+	trace() << "Saving routing snapshot, parent " << currentParentNodeId;
+	// The parent on its own, so that other protocols (e.g. StaticRouting) can use the same routes
+	if(currentParentNodeId != -1)
+	{
+		RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "parent", std::vector<std::string>(1, std::to_string(currentParentNodeId)));
+	}
+	RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "ctpRoute", tableManager->getRoutingTableRecords());
+	RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "ctpLink", linkEstimator->getLinkEstimateRecords());
 }
 
 void CtpRoutingController::initiateRouteDiscoveryAndPropagation()
@@ -66,11 +285,94 @@ void CtpRoutingController::initiateRouteDiscoveryAndPropagation()
 	// neighbous that we want to quickly receive up to date routing info
 	// (this is useful if a node startup is delayed with respect to the rest of the network,
 	// which may be mature and established and therefore sending beacons very infrequently)
+	// Always sent as a message, not a direct call: on first startup this is called during initialisation,
+	// before the beacon sender has been initialised
+	if(listenedBeforePull && currentParentNodeId != -1)
+	{
+		// We chose a parent from beacons overheard while listening after restart, and Trickle was reset (without
+		// pull) to advertise it then, so there is nothing more to do
+		trace() << "Route to parent " << currentParentNodeId << " heard while listening, not pulling";
+		collectOutput(OUTPUT_CTP_RESTART_ROUTE_DISCOVERY, "heard passively");
+		return;
+	}
+	if(listenedBeforePull)
+	{
+		collectOutput(OUTPUT_CTP_RESTART_ROUTE_DISCOVERY, "pulled");
+	}
+	if(routeRestoredOnRestart)
+	{
+		// We already have a route from non-volatile memory, so only advertise it. Neighbours don't all need to
+		// send us their routing info, it is revalidated as it comes
+		BeaconSenderControlMessage *resetTrickleMsg = new BeaconSenderControlMessage("Reset trickle message", BEACON_SENDER_CONTROL_COMMAND);
+		resetTrickleMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_RESET_TRICKLE);
+		send(resetTrickleMsg, "toBeaconSender");
+		return;
+	}
+	setPullFlagOnNextDataPacket = useSnoopedDataForRouting;
 	BeaconSenderControlMessage *resetTrickleMsg = new BeaconSenderControlMessage("Reset trickle and pull message", BEACON_SENDER_CONTROL_COMMAND);
 	resetTrickleMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_RESET_TRICKLE_AND_PULL);
 	send(resetTrickleMsg, "toBeaconSender");
 }
 
+// Nodes which restart together would otherwise all pull at once, and each pull resets Trickle in every neighbour
+// which hears it. The more neighbours we have, the more nodes are likely to be restarting around us, so the window
+// the pull is spread over grows with the number in our routing table: the neighbours we have heard while listening
+// since restarting, or those restored from non-volatile memory (see the check in startup)
+void CtpRoutingController::scheduleRouteDiscoveryAfterRestartJitter()
+{
+	unsigned int neighbours = std::max(tableManager->getNeighbourTable().getRoutingTableSize(), 1u);
+	double jitter = 0;
+	if(restartJitterPerNeighbour > 0)
+	{
+		jitter = uniform(0, std::min(restartJitterPerNeighbour * neighbours, restartJitterMax));
+	}
+	trace() << "Route discovery after restart jitter " << jitter << "s (" << neighbours << " neighbours)";
+	if(delayBeforeRouteDiscoveryPropagation + jitter == 0)
+	{
+		initiateRouteDiscoveryAndPropagation();
+	}
+	else
+	{
+		setTimer(CTP_ROUTING_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION, delayBeforeRouteDiscoveryPropagation + jitter);
+	}
+}
+
+// Rate limits Trickle resets in response to pull flags. Several neighbours restarting together each pull, but one
+// reset is enough to send them all our routing info quickly
+bool CtpRoutingController::isPullResetAllowed()
+{
+	if(maxPullResetsPerWindow == 0)
+	{
+		return true;
+	}
+	if(pullResetWindowStart < 0 || simTime().dbl() - pullResetWindowStart >= pullResetWindow)
+	{
+		pullResetWindowStart = simTime().dbl();
+		pullResetsInWindow = 0;
+	}
+	if(pullResetsInWindow >= maxPullResetsPerWindow)
+	{
+		trace() << "Already reset trickle for " << pullResetsInWindow << " pulls in this window, ignoring pull";
+		collectOutput(OUTPUT_CTP_PULL_RESETS_SUPPRESSED);
+		return false;
+	}
+	pullResetsInWindow++;
+	return true;
+}
+
+void CtpRoutingController::requestTrickleReset(bool setPull)
+{
+	if(directSubmoduleCalls)
+	{
+		beaconSender->requestTrickleReset(setPull);
+		return;
+	}
+	BeaconSenderControlMessage *resetTrickleMsg = new BeaconSenderControlMessage(
+		setPull ? "Reset trickle and pull message" : "Reset trickle message", BEACON_SENDER_CONTROL_COMMAND);
+	resetTrickleMsg->setBeaconSenderControlMessageKind(setPull ? BEACON_SENDER_RESET_TRICKLE_AND_PULL : BEACON_SENDER_RESET_TRICKLE);
+	send(resetTrickleMsg, "toBeaconSender");
+}
+
 void CtpRoutingController::handleOutOfEnergy(cMessage *outOfEnergyMsg)
 {
 	// We need to simulate what happens when a node runs out of energy - all state will be lost
@@ -93,28 +395,60 @@ void CtpRoutingController::handleOutOfEnergy(cMessage *outOfEnergyMsg)
 		cancelAndDelete(pkt);
 		collectOutput(OUTPUT_CTP_DROPPED_OUT_OF_ENERGY);
 	}
+	while ((pkt = fairQueue.dequeue()) != NULL) {
+		delete pkt;
+		collectOutput(OUTPUT_CTP_DROPPED_OUT_OF_ENERGY);
+	}
+	for(int c = 0; c < PacketPriority::NUMBER_OF_CLASSES; c++)
+	{
+		while(!priorityQueues[c].empty())
+		{
+			delete priorityQueues[c].front();
+			priorityQueues[c].pop_front();
+			collectOutput(OUTPUT_CTP_DROPPED_OUT_OF_ENERGY);
+		}
+	}
+	clearAggregationBuffer();
 
 	// DO NOT RESET THE PACKET SEQUENCE NUMBER - OTHERWISE DUPLICATE PACKET CHECKING WILL ERRONEOUSLY DISCARD PACKETS WHEN NODES RESTART
 
 	// No need to reinitialise private variables set in startup() - startup will be called when node restarts
 
 	// Signal to sub-modules that we are out of energy
-	send(outOfEnergyMsg->dup(), "toBeaconSender");
-	send(outOfEnergyMsg->dup(), "toLinkEstimator");
-	send(outOfEnergyMsg->dup(), "toTableManager");
+	if(directSubmoduleCalls)
+	{
+		beaconSender->outOfEnergy();
+		linkEstimator->outOfEnergy();
+		tableManager->outOfEnergy();
+	}
+	else
+	{
+		send(outOfEnergyMsg->dup(), "toBeaconSender");
+		send(outOfEnergyMsg->dup(), "toLinkEstimator");
+		send(outOfEnergyMsg->dup(), "toTableManager");
+	}
 	cancelAndDelete(outOfEnergyMsg);
 }
 
 void CtpRoutingController::fromApplicationLayer(cPacket *pkt, const char *destination)
 {
-	// We are only handling the case where application specifies sink node as destination.
+	// We are only handling the case where application specifies the collection anycast address or a sink node as
+	// destination. Either way the packet goes to whichever sink our route leads to.
 	// Also we don't expect the sink to send application data packets.
-	if(atoi(destination) != sinkNodeId || isSink) {
-		opp_error("CTP expects apps to specify destination (%s) as sink node, and sink nodes shouldn't send app packets", destination);
+	if((strcmp(destination, CTP_COLLECTION_NETWORK_ADDRESS) != 0 && sinkNodeIds.count(atoi(destination)) == 0) || isSink) {
+		opp_error("CTP expects apps to specify destination (%s) as %s or a sink node, and sink nodes shouldn't send app packets",
+			destination, CTP_COLLECTION_NETWORK_ADDRESS);
 	}
 
 	trace() << "Received packet from application layer. Current parent is " << currentParentNodeId; 
 
+	// The application's priority class, read before the application packet is encapsulated
+	int priorityClass = PacketPriority::of(pkt);
+	if(packetPriorities && priorityClass == PacketPriority::ROUTINE &&
+		urgentApplicationIds.count(check_and_cast<ApplicationPacket*>(pkt)->getApplicationID()) > 0) {
+		priorityClass = PacketPriority::URGENT;
+	}
+
 	// Create the packet
 	CtpRoutingPacket *networkPacket = new CtpRoutingPacket("CTP routing data packet", NETWORK_LAYER_PACKET);
 	// Important: set bit length before encapsulation
@@ -124,7 +458,7 @@ void CtpRoutingController::fromApplicationLayer(cPacket *pkt, const char *destin
 	// THEN set packet fields (encapsulate function sets some fields, e.g. sequenceNumber)
 	networkPacket->setRoutingPacketKind(CTP_ROUTING_PACKET_TYPE_DATA);
 	networkPacket->setSource(SELF_NETWORK_ADDRESS);
-	networkPacket->setOrigin(SELF_NETWORK_ADDRESS);
+	networkPacket->setOrigin(self);
 	networkPacket->setHopCount(0);
 	// Set the multihop ETX of this node, for use in detecting routing loops:
 	networkPacket->setMultihopEtxToRoot(currentMultihopEtxToRoot);
@@ -132,10 +466,15 @@ void CtpRoutingController::fromApplicationLayer(cPacket *pkt, const char *destin
 	// The network level destination is the ultimate destination, for application packets this is the sink
 	// This is different from the pkt->getNetMacInfoExchange().nextHop which is the MAC level next hop destination, set in the sendPackets function
 	networkPacket->setDestination(destination); 
+	PacketPriority::set(networkPacket, priorityClass);
 	
+	if(collectPacketJourneys) {
+		PacketJourney::start(pkt, self);
+	}
 
 	// Buffer the packet
-	bufferPacket(networkPacket);
+	enqueuePacket(networkPacket);
+	updateCongestion();
 
 	// Start sending packets
 	// Check if not already sending to avoid conflicting with current send (e.g. we may be waiting for a reply / retransmission of a previous packet)
@@ -164,6 +503,12 @@ void CtpRoutingController::sendPackets()
 
 	if(TXBuffer.size() > 0)
 	{
+		// If our parent is congested, wait before each send attempt (sendPackets will be recalled after the wait)
+		if(backOffFromCongestedParent())
+		{
+			return;
+		}
+
 		if(implementRetries)
 		{
 			if(currentPacketSendingAttempts < maxPacketSendRetries)
@@ -171,17 +516,23 @@ void CtpRoutingController::sendPackets()
 				isSending = true;
 
 				// Send the packet to the MAC layer. Send a duplicate because we hold the
-				// message in the buffer in case we need to retry
+				// message in the buffer in case we need to retry. The duplicate is just the CTP header:
+				// the application packet is shared with the buffered packet (OMNeT's encapsulation reference 
+				// counting), so retries never copy the payload
 				//trace() << "Transmission attempt number " << currentPacketSendingAttempts;
 				plotTrace() << "#ROU_SEND";
 				CtpRoutingPacket *networkPacket = check_and_cast<CtpRoutingPacket*>(TXBuffer.front()->dup());
+				setRoutingInfoOnDataPacket(networkPacket);
 				trace() << "Sending packet (attempt number " << currentPacketSendingAttempts << "): origin " << networkPacket->getOrigin() << ", " <<
 					"sequenceNo " << networkPacket->getSequenceNumber() << ", " <<
 					"hop count " <<networkPacket->getHopCount() << " " <<
-					"to current parent " << currentParentNodeId;
+					"to next hop " << getNextHop();
 
 				// Application data packets are routed via our parent, so set the latest known parent as the MAC layer next hop destination
-				toMacLayer(networkPacket, currentParentNodeId);
+				if(collectPacketJourneys) {
+					PacketJourney::stamp(networkPacket, self, PacketJourney::ROUTING_DEQUEUE);
+				}
+				toMacLayer(networkPacket, getNextHop());
 
 			}
 			else // Max number of retries attempted - drop the packet
@@ -190,6 +541,8 @@ void CtpRoutingController::sendPackets()
 				// Remove from the buffer
 				cancelAndDelete(TXBuffer.front());
 				TXBuffer.pop();
+				refillTXBuffer();
+				updateCongestion();
 				// Reset sending attempts counter 
 				currentPacketSendingAttempts = 0;
 				// Collect stats
@@ -205,11 +558,17 @@ void CtpRoutingController::sendPackets()
 			plotTrace() << "#ROU_SEND";
 			CtpRoutingPacket *networkPacket = check_and_cast<CtpRoutingPacket*>(TXBuffer.front());
 			TXBuffer.pop();
+			refillTXBuffer();
+			updateCongestion();
+			setRoutingInfoOnDataPacket(networkPacket);
 			trace() << "Sending packet (attempt number " << currentPacketSendingAttempts << "): origin " << networkPacket->getOrigin() << ", " <<
 					"sequenceNo " << networkPacket->getSequenceNumber() << ", " <<
 					"hop count " <<networkPacket->getHopCount() << " " <<
-					"to current parent " << currentParentNodeId;
-			toMacLayer(networkPacket, currentParentNodeId);
+					"to next hop " << getNextHop();
+			if(collectPacketJourneys) {
+				PacketJourney::stamp(networkPacket, self, PacketJourney::ROUTING_DEQUEUE);
+			}
+			toMacLayer(networkPacket, getNextHop());
 
 			// Recall send packets in case we have more in the buffer to send
 			sendPackets();
@@ -248,17 +607,42 @@ void CtpRoutingController::fromMacLayer(cPacket *pkt, int srcMacAddress, double
 			plotTrace() << "#ROU_REC_BEACON";
 
 			// Send the beacon to link estimator so it can update incoming link quality and possibly notify table manager of updated multihop ETX to root
-			// Sending a duplicate, because the original will be deleted by VirtualMac 
-			send(ctpPkt->dup(), "toLinkEstimator");
+			if(directSubmoduleCalls)
+			{
+				linkEstimator->beaconReceived(ctpPkt);
+			}
+			else
+			{
+				// Sending a duplicate, because the original will be deleted by VirtualMac 
+				send(ctpPkt->dup(), "toLinkEstimator");
+			}
 			
 			// Check for Pull flag - if set, tell beacon sender to reset trickle so that we update neighbouring nodes quickly
 			if(ctpPkt->getPullFlag())
 			{
 				trace() << "Beacon contained pull flag - resetting trickle";
 				plotTrace() << "#ROU_PULL_RECEIVED " << ctpPkt->getNetMacInfoExchange().lastHop;
-				BeaconSenderControlMessage *resetTrickleMsg = new BeaconSenderControlMessage("Reset trickle message", BEACON_SENDER_CONTROL_COMMAND);
-				resetTrickleMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_RESET_TRICKLE);
-				send(resetTrickleMsg, "toBeaconSender");
+				if(isPullResetAllowed())
+				{
+					requestTrickleReset(false);
+				}
+			}
+			// Otherwise let the beacon sender count it towards Trickle suppression, or reset trickle if it is inconsistent
+			else if(trickleSuppression)
+			{
+				if(directSubmoduleCalls)
+				{
+					beaconSender->beaconHeard(ctpPkt->getNetMacInfoExchange().lastHop, ctpPkt->getParentNodeId(), ctpPkt->getMultihopEtxToRoot());
+				}
+				else
+				{
+					BeaconSenderControlMessage *beaconHeardMsg = new BeaconSenderControlMessage("Beacon heard message", BEACON_SENDER_CONTROL_COMMAND);
+					beaconHeardMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_BEACON_HEARD);
+					beaconHeardMsg->setNodeId(ctpPkt->getNetMacInfoExchange().lastHop);
+					beaconHeardMsg->setParentNodeId(ctpPkt->getParentNodeId());
+					beaconHeardMsg->setMultihopEtxToRoot(ctpPkt->getMultihopEtxToRoot());
+					send(beaconHeardMsg, "toBeaconSender");
+				}
 			}
 			
 			break;
@@ -266,6 +650,11 @@ void CtpRoutingController::fromMacLayer(cPacket *pkt, int srcMacAddress, double
 
 		case CTP_ROUTING_PACKET_TYPE_DATA: {
 			// We have received a data packet 
+
+			if(useSnoopedDataForRouting)
+			{
+				useDataPacketAsRoutingEvidence(ctpPkt);
+			}
 			
 			// Check if we were the intended next-hop destination from the sender
 			if(ctpPkt->getNetMacInfoExchange().nextHop == self)
@@ -277,9 +666,14 @@ void CtpRoutingController::fromMacLayer(cPacket *pkt, int srcMacAddress, double
 					// The packet has reached its ultimate destination
 					// pass received data packet up to application layer
 					trace() << "Sink received data packet from " << ctpPkt->getNetMacInfoExchange().lastHop << ", passing to application layer";
+					if(collectPacketJourneys) {
+						collectPacketJourney(ctpPkt);
+					}
 					toApplicationLayer(decapsulatePacket(ctpPkt));				
 				
-					collectHistogram(OUTPUT_CTP_HOP_COUNT, ctpPkt->getHopCount());			
+					collectHistogram(OUTPUT_CTP_HOP_COUNT, ctpPkt->getHopCount());
+					// Indexed by origin, so deliveries can be totalled across all sinks
+					collectOutput(OUTPUT_CTP_DELIVERED_TO_ROOT, ctpPkt->getOrigin());
 				}
 				// Otherwise, we need to forward packet onwards towards sink
 				else
@@ -292,13 +686,39 @@ void CtpRoutingController::fromMacLayer(cPacket *pkt, int srcMacAddress, double
 			else
 			{
 				trace() << "Snooped packet not addressed to is (addressed to " << ctpPkt->getNetMacInfoExchange().nextHop << ")";
-			
-				// TODO: scan for pull request
 			}
 			
 			break;
 		}
 
+		case CTP_ROUTING_PACKET_TYPE_AGGREGATE: {
+			// We have received several data packets aggregated into one
+
+			if(useSnoopedDataForRouting)
+			{
+				useDataPacketAsRoutingEvidence(ctpPkt);
+			}
+
+			if(ctpPkt->getNetMacInfoExchange().nextHop == self)
+			{
+				if(isSink)
+				{
+					deliverAggregatePacket(ctpPkt);
+				}
+				else
+				{
+					plotTrace() << "#ROU_REC_MSG_TO_FORWARD";
+					forwardAggregatePacket(ctpPkt);
+				}
+			}
+			else
+			{
+				trace() << "Snooped aggregate packet not addressed to us (addressed to " << ctpPkt->getNetMacInfoExchange().nextHop << ")";
+			}
+
+			break;
+		}
+
 		default: {
 			opp_error("Unexpected CTP routing packet type");
 		}
@@ -313,6 +733,9 @@ void CtpRoutingController::forwardPacket(CtpRoutingPacket *pkt)
 
 	// Set this node as the source (origin address remains unchanged - origin is the original sender)
 	pkt->setSource(SELF_NETWORK_ADDRESS);
+	// The pull and congestion flags are from the last hop only, so are not forwarded
+	pkt->setPullFlag(false);
+	pkt->setCongestionFlag(false);
 
 	// Check for routing loops
 	// Because multihop ETX is an additive route metric, which increases by at least 1 each hop,
@@ -328,7 +751,8 @@ void CtpRoutingController::forwardPacket(CtpRoutingPacket *pkt)
 		
 		// Buffer the packet for re-sending later after the loop repair procedure has completed.
 		// We take a duplicate because the original will be deleted by VirtualMac
-		bufferPacket(pkt->dup());
+		enqueuePacket(pkt->dup());
+		updateCongestion();
 
 		// Initialte the loop repair procedure
 		repairLoop();
@@ -340,7 +764,7 @@ void CtpRoutingController::forwardPacket(CtpRoutingPacket *pkt)
 		pkt->setMultihopEtxToRoot(currentMultihopEtxToRoot);
 
 		// Buffer the packet. We take a duplicate because the original will be deleted by VirtualMac
-		bufferPacket(pkt->dup());
+		queueForwardedPacket(pkt->dup());
 		
 		// Initiate packet sending
 		if(!isSending)
@@ -350,6 +774,508 @@ void CtpRoutingController::forwardPacket(CtpRoutingPacket *pkt)
 	}
 }
 
+void CtpRoutingController::forwardAggregatePacket(CtpRoutingPacket *aggregate)
+{
+	trace() << "Forwarding aggregate packet number " << aggregate->getSequenceNumber() << " from " << aggregate->getNetMacInfoExchange().lastHop <<
+		" carrying " << aggregate->getAggregatedOriginsArraySize() << " packets";
+
+	// Check for routing loops, as for data packets in forwardPacket (the aggregate carries the sender's multihop ETX)
+	bool routingLoopDetected = aggregate->getMultihopEtxToRoot() != -1 && aggregate->getMultihopEtxToRoot() <= currentMultihopEtxToRoot;
+
+	// Split the aggregate. Each packet is then forwarded as if it had been received on its own
+	CtpRoutingPacket *pkt;
+	while((pkt = detachNextAggregatedPacket(aggregate)) != NULL)
+	{
+		collectOutput(OUTPUT_CTP_FORWARDING);
+		pkt->setSource(SELF_NETWORK_ADDRESS);
+		pkt->setPullFlag(false);
+		pkt->setCongestionFlag(false);
+
+		if(routingLoopDetected)
+		{
+			// Buffer the packet for re-sending later after the loop repair procedure has completed
+			enqueuePacket(pkt);
+		}
+		else
+		{
+			pkt->setMultihopEtxToRoot(currentMultihopEtxToRoot);
+			queueForwardedPacket(pkt);
+		}
+	}
+
+	if(routingLoopDetected)
+	{
+		trace() << "WARNING - routing loop detected! Node's MH-EHX is " << currentMultihopEtxToRoot
+			<< ", sending node " << aggregate->getNetMacInfoExchange().lastHop << " MH-ETX is " << aggregate->getMultihopEtxToRoot() << " - Initiating routing loop repair";
+		plotTrace() << "#ROU_LOOP_DETECTED";
+		updateCongestion();
+		repairLoop();
+		return;
+	}
+
+	// Initiate packet sending
+	if(!isSending)
+	{
+		sendPackets();
+	}
+}
+
+void CtpRoutingController::deliverAggregatePacket(CtpRoutingPacket *aggregate)
+{
+	trace() << "Sink received aggregate packet from " << aggregate->getNetMacInfoExchange().lastHop << " carrying "
+		<< aggregate->getAggregatedOriginsArraySize() << " packets, passing them to application layer";
+
+	CtpRoutingPacket *pkt;
+	while((pkt = detachNextAggregatedPacket(aggregate)) != NULL)
+	{
+		trace() << "Aggregated packet: origin " << pkt->getOrigin() << ", sequenceNo " << pkt->getSequenceNumber();
+		if(collectPacketJourneys) {
+			collectPacketJourney(pkt);
+		}
+		toApplicationLayer(decapsulatePacket(pkt));
+
+		collectHistogram(OUTPUT_CTP_HOP_COUNT, pkt->getHopCount());
+		collectOutput(OUTPUT_CTP_DELIVERED_TO_ROOT, pkt->getOrigin());
+		delete pkt;
+	}
+}
+
+void CtpRoutingController::collectPacketJourney(CtpRoutingPacket *pkt)
+{
+	// Breaks down the delay of a packet delivered to this sink. Delays are totalled in seconds, with the number of
+	// packets (or hops) alongside so they can be averaged
+	PacketJourney::Journey_t journey;
+	if(!PacketJourney::finish(pkt, journey)) {
+		return;
+	}
+
+	double endToEndDelay = (journey.delivered - journey.appSend).dbl();
+	collectOutput(OUTPUT_CTP_JOURNEY_END_TO_END, pkt->getOrigin(), "packets", 1);
+	collectOutput(OUTPUT_CTP_JOURNEY_END_TO_END, pkt->getOrigin(), "delay", endToEndDelay);
+
+	const char *delayLabels[] = {"queueing", "MAC access", "retransmission"};
+	std::ostringstream hopDelays;
+	for(unsigned int i = 0; i < journey.hops.size(); i++)
+	{
+		int hopNode = journey.hops[i].node;
+		double delays[] = {journey.queueingDelay(i), journey.macAccessDelay(i), journey.retransmissionDelay(i)};
+		collectOutput(OUTPUT_CTP_JOURNEY_DELAY_BY_NODE, hopNode, "hops", 1);
+		collectOutput(OUTPUT_CTP_JOURNEY_DELAY_BY_HOP, i, "hops", 1);
+		hopDelays << "; node " << hopNode;
+		for(int j = 0; j < 3; j++)
+		{
+			// Missing if the MAC doesn't stamp journeys
+			if(delays[j] >= 0)
+			{
+				collectOutput(OUTPUT_CTP_JOURNEY_DELAY_BY_NODE, hopNode, delayLabels[j], delays[j]);
+				collectOutput(OUTPUT_CTP_JOURNEY_DELAY_BY_HOP, i, delayLabels[j], delays[j]);
+			}
+			hopDelays << " " << delayLabels[j] << " " << delays[j];
+		}
+	}
+	trace() << "Journey of packet from origin " << pkt->getOrigin() << " sequenceNo " << pkt->getSequenceNumber() <<
+		": end-to-end " << endToEndDelay << hopDelays.str();
+}
+
+CtpRoutingPacket *CtpRoutingController::detachNextAggregatedPacket(CtpRoutingPacket *aggregate)
+{
+	// Returns NULL when there are no more packets in the aggregate
+	cArray &aggregatedPackets = aggregate->getParList();
+	for(int i = 0; i < aggregatedPackets.size(); i++)
+	{
+		if(aggregatedPackets.exist(i))
+		{
+			CtpRoutingPacket *pkt = check_and_cast<CtpRoutingPacket*>(aggregate->removeObject(aggregatedPackets.get(i)));
+			// The packet's hop count is its hop count when it was aggregated, plus the hops made in the aggregate
+			pkt->setHopCount(pkt->getHopCount() + aggregate->getHopCount());
+			// Latest hop info, e.g. for the RSSI and LQI passed to the application
+			pkt->setNetMacInfoExchange(aggregate->getNetMacInfoExchange());
+			return pkt;
+		}
+	}
+	return NULL;
+}
+
+void CtpRoutingController::queueForwardedPacket(CtpRoutingPacket *pkt)
+{
+	// The caller is responsible for initiating packet sending.
+	// Packets above routine priority are not held back for aggregation
+	if(aggregateForwardedPackets && !(packetPriorities && PacketPriority::of(pkt) > PacketPriority::ROUTINE))
+	{
+		aggregatePacket(pkt);
+	}
+	else
+	{
+		enqueuePacket(pkt);
+		updateCongestion();
+	}
+}
+
+void CtpRoutingController::aggregatePacket(CtpRoutingPacket *pkt)
+{
+	int packetBits = pkt->getBitLength() - networkDataFrameOverheadBits + aggregatedPacketRecordBits;
+
+	// Waiting for the aggregate counts as queueing
+	if(collectPacketJourneys) {
+		PacketJourney::stamp(pkt, self, PacketJourney::ROUTING_ENQUEUE);
+	}
+
+	// If the packet would make the aggregate too big, send what we have first
+	if(!aggregationBuffer.empty() && maxNetFrameSize > 0 &&
+		networkDataFrameOverheadBits + aggregationBufferBits + packetBits > maxNetFrameSize * 8)
+	{
+		flushAggregationBuffer();
+	}
+
+	aggregationBuffer.push_back(pkt);
+	aggregationBufferBits += packetBits;
+
+	if(aggregationBuffer.size() >= aggregationMaxPackets)
+	{
+		flushAggregationBuffer();
+	}
+	else if(getTimer(CTP_ROUTING_CONTROLLER_TIMER_AGGREGATION) == -1)
+	{
+		// The first packet waits at most aggregationMaxDelay for others to join it
+		setTimer(CTP_ROUTING_CONTROLLER_TIMER_AGGREGATION, aggregationMaxDelay);
+	}
+}
+
+void CtpRoutingController::flushAggregationBuffer()
+{
+	// Moves the waiting packets to the TX buffer as one aggregate packet. The caller is responsible for initiating packet sending
+	cancelTimer(CTP_ROUTING_CONTROLLER_TIMER_AGGREGATION);
+
+	if(aggregationBuffer.size() == 1)
+	{
+		// Not worth aggregating
+		enqueuePacket(aggregationBuffer.front());
+	}
+	else if(aggregationBuffer.size() > 1)
+	{
+		CtpRoutingPacket *aggregate = new CtpRoutingPacket("CTP routing aggregate packet", NETWORK_LAYER_PACKET);
+		aggregate->setRoutingPacketKind(CTP_ROUTING_PACKET_TYPE_AGGREGATE);
+		aggregate->setSource(SELF_NETWORK_ADDRESS);
+		aggregate->setDestination(aggregationBuffer.front()->getDestination());
+		aggregate->setOrigin(self);
+		aggregate->setSequenceNumber(aggregateSequenceNumber++);
+		aggregate->setHopCount(0);
+		aggregate->setMultihopEtxToRoot(currentMultihopEtxToRoot);
+		aggregate->setBitLength(networkDataFrameOverheadBits + aggregationBufferBits);
+
+		aggregate->setAggregatedOriginsArraySize(aggregationBuffer.size());
+		aggregate->setAggregatedSequenceNumbersArraySize(aggregationBuffer.size());
+		for(unsigned int i = 0; i < aggregationBuffer.size(); i++)
+		{
+			aggregate->setAggregatedOrigins(i, aggregationBuffer[i]->getOrigin());
+			aggregate->setAggregatedSequenceNumbers(i, aggregationBuffer[i]->getSequenceNumber());
+			if(collectPacketJourneys) {
+				PacketJourney::carry(aggregate, aggregationBuffer[i]);
+			}
+			// The aggregate takes ownership
+			aggregate->addObject(aggregationBuffer[i]);
+		}
+
+		trace() << "Aggregated " << aggregationBuffer.size() << " packets into aggregate packet " << aggregate->getSequenceNumber();
+		collectHistogram(OUTPUT_CTP_AGGREGATE_SIZE, aggregationBuffer.size());
+		enqueuePacket(aggregate);
+	}
+
+	aggregationBuffer.clear();
+	aggregationBufferBits = 0;
+	updateCongestion();
+}
+
+void CtpRoutingController::clearAggregationBuffer()
+{
+	for(unsigned int i = 0; i < aggregationBuffer.size(); i++)
+	{
+		delete aggregationBuffer[i];
+		collectOutput(OUTPUT_CTP_DROPPED_OUT_OF_ENERGY);
+	}
+	aggregationBuffer.clear();
+	aggregationBufferBits = 0;
+}
+
+void CtpRoutingController::enqueuePacket(cPacket *pkt)
+{
+	if(collectPacketJourneys) {
+		PacketJourney::stamp(pkt, self, PacketJourney::ROUTING_ENQUEUE);
+	}
+
+	if(packetPriorities)
+	{
+		enqueuePriorityPacket(check_and_cast<CtpRoutingPacket*>(pkt));
+		return;
+	}
+
+	if(!fairQueueing)
+	{
+		bufferPacket(pkt);
+		return;
+	}
+
+	// Our own data packets are local. Forwarded packets are queued by origin, and aggregates (which carry packets
+	// from many origins) share one flow of their own
+	CtpRoutingPacket *ctpPkt = check_and_cast<CtpRoutingPacket*>(pkt);
+	bool isAggregate = ctpPkt->getRoutingPacketKind() == CTP_ROUTING_PACKET_TYPE_AGGREGATE;
+	int flowId = isAggregate ? -1 : ctpPkt->getOrigin();
+
+	CtpRoutingPacket *droppedPkt = fairQueue.enqueue(ctpPkt, flowId);
+	if(droppedPkt != NULL)
+	{
+		trace() << "Fair queue full, dropping packet from origin " << droppedPkt->getOrigin();
+		collectOutput(OUTPUT_CTP_FAIR_QUEUE_DROP, droppedPkt->getOrigin());
+		delete droppedPkt;
+	}
+
+	refillTXBuffer();
+}
+
+void CtpRoutingController::enqueuePriorityPacket(CtpRoutingPacket *pkt)
+{
+	int priorityClass = PacketPriority::of(pkt);
+
+	if(getNumberOfBufferedPackets() >= (unsigned int) netBufferSize)
+	{
+		// Make room by dropping the newest packet of the lowest class below this one, or drop this one if there is none
+		int droppedClass = 0;
+		while(droppedClass < priorityClass && priorityQueues[droppedClass].empty()) {
+			droppedClass++;
+		}
+		if(droppedClass == priorityClass)
+		{
+			trace() << "Buffer full of packets of priority class " << priorityClass << " or above, dropping packet from origin " << pkt->getOrigin();
+			collectOutput(OUTPUT_CTP_PRIORITY_QUEUE_DROP, priorityClass);
+			delete pkt;
+			return;
+		}
+		CtpRoutingPacket *droppedPkt = priorityQueues[droppedClass].back();
+		priorityQueues[droppedClass].pop_back();
+		trace() << "Buffer full, dropping packet of priority class " << droppedClass << " from origin " << droppedPkt->getOrigin()
+			<< " to make room for priority class " << priorityClass;
+		collectOutput(OUTPUT_CTP_PRIORITY_QUEUE_DROP, droppedClass);
+		delete droppedPkt;
+	}
+
+	priorityQueues[priorityClass].push_back(pkt);
+	refillTXBuffer();
+}
+
+unsigned int CtpRoutingController::getWaitingPriorityClasses()
+{
+	unsigned int waitingClasses = 0;
+	for(int c = 0; c < PacketPriority::NUMBER_OF_CLASSES; c++)
+	{
+		if(!priorityQueues[c].empty()) {
+			waitingClasses |= PriorityScheduler::bit(c);
+		}
+	}
+	return waitingClasses;
+}
+
+void CtpRoutingController::refillTXBuffer()
+{
+	// With fair queueing or packet priorities, the scheduler chooses the next packet when the TX buffer is empty
+	if(fairQueueing && TXBuffer.empty())
+	{
+		CtpRoutingPacket *pkt = fairQueue.dequeue();
+		if(pkt != NULL) {
+			TXBuffer.push(pkt);
+		}
+	}
+	else if(packetPriorities && TXBuffer.empty())
+	{
+		unsigned int waitingClasses = getWaitingPriorityClasses();
+		int priorityClass = priorityScheduler.choose(waitingClasses);
+		if(priorityClass != -1)
+		{
+			priorityScheduler.charge(priorityClass, waitingClasses);
+			TXBuffer.push(priorityQueues[priorityClass].front());
+			priorityQueues[priorityClass].pop_front();
+		}
+	}
+}
+
+unsigned int CtpRoutingController::getNumberOfBufferedPackets()
+{
+	unsigned int priorityQueuedPackets = 0;
+	for(int c = 0; c < PacketPriority::NUMBER_OF_CLASSES; c++) {
+		priorityQueuedPackets += priorityQueues[c].size();
+	}
+	return TXBuffer.size() + fairQueue.size() + priorityQueuedPackets;
+}
+
+void CtpRoutingController::setRoutingInfoOnDataPacket(CtpRoutingPacket *pkt)
+{
+	if(congestionSignalling) {
+		pkt->setCongestionFlag(isCongested);
+	}
+
+	// Via a fallback parent, our MH-ETX is our path ETX through it. The fallback's loop detection expects it to be
+	// higher than its own. Our beacons still advertise our normal route, so flag the packet to stop neighbours
+	// using it as routing evidence
+	pkt->setViaFallbackParent(fallbackParentNodeId != -1);
+	if(fallbackParentNodeId != -1) {
+		pkt->setMultihopEtxToRoot(fallbackPathEtx);
+	}
+
+	if(!useSnoopedDataForRouting) {
+		return;
+	}
+
+	// Neighbours which receive or snoop this packet use it as routing evidence, so give them our latest MH-ETX
+	if(fallbackParentNodeId == -1) {
+		pkt->setMultihopEtxToRoot(currentMultihopEtxToRoot);
+	}
+
+	if(setPullFlagOnNextDataPacket)
+	{
+		trace() << "Setting pull flag on data packet";
+		pkt->setPullFlag(true);
+		setPullFlagOnNextDataPacket = false;
+	}
+}
+
+int CtpRoutingController::getNextHop()
+{
+	return fallbackParentNodeId != -1 ? fallbackParentNodeId : currentParentNodeId;
+}
+
+void CtpRoutingController::escalateSendFailure(int nodeId)
+{
+	// After parentFailoverThreshold failures in a row, stop waiting on the node we are sending to (e.g. it may have
+	// just run out of energy). Its link estimate is penalised straight away, rather than when its outgoing message
+	// window fills, and packets go to the next best parent candidate for parentFailoverHoldTime
+	if(++consecutiveSendFailures < parentFailoverThreshold) {
+		return;
+	}
+	consecutiveSendFailures = 0;
+	linkEstimator->penaliseLink(nodeId, parentFailoverThreshold);
+
+	if(nodeId == fallbackParentNodeId)
+	{
+		// The fallback is no better, so go back to our parent
+		trace() << "Fallback parent " << nodeId << " failed " << parentFailoverThreshold << " times, going back to parent " << currentParentNodeId;
+		collectOutput(OUTPUT_CTP_PARENT_FAILOVER, "back to parent");
+		clearFallbackParent();
+		return;
+	}
+
+	// The penalty may have made the table manager choose a new parent already
+	if(nodeId != currentParentNodeId) {
+		return;
+	}
+
+	double pathEtx;
+	int candidateNodeId = tableManager->getFallbackParent(pathEtx);
+	if(candidateNodeId == -1)
+	{
+		trace() << "Parent " << nodeId << " failed " << parentFailoverThreshold << " times, but there is no other candidate";
+		collectOutput(OUTPUT_CTP_PARENT_FAILOVER, "no candidate");
+		return;
+	}
+
+	trace() << "Parent " << nodeId << " failed " << parentFailoverThreshold << " times, sending via " << candidateNodeId
+		<< " (path ETX " << pathEtx << ") for " << parentFailoverHoldTime;
+	plotTrace() << "#ROU_FALLBACK_PARENT " << candidateNodeId;
+	collectOutput(OUTPUT_CTP_PARENT_FAILOVER, "to fallback");
+	fallbackParentNodeId = candidateNodeId;
+	fallbackPathEtx = pathEtx;
+	setTimer(CTP_ROUTING_CONTROLLER_TIMER_FALLBACK_PARENT_EXPIRY, parentFailoverHoldTime);
+}
+
+void CtpRoutingController::clearFallbackParent()
+{
+	fallbackParentNodeId = -1;
+	fallbackPathEtx = -1;
+	cancelTimer(CTP_ROUTING_CONTROLLER_TIMER_FALLBACK_PARENT_EXPIRY);
+}
+
+void CtpRoutingController::updateCongestion()
+{
+	if(!congestionSignalling) {
+		return;
+	}
+
+	bool nowCongested = getNumberOfBufferedPackets() >= congestionBufferThreshold;
+	if(nowCongested == isCongested) {
+		return;
+	}
+
+	isCongested = nowCongested;
+	trace() << (isCongested ? "Buffer is congested (" : "Buffer is no longer congested (") << getNumberOfBufferedPackets() << " packets)";
+	plotTrace() << "#ROU_CONGESTED " << isCongested;
+
+	// Beacons carry the congestion flag too
+	if(directSubmoduleCalls)
+	{
+		beaconSender->updateCongestion(isCongested);
+	}
+	else
+	{
+		BeaconSenderControlMessage *congestionMsg = new BeaconSenderControlMessage("Update congestion message", BEACON_SENDER_CONTROL_COMMAND);
+		congestionMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_UPDATE_CONGESTION);
+		congestionMsg->setCongested(isCongested);
+		send(congestionMsg, "toBeaconSender");
+	}
+}
+
+bool CtpRoutingController::backOffFromCongestedParent()
+{
+	if(!congestionSignalling || !parentIsCongested) {
+		return false;
+	}
+
+	// Each send attempt waits for one backoff period
+	if(congestionBackoffComplete)
+	{
+		congestionBackoffComplete = false;
+		return false;
+	}
+
+	if(getTimer(CTP_ROUTING_CONTROLLER_TIMER_CONGESTION_BACKOFF) == -1)
+	{
+		double backoff = congestionBackoffMin + dblrand() * congestionBackoffRange;
+		trace() << "Parent " << currentParentNodeId << " is congested, backing off for " << backoff;
+		collectOutput(OUTPUT_CTP_CONGESTION_BACKOFF);
+		setTimer(CTP_ROUTING_CONTROLLER_TIMER_CONGESTION_BACKOFF, backoff);
+	}
+	return true;
+}
+
+void CtpRoutingController::useDataPacketAsRoutingEvidence(CtpRoutingPacket *pkt)
+{
+	int lastHop = pkt->getNetMacInfoExchange().lastHop;
+
+	// The packet's next hop is the sender's parent, and its MH-ETX is the sender's (see
+	// setRoutingInfoOnDataPacket). Pass these to the link estimator, which updates the table manager as it does for beacons.
+	// Packets sent via a fallback parent don't match the sender's beacons, so are not evidence
+	if(!isSink && !pkt->getViaFallbackParent())
+	{
+		if(directSubmoduleCalls)
+		{
+			linkEstimator->dataPacketReceived(pkt);
+		}
+		else
+		{
+			// Sending a duplicate, because the original will be deleted by VirtualMac 
+			send(pkt->dup(), "toLinkEstimator");
+		}
+	}
+
+	// A node with a valid route which sees a pull request should send a beacon soon
+	if(pkt->getPullFlag() && (isSink || currentMultihopEtxToRoot != -1))
+	{
+		trace() << "Data packet contained pull flag - resetting trickle";
+		plotTrace() << "#ROU_PULL_RECEIVED " << lastHop;
+		if(isPullResetAllowed())
+		{
+			requestTrickleReset(false);
+		}
+	}
+}
+
 void CtpRoutingController::repairLoop()
 {
 	// Do not send / forward data packets while we repair the loop. This is controlled using a flag:
@@ -358,9 +1284,8 @@ void CtpRoutingController::repairLoop()
 	// Reset the trickle algorithm in the beacon sender module - this will cause beacons to be sent out
 	// to hopefully help repair the loop by advertising most recent routing info
 	// Also request pull in order to quickly receive latest updated info from neighbours 
-	BeaconSenderControlMessage *resetTrickleMsg = new BeaconSenderControlMessage("Reset trickle message", BEACON_SENDER_CONTROL_COMMAND);
-	resetTrickleMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_RESET_TRICKLE_AND_PULL);
-	send(resetTrickleMsg, "toBeaconSender");
+	requestTrickleReset(true);
+	setPullFlagOnNextDataPacket = useSnoopedDataForRouting;
 
 	// Set a timer for when to re-allow packet sending (hopefully the route loop will be repaired by then)
 	double repairLoopWaitTime = repairLoopWaitTimeMin + dblrand() * repairLoopWaitTimeRange;
@@ -376,53 +1301,23 @@ bool CtpRoutingController::isDuplicate(CtpRoutingPacket *pkt)
 	// We also compare routingPacketKind, as broadcast beacons and unicast data
 	// have different runs of sequence number (so it would be possible for
 	// a beacon and data packet from the same node to have the same seqNo) 
-
-	//extract fields from packet
-	ctpRoutingPacket_type type = (ctpRoutingPacket_type) pkt->getRoutingPacketKind();
-	unsigned int seqNo = pkt->getSequenceNumber();
-	int origin = std::stoi(pkt->getOrigin());
-	unsigned int hopCount = pkt->getHopCount();
-
-	//resize packet history vector if necessary
-	if (origin >= (int)duplicateDetectionBuffer.size())
-		duplicateDetectionBuffer.resize(origin + 1);
-
-	//search for this packet from this origin in the list
-	list<duplicatePacketBufferEntry>::iterator iter;
-	for (iter = duplicateDetectionBuffer[origin].begin(); iter != duplicateDetectionBuffer[origin].end(); iter++) 
-	{
-		// Same type (beacon / data), seq no and hop count means it's the same
-		// no need to check origin - using separate list in vector for each origin node 
-		if((*iter).type == (ctpRoutingPacket_type) pkt->getRoutingPacketKind()
-		&& (*iter).seqNo == pkt->getSequenceNumber()
-		&& (*iter).hopCount == pkt->getHopCount())
-		{
-			// This is a duplicate.
-			trace() << "Dropping duplicate packet type " << type << 
-				" seqNo " << seqNo << 
-				" from origin node " << origin <<
-			 	", hop count " << hopCount;
-			return true;
-		}
+	if(duplicateDetectionBuffer.isDuplicateOtherwiseRecord(pkt->getOrigin(), pkt->getRoutingPacketKind(), 
+		pkt->getSequenceNumber(), pkt->getHopCount()))
+	{
+		// This is a duplicate.
+		trace() << "Dropping duplicate packet type " << pkt->getRoutingPacketKind() << 
+			" seqNo " << pkt->getSequenceNumber() << 
+			" from origin node " << pkt->getOrigin() <<
+		 	", hop count " << pkt->getHopCount();
+		return true;
 	}
 
-	// this is new packet, not a duplicate, add to duplicate buffer for this origin
-	struct duplicatePacketBufferEntry entry;
-	entry.type =  (ctpRoutingPacket_type) pkt->getRoutingPacketKind();
-	entry.seqNo =  pkt->getSequenceNumber();
-	entry.hopCount =  pkt->getHopCount();
-	duplicateDetectionBuffer[origin].push_front(entry);
-
-	// Rotate buffer
-	if (duplicateDetectionBuffer[origin].size() > duplicateDetectionBufferSize)
-		duplicateDetectionBuffer[origin].pop_back();
-
 	return false;
 }
 
 void CtpRoutingController::clearDuplicateBuffer()
 {
-	// Delete any remiaining messages in the duplicate check buffer (avoids undisposed object warning)
+	// Forget all packets seen
 	duplicateDetectionBuffer.clear();
 }
 
@@ -453,6 +1348,7 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 					trace() << "Message ACKed";
 					// Message sending succeeded
 					isSending = false;
+					consecutiveSendFailures = 0;
 
 					// If we're implementing retires
 					if(implementRetries)
@@ -462,6 +1358,8 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 						// of the buffer, since we are only sending to MAC layer once)
 						cancelAndDelete(TXBuffer.front());
 						TXBuffer.pop();
+						refillTXBuffer();
+						updateCongestion();
 
 						// Reset the number of retries
 						currentPacketSendingAttempts = 0;
@@ -473,7 +1371,15 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 					sendPackets();
 
 					// Pass on to the link estimator the succeeded send message so it can update link quality estimate
-					send(controlMsg, "toLinkEstimator");
+					if(directSubmoduleCalls)
+					{
+						linkEstimator->sendingResult(controlMsg->getValue(), true);
+						cancelAndDelete(controlMsg);
+					}
+					else
+					{
+						send(controlMsg, "toLinkEstimator");
+					}
 					break;
 				}
 
@@ -490,6 +1396,10 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 
 						collectOutput(OUTPUT_CTP_SENDING_RETRY);
 					}
+
+					if(parentFailoverThreshold > 0) {
+						escalateSendFailure(controlMsg->getValue()); // The value is the node we were sending to
+					}
 					
 					//plotTrace() << "#ROU_DATA_SEND_NOT_ACKED";
 					
@@ -497,14 +1407,24 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 					sendPackets();
 
 					// Pass on to the link estimator the failed send message so it can update link quality estimate
-					send(controlMsg, "toLinkEstimator");
+					if(directSubmoduleCalls)
+					{
+						linkEstimator->sendingResult(controlMsg->getValue(), false);
+						cancelAndDelete(controlMsg);
+					}
+					else
+					{
+						send(controlMsg, "toLinkEstimator");
+					}
 					break;
 				}
 
-				// The application layer is updating the network layer on what the sink node ID is
+				// The application layer is updating the network layer on what the sink node ID is.
+				// There may be several sinks (roots), each announced by its own update
 				case ROUTING_MSG_SINK_NODE_UPDATE: {
 
-					sinkNodeId = controlMsg->getValue();
+					int sinkNodeId = controlMsg->getValue();
+					sinkNodeIds.insert(sinkNodeId);
 					if(sinkNodeId == self) {
 						trace() << "This node is sink";
 						isSink = true;
@@ -512,8 +1432,15 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 						currentParentNodeId = self;
 					}
 
-					// Pass a copy of this update on to the table manager
-					send(controlMsg->dup(), "toTableManager");
+					// Pass this update on to the table manager
+					if(directSubmoduleCalls)
+					{
+						tableManager->updateSinkNode(sinkNodeId);
+					}
+					else
+					{
+						send(controlMsg->dup(), "toTableManager");
+					}
 					cancelAndDelete(controlMsg);
 					break;
 				}
@@ -534,20 +1461,7 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 			{
 				// The table manager is updating the controller of the latest chosen parent node ID and multihop ETX
 				case CTP_ROUTING_MSG_UPDATE_ROUTE_INFO: {
-					
-					// Update our stored parent node ID
-					currentParentNodeId = controlMsg->getValue();
-					trace() << "Parent Node ID is " << currentParentNodeId;
-					// Update our stored multihop ETX for routing loop detection
-					currentMultihopEtxToRoot = controlMsg->getMultihopEtx();
-					trace() << "Multihop ETX is " << currentMultihopEtxToRoot;
-					
-					// In case we have packets queued from earlier because we previously had no valid parent, initiate send packets
-					// Check if not already sending to avoid conflicting with current send
-					if(!isSending)
-					{
-						sendPackets();
-					}
+					updateRouteInfo(controlMsg->getValue(), controlMsg->getMultihopEtx(), controlMsg->getParentCongested());
 					cancelAndDelete(controlMsg);
 					break;
 				}
@@ -565,6 +1479,35 @@ void CtpRoutingController::handleNetworkControlCommand(cMessage *msg)
 	}
 }
 
+void CtpRoutingController::updateRouteInfo(int parentNodeId, double multihopEtx, bool parentCongested)
+{
+	Enter_Method_Silent();
+
+	// Whether to back off sending to the parent
+	parentIsCongested = parentCongested;
+
+	// A fallback only stands in for the parent it was chosen for
+	if(parentNodeId != currentParentNodeId && fallbackParentNodeId != -1)
+	{
+		trace() << "New parent, no longer sending via fallback parent " << fallbackParentNodeId;
+		clearFallbackParent();
+	}
+
+	// Update our stored parent node ID
+	currentParentNodeId = parentNodeId;
+	trace() << "Parent Node ID is " << currentParentNodeId;
+	// Update our stored multihop ETX for routing loop detection
+	currentMultihopEtxToRoot = multihopEtx;
+	trace() << "Multihop ETX is " << currentMultihopEtxToRoot;
+	
+	// In case we have packets queued from earlier because we previously had no valid parent, initiate send packets
+	// Check if not already sending to avoid conflicting with current send
+	if(!isSending)
+	{
+		sendPackets();
+	}
+}
+
 void CtpRoutingController::timerFiredCallback(int index)
 {
 	switch(index)
@@ -584,11 +1527,60 @@ void CtpRoutingController::timerFiredCallback(int index)
 			break;
 		}
 
+		case CTP_ROUTING_CONTROLLER_TIMER_CONGESTION_BACKOFF: {
+			// Allow the next send attempt
+			congestionBackoffComplete = true;
+			if(!isSending)
+			{
+				sendPackets();
+			}
+			break;
+		}
+
+		case CTP_ROUTING_CONTROLLER_TIMER_AGGREGATION: {
+			// Don't wait any longer for packets to aggregate with
+			flushAggregationBuffer();
+			if(!isSending)
+			{
+				sendPackets();
+			}
+			break;
+		}
+
+		case CTP_ROUTING_CONTROLLER_TIMER_FALLBACK_PARENT_EXPIRY: {
+			trace() << "Fallback parent hold time over, going back to parent " << currentParentNodeId;
+			fallbackParentNodeId = -1;
+			fallbackPathEtx = -1;
+			break;
+		}
+
+		case CTP_ROUTING_CONTROLLER_TIMER_PASSIVE_LISTEN: {
+			trace() << "Passive listen after restart over, routing table has " << tableManager->getNeighbourTable().getRoutingTableSize() << " entries";
+			scheduleRouteDiscoveryAfterRestartJitter();
+			break;
+		}
+
 		case CTP_ROUTING_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION: {
 			initiateRouteDiscoveryAndPropagation();
 			break;
 		}
 
+		case CTP_ROUTING_CONTROLLER_TIMER_RESTORE_SNAPSHOT: {
+			restoreRoutingSnapshot();
+			break;
+		}
+
+		case CTP_ROUTING_CONTROLLER_TIMER_SAVE_SNAPSHOT: {
+			saveRoutingSnapshot();
+			break;
+		}
+
+		case CTP_ROUTING_CONTROLLER_TIMER_NV_CHECKPOINT: {
+			writeNonVolatileCheckpoint();
+			setTimer(CTP_ROUTING_CONTROLLER_TIMER_NV_CHECKPOINT, nvCheckpointInterval);
+			break;
+		}
+
 		default: {
 			opp_error("Unknown timer type");
 		}
@@ -598,4 +1590,25 @@ void CtpRoutingController::timerFiredCallback(int index)
 void CtpRoutingController::finishSpecific()
 {
 	clearDuplicateBuffer();
+	for(unsigned int i = 0; i < aggregationBuffer.size(); i++)
+	{
+		delete aggregationBuffer[i];
+	}
+	aggregationBuffer.clear();
+
+	if(hasStartedUpOnce)
+	{
+		if(loadRoutingSnapshotFile != "") {
+			RoutingStateSnapshot::release(loadRoutingSnapshotFile);
+		}
+		if(saveRoutingSnapshotFile != "") {
+			RoutingStateSnapshot::release(saveRoutingSnapshotFile);
+		}
+		if(nvStateRetention) {
+			NonVolatileStorage::release(node);
+		}
+		if(collectPacketJourneys) {
+			PacketJourney::release();
+		}
+	}
 }
\ No newline at end of file
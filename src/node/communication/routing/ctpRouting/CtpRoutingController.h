@@ -3,21 +3,40 @@
 
 // Header for the virtual base Castalia MAC module 
 #include "VirtualRouting.h"
+#include "DuplicatePacketDetector.h"
+#include "CtpFairQueue.h"
+#include "RoutingStateSnapshot.h"
+#include "NonVolatileStorage.h"
+#include "PacketJourney.h"
+#include "PacketPriority.h"
+#include <set>
+#include <deque>
+#include <sstream>
+#include <vector>
 #include "CtpRoutingControlMessage_m.h"
 #include "RoutingControlMessage_m.h"
 #include "CtpRoutingPacket_m.h"
+#include "ApplicationPacket_m.h"
 #include "BeaconSenderControlMessage_m.h"
 
+// Anycast destination for application packets: delivered to whichever root (sink) the route leads to
+#define CTP_COLLECTION_NETWORK_ADDRESS "collection"
+
 enum CtpRoutingControllerTimers {
 	CTP_ROUTING_CONTROLLER_TIMER_LOOP_REPAIR = 1,
-	CTP_ROUTING_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION = 2
+	CTP_ROUTING_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION = 2,
+	CTP_ROUTING_CONTROLLER_TIMER_CONGESTION_BACKOFF = 3,
+	CTP_ROUTING_CONTROLLER_TIMER_AGGREGATION = 4,
+	CTP_ROUTING_CONTROLLER_TIMER_RESTORE_SNAPSHOT = 5,
+	CTP_ROUTING_CONTROLLER_TIMER_SAVE_SNAPSHOT = 6,
+	CTP_ROUTING_CONTROLLER_TIMER_NV_CHECKPOINT = 7,
+	CTP_ROUTING_CONTROLLER_TIMER_FALLBACK_PARENT_EXPIRY = 8,
+	CTP_ROUTING_CONTROLLER_TIMER_PASSIVE_LISTEN = 9
 };
 
-struct duplicatePacketBufferEntry {
-	ctpRoutingPacket_type type;
-	unsigned int seqNo;
-	unsigned int hopCount;
-};
+class CtpRoutingBeaconSender;
+class CtpRoutingLinkEstimator;
+class CtpRoutingTableManager;
 
 class CtpRoutingController : public VirtualRouting
 {
@@ -28,6 +47,33 @@ class CtpRoutingController : public VirtualRouting
 		int networkDataFrameOverheadBits;
 		double repairLoopWaitTimeMin;
 		double repairLoopWaitTimeRange;
+		bool congestionSignalling;
+		unsigned int congestionBufferThreshold;
+		double congestionBackoffMin;
+		double congestionBackoffRange;
+		bool aggregateForwardedPackets;
+		unsigned int aggregationMaxPackets;
+		double aggregationMaxDelay;
+		int aggregatedPacketRecordBits;
+		bool fairQueueing;
+		bool packetPriorities;
+		std::set<std::string> urgentApplicationIds;
+		std::string loadRoutingSnapshotFile;
+		std::string saveRoutingSnapshotFile;
+		double saveRoutingSnapshotTime;
+		bool nvStateRetention;
+		bool nvRetainRoutes;
+		bool nvRetainLinks;
+		double nvCheckpointInterval;
+		double nvWriteEnergyPerByte;
+		bool collectPacketJourneys;
+		unsigned int parentFailoverThreshold;
+		double parentFailoverHoldTime;
+		double passiveListenTime;
+		double restartJitterPerNeighbour;
+		double restartJitterMax;
+		unsigned int maxPullResetsPerWindow;
+		double pullResetWindow;
 		
 		//=========== Other private variables ============
 		static const char *OUTPUT_CTP_DROPPED_AFTER_MAX_RETRIES;
@@ -35,19 +81,65 @@ class CtpRoutingController : public VirtualRouting
 		static const char *OUTPUT_CTP_SENDING_RETRY;
 		static const char *OUTPUT_CTP_FORWARDING;
 		static const char *OUTPUT_CTP_HOP_COUNT;
+		static const char *OUTPUT_CTP_CONGESTION_BACKOFF;
+		static const char *OUTPUT_CTP_DELIVERED_TO_ROOT;
+		static const char *OUTPUT_CTP_AGGREGATE_SIZE;
+		static const char *OUTPUT_CTP_FAIR_QUEUE_DROP;
+		static const char *OUTPUT_CTP_PRIORITY_QUEUE_DROP;
+		static const char *OUTPUT_CTP_NV_BYTES_WRITTEN;
+		static const char *OUTPUT_CTP_JOURNEY_END_TO_END;
+		static const char *OUTPUT_CTP_JOURNEY_DELAY_BY_NODE;
+		static const char *OUTPUT_CTP_JOURNEY_DELAY_BY_HOP;
+		static const char *OUTPUT_CTP_PARENT_FAILOVER;
+		static const char *OUTPUT_CTP_PULL_RESETS_SUPPRESSED;
+		static const char *OUTPUT_CTP_RESTART_ROUTE_DISCOVERY;
+		// Size of the entries a mote would keep in non-volatile memory (as in TinyOS CTP)
+		static const unsigned int NV_ROUTE_RECORD_BYTES = 8;
+		static const unsigned int NV_LINK_RECORD_BYTES = 6;
 		bool isSink;
 		double delayBeforeRouteDiscoveryPropagation;
 		bool implementRetries;
-		int sinkNodeId;
+		std::set<int> sinkNodeIds;
 		int currentParentNodeId;
 		double currentMultihopEtxToRoot;
 		bool isSending;
 		bool waitingForLoopRepair;
 		int currentPacketSendingAttempts;
-		// The buffer size in TinyOS is 4. Doubling to 8 because beacons and data packets
-		// have separate seqNo streams, so need to account for both types separately
-		const unsigned int duplicateDetectionBufferSize = 4;	
-		vector<list<duplicatePacketBufferEntry>> duplicateDetectionBuffer;
+		// The buffer size in TinyOS is 4 packets per origin. Beacons and data packets have separate seqNo streams,
+		// so the packet kind is also compared
+		DuplicatePacketDetector<4> duplicateDetectionBuffer;
+		// For calling the other submodules directly instead of sending them messages
+		bool directSubmoduleCalls;
+		bool useSnoopedDataForRouting;
+		bool trickleSuppression;
+		bool setPullFlagOnNextDataPacket;
+		bool isCongested;
+		bool parentIsCongested;
+		bool congestionBackoffComplete;
+		// Forwarded packets waiting to be aggregated
+		std::vector<CtpRoutingPacket*> aggregationBuffer;
+		int aggregationBufferBits;
+		unsigned int aggregateSequenceNumber;
+		// With fair queueing, packets wait here and TXBuffer only holds the packet being sent
+		CtpFairQueue fairQueue;
+		// With packet priorities, packets wait here by class and TXBuffer only holds the packet being sent
+		std::deque<CtpRoutingPacket*> priorityQueues[PacketPriority::NUMBER_OF_CLASSES];
+		PriorityScheduler priorityScheduler;
+		CtpRoutingBeaconSender *beaconSender;
+		CtpRoutingLinkEstimator *linkEstimator;
+		CtpRoutingTableManager *tableManager;
+		cModule *node;
+		bool routeRestoredOnRestart;
+		// Send failures in a row to the node we are sending to, and the neighbour we are sending to instead of our
+		// parent after too many (-1 if none), with our path ETX through it
+		unsigned int consecutiveSendFailures;
+		int fallbackParentNodeId;
+		double fallbackPathEtx;
+		// Set on a restart with a passive listen phase, so that a route heard while listening is not pulled for
+		bool listenedBeforePull;
+		// Start of the current pull reset rate limiting window, and pull flags responded to in it
+		double pullResetWindowStart;
+		unsigned int pullResetsInWindow;
 
 		//=========== Private member functions ===========
 		void initiateRouteDiscoveryAndPropagation();
@@ -55,7 +147,40 @@ class CtpRoutingController : public VirtualRouting
 		void sendPackets();
 		void repairLoop();
 		void forwardPacket(CtpRoutingPacket *pkt);
+		void forwardAggregatePacket(CtpRoutingPacket *aggregate);
+		void deliverAggregatePacket(CtpRoutingPacket *aggregate);
+		void collectPacketJourney(CtpRoutingPacket *pkt);
+		CtpRoutingPacket *detachNextAggregatedPacket(CtpRoutingPacket *aggregate);
+		void queueForwardedPacket(CtpRoutingPacket *pkt);
+		void aggregatePacket(CtpRoutingPacket *pkt);
+		void flushAggregationBuffer();
+		void clearAggregationBuffer();
+		void enqueuePacket(cPacket *pkt);
+		void refillTXBuffer();
+		unsigned int getNumberOfBufferedPackets();
+		void enqueuePriorityPacket(CtpRoutingPacket *pkt);
+		unsigned int getWaitingPriorityClasses();
 		void clearDuplicateBuffer();
+		void requestTrickleReset(bool setPull);
+		void scheduleRouteDiscoveryAfterRestartJitter();
+		bool isPullResetAllowed();
+		void setRoutingInfoOnDataPacket(CtpRoutingPacket *pkt);
+		int getNextHop();
+		void escalateSendFailure(int nodeId);
+		void clearFallbackParent();
+		void updateCongestion();
+		bool backOffFromCongestedParent();
+		void useDataPacketAsRoutingEvidence(CtpRoutingPacket *pkt);
+		bool restoreRoutingState(const std::vector<std::string> &linkRecords, const std::vector<std::string> &routeRecords);
+		void restoreRoutingSnapshot();
+		void writeNonVolatileCheckpoint();
+		void saveRoutingSnapshot();
+
+	public:
+
+		// Direct call from the table manager (used instead of a control message when the CtpRouting
+		// directSubmoduleCalls parameter is set)
+		void updateRouteInfo(int parentNodeId, double multihopEtx, bool parentCongested);
 
 	protected:
 
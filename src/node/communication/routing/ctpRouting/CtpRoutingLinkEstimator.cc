@@ -1,10 +1,12 @@
 #include "CtpRoutingLinkEstimator.h"
+#include "CtpRoutingTableManager.h"
 
 // Register the module with Omnet
 Define_Module(CtpRoutingLinkEstimator);
 
 // Const strings for output names
 const char * CtpRoutingLinkEstimator::OUTPUT_LINK_QUALITY = "LinkEstimator LQ";
+const char * CtpRoutingLinkEstimator::OUTPUT_FAST_ADMISSION = "LinkEstimator Fast admission";
 
 void CtpRoutingLinkEstimator::initialize()
 {
@@ -13,6 +15,13 @@ void CtpRoutingLinkEstimator::initialize()
 	etxSmoothingConst = par("etxSmoothingConst");
 	inBeaconWindowSize = par("inBeaconWindowSize");
 	outMessageWindowSize = par("outMessageWindowSize");
+	fastAdmission = par("fastAdmission");
+	fastAdmissionRssiThreshold = par("fastAdmissionRssiThreshold");
+	fastAdmissionRssiGood = par("fastAdmissionRssiGood");
+	fastAdmissionMaxSeedEtx = par("fastAdmissionMaxSeedEtx");
+	if(fastAdmission && fastAdmissionRssiGood <= fastAdmissionRssiThreshold) {
+		opp_error("fastAdmissionRssiGood must be higher than fastAdmissionRssiThreshold");
+	}
 
 	// Initialise private variables
 	noUnsuccessfulDeliveriesSinceLastSuccessful = 0;
@@ -32,9 +41,17 @@ void CtpRoutingLinkEstimator::initialize()
 	// Set the timer drift for the timer service. If we do not do this all timers will return immediately!
 	setTimerDrift(resMgrModule->getCPUClockDrift());
 
+	// The neighbour table is owned by the table manager
+	tableManager = check_and_cast<CtpRoutingTableManager*>(getParentModule()->getSubmodule("TableManager"));
+	neighbourTable = &tableManager->getNeighbourTable();
+
+	// The direct call switch is in the containing compound module, as it applies to all CTP submodules
+	directSubmoduleCalls = getParentModule()->par("directSubmoduleCalls");
+
 	// Declare outputs
 	// declareHistogram(name, min value, max value, number of buckets)
 	declareHistogram(OUTPUT_LINK_QUALITY, 1, 10, 10);
+	declareOutput(OUTPUT_FAST_ADMISSION);
 }
 
 void CtpRoutingLinkEstimator::handleMessage(cMessage *msg)
@@ -56,14 +73,12 @@ void CtpRoutingLinkEstimator::handleMessage(cMessage *msg)
 			switch(controlMsg->getRoutingControlMessageKind()) {
 
 				case ROUTING_MSG_MAC_SENDING_ACKED: {
-					trace() << "Updating outgoing LQ of node " << controlMsg->getValue() << ": ACK received";
-					updateOutgoingLinkQuality(controlMsg->getValue(), true); // value = the outgoing node id, true = message was ACKed
+					sendingResult(controlMsg->getValue(), true); // value = the outgoing node id, true = message was ACKed
 					break;
 				}
 
 				case ROUTING_MSG_MAC_SENDING_FAILED_NO_ACK: {
-					trace() << "Updating outgoing LQ of node " << controlMsg->getValue() << ": No ACK";
-					updateOutgoingLinkQuality(controlMsg->getValue(), false); // value = the outgoing node id, false = message not ACKed
+					sendingResult(controlMsg->getValue(), false); // value = the outgoing node id, false = message not ACKed
 					break;
 				}
 
@@ -80,33 +95,18 @@ void CtpRoutingLinkEstimator::handleMessage(cMessage *msg)
 			switch(ctpPkt->getRoutingPacketKind()) {
 
 				case CTP_ROUTING_PACKET_TYPE_BEACON: {
-					// We have received a beacon, we need to use this to update the incoming link quality metrics
-					int beaconFromNode = ctpPkt->getNetMacInfoExchange().lastHop;
-					int beaconSeqNo = ctpPkt->getSequenceNumber();
-
-					// First check this isn't a duplicate of one we have already received
-					if(lastSeqNoReceivedFromNode.count(beaconFromNode) > 0 &&
-						lastSeqNoReceivedFromNode[beaconFromNode] == beaconSeqNo)
-					{
-						trace() << "Ignoring duplicate beacon " << beaconSeqNo << " form node " << beaconFromNode;
-					}
-					else
-					{
-						trace() << "Updating incoming LQ of node " << beaconFromNode << ": received beacon " << beaconSeqNo;
-						updateIncomingLinkQuality(beaconFromNode, beaconSeqNo);
-						
-						// Also inform the table manager of the sender's mutihop ETX to root (for selecting our parent)
-						// and the sender's parent (so we can check that we're not choosing a node as parent who has us as parent)
-						TableManagerControlMessage *updateMsg = new TableManagerControlMessage("Update beacon sender multihop ETX", TABLE_MANAGER_CONTROL_COMMAND);
-						updateMsg->setTableManagerControlMessageKind(TABLE_MANAGER_UPDATE_REMOTE_NODE_ROUTING_TABLE_INFO);
-						updateMsg->setNodeId(beaconFromNode);
-						updateMsg->setValue(ctpPkt->getMultihopEtxToRoot()); // Value is the multihop ETX of the node
-						updateMsg->setParentNodeId(ctpPkt->getParentNodeId()); // This is the sender's parent
-						send(updateMsg, "toTableManager");
-
-						// Add this to the last received beacon seq no list so we can check for subsequent duplciates
-						lastSeqNoReceivedFromNode[beaconFromNode] = beaconSeqNo;
-					}
+					beaconReceived(ctpPkt);
+					break;
+				}
+
+				case CTP_ROUTING_PACKET_TYPE_DATA: {
+					dataPacketReceived(ctpPkt);
+					break;
+				}
+
+				// Aggregates carry the sender's routing info in the same way as data packets
+				case CTP_ROUTING_PACKET_TYPE_AGGREGATE: {
+					dataPacketReceived(ctpPkt);
 					break;
 				}
 			}
@@ -116,19 +116,7 @@ void CtpRoutingLinkEstimator::handleMessage(cMessage *msg)
 
 		case OUT_OF_ENERGY:
 		{
-			// We need to simulate what happens when a node runs out of energy - all state will be lost
-
-			// Reinitialise private variables
-			noUnsuccessfulDeliveriesSinceLastSuccessful = 0;
-			// Clear state maps
-			lastSeqNoReceivedFromNode.clear();
-			inWindowOfBeaconSeqNos.clear();
-			previousInLqs.clear();
-			previousEtxs.clear();
-			outWindowOfMessagesSent.clear();
-			
-			// Cancel any pending timers
-			cancelAllTimers();
+			outOfEnergy();
 			break;
 		}
 
@@ -141,34 +129,201 @@ void CtpRoutingLinkEstimator::handleMessage(cMessage *msg)
 	cancelAndDelete(msg);
 }
 
-void CtpRoutingLinkEstimator::updateIncomingLinkQuality(int nodeId, unsigned int seqNo)
+void CtpRoutingLinkEstimator::beaconReceived(CtpRoutingPacket *beacon)
+{
+	Enter_Method_Silent();
+
+	// We have received a beacon, we need to use this to update the incoming link quality metrics
+	int beaconFromNode = beacon->getNetMacInfoExchange().lastHop;
+	int beaconSeqNo = beacon->getSequenceNumber();
+	CtpNeighbour_t &neighbour = neighbourTable->getNeighbour(beaconFromNode);
+
+	// First check this isn't a duplicate of one we have already received
+	if(neighbour.lastBeaconSeqNoReceived == beaconSeqNo)
+	{
+		trace() << "Ignoring duplicate beacon " << beaconSeqNo << " form node " << beaconFromNode;
+		return;
+	}
+
+	// The beacon which creates the neighbour's entry (a cleared entry has no last beacon)
+	bool isFirstBeacon = (neighbour.lastBeaconSeqNoReceived == -1);
+
+	trace() << "Updating incoming LQ of node " << beaconFromNode << ": received beacon " << beaconSeqNo;
+	updateIncomingLinkQuality(beaconFromNode, neighbour, beaconSeqNo);
+
+	// Store the last received beacon seq no so we can check for subsequent duplciates
+	neighbour.lastBeaconSeqNoReceived = beaconSeqNo;
+
+	// A good first beacon gets the neighbour into the routing table straight away, with its routing info
+	if(isFirstBeacon && seedEtxFromFirstBeacon(beaconFromNode, neighbour, beacon))
+	{
+		if(directSubmoduleCalls)
+		{
+			tableManager->fastAdmitNeighbour(beaconFromNode, neighbour.previousEtx, beacon->getMultihopEtxToRoot(),
+				beacon->getParentNodeId(), beacon->getCongestionFlag());
+		}
+		else
+		{
+			TableManagerControlMessage *admitMsg = new TableManagerControlMessage("Fast admit beacon sender", TABLE_MANAGER_CONTROL_COMMAND);
+			admitMsg->setTableManagerControlMessageKind(TABLE_MANAGER_FAST_ADMIT_NEIGHBOUR);
+			admitMsg->setNodeId(beaconFromNode);
+			admitMsg->setSingleHopEtx(neighbour.previousEtx);
+			admitMsg->setValue(beacon->getMultihopEtxToRoot()); // Value is the multihop ETX of the node
+			admitMsg->setParentNodeId(beacon->getParentNodeId());
+			admitMsg->setCongested(beacon->getCongestionFlag());
+			send(admitMsg, "toTableManager");
+		}
+		return;
+	}
+	
+	// Also inform the table manager of the sender's mutihop ETX to root (for selecting our parent)
+	// and the sender's parent (so we can check that we're not choosing a node as parent who has us as parent)
+	if(directSubmoduleCalls)
+	{
+		tableManager->updateRemoteNodeRoutingInfo(beaconFromNode, beacon->getMultihopEtxToRoot(), beacon->getParentNodeId(),
+			beacon->getCongestionFlag());
+	}
+	else
+	{
+		TableManagerControlMessage *updateMsg = new TableManagerControlMessage("Update beacon sender multihop ETX", TABLE_MANAGER_CONTROL_COMMAND);
+		updateMsg->setTableManagerControlMessageKind(TABLE_MANAGER_UPDATE_REMOTE_NODE_ROUTING_TABLE_INFO);
+		updateMsg->setNodeId(beaconFromNode);
+		updateMsg->setValue(beacon->getMultihopEtxToRoot()); // Value is the multihop ETX of the node
+		updateMsg->setParentNodeId(beacon->getParentNodeId()); // This is the sender's parent
+		updateMsg->setCongested(beacon->getCongestionFlag());
+		send(updateMsg, "toTableManager");
+	}
+}
+
+void CtpRoutingLinkEstimator::dataPacketReceived(CtpRoutingPacket *dataPacket)
+{
+	Enter_Method_Silent();
+
+	// Data packets (addressed to us or snooped) are sent to us by the controller as extra routing evidence.
+	// Their sequence numbers are per origin rather than per sender, so can't be used for the incoming LQ, but
+	// they do tell us the sender's MH-ETX, and its parent (the packet's next hop)
+	int fromNode = dataPacket->getNetMacInfoExchange().lastHop;
+	int sendersParent = dataPacket->getNetMacInfoExchange().nextHop;
+	trace() << "Data packet from node " << fromNode << ": MH-ETX " << dataPacket->getMultihopEtxToRoot() << ", parent " << sendersParent;
+
+	if(directSubmoduleCalls)
+	{
+		tableManager->updateRemoteNodeRoutingInfo(fromNode, dataPacket->getMultihopEtxToRoot(), sendersParent,
+			dataPacket->getCongestionFlag());
+	}
+	else
+	{
+		TableManagerControlMessage *updateMsg = new TableManagerControlMessage("Update data sender multihop ETX", TABLE_MANAGER_CONTROL_COMMAND);
+		updateMsg->setTableManagerControlMessageKind(TABLE_MANAGER_UPDATE_REMOTE_NODE_ROUTING_TABLE_INFO);
+		updateMsg->setNodeId(fromNode);
+		updateMsg->setValue(dataPacket->getMultihopEtxToRoot()); // Value is the multihop ETX of the node
+		updateMsg->setParentNodeId(sendersParent);
+		updateMsg->setCongested(dataPacket->getCongestionFlag());
+		send(updateMsg, "toTableManager");
+	}
+}
+
+void CtpRoutingLinkEstimator::sendingResult(int nodeId, bool wasAcked)
+{
+	Enter_Method_Silent();
+	trace() << "Updating outgoing LQ of node " << nodeId << (wasAcked ? ": ACK received" : ": No ACK");
+	updateOutgoingLinkQuality(nodeId, neighbourTable->getNeighbour(nodeId), wasAcked);
+}
+
+void CtpRoutingLinkEstimator::penaliseLink(int nodeId, unsigned int failures)
+{
+	Enter_Method_Silent();
+	// The failures count as a full outgoing window with no ACKs, as in updateOutgoingLinkQuality, without waiting
+	// for the window to fill
+	trace() << "Penalising link to node " << nodeId << " after " << failures << " failed sends";
+	CtpNeighbour_t &neighbour = neighbourTable->getNeighbour(nodeId);
+	neighbour.outWindowMessagesSent = 0;
+	neighbour.outWindowMessagesAcked = 0;
+	updateEtx(nodeId, neighbour, failures);
+}
+
+void CtpRoutingLinkEstimator::outOfEnergy()
+{
+	Enter_Method_Silent();
+	// We need to simulate what happens when a node runs out of energy - all state will be lost
+
+	// Reinitialise private variables
+	noUnsuccessfulDeliveriesSinceLastSuccessful = 0;
+	// Clear link estimation state (the table manager clears the routing state in the table)
+	neighbourTable->clearLinkEstimates();
+	
+	// Cancel any pending timers
+	cancelAllTimers();
+}
+
+std::vector<std::string> CtpRoutingLinkEstimator::getLinkEstimateRecords()
+{
+	Enter_Method_Silent();
+	std::vector<std::string> records;
+	for(int nodeId = 0; nodeId < neighbourTable->size(); nodeId++)
+	{
+		CtpNeighbour_t &neighbour = neighbourTable->getNeighbour(nodeId);
+		if(neighbour.previousInLq != -1 || neighbour.previousEtx != -1)
+		{
+			std::ostringstream record;
+			record << nodeId << " " << neighbour.previousInLq << " " << neighbour.previousEtx;
+			records.push_back(record.str());
+		}
+	}
+	return records;
+}
+
+void CtpRoutingLinkEstimator::restoreLinkEstimates(const std::vector<std::string> &records)
+{
+	Enter_Method_Silent();
+	for(unsigned int i = 0; i < records.size(); i++)
+	{
+		std::istringstream record(records[i]);
+		int nodeId;
+		double previousInLq, previousEtx;
+		if(!(record >> nodeId >> previousInLq >> previousEtx)) {
+			opp_error("Malformed CTP link estimate snapshot record: %s", records[i].c_str());
+		}
+		// New estimates are smoothed with the restored ones, as if the estimator had been running all along
+		CtpNeighbour_t &neighbour = neighbourTable->getNeighbour(nodeId);
+		neighbour.previousInLq = previousInLq;
+		neighbour.previousEtx = previousEtx;
+	}
+	trace() << "Restored " << records.size() << " link estimates from snapshot";
+}
+
+void CtpRoutingLinkEstimator::updateIncomingLinkQuality(int nodeId, CtpNeighbour_t &neighbour, unsigned int seqNo)
 { 
 	double newInLq;
 	int numberBeaconsBroadcast;
 
-	// First check if the last stored seqNo (if any) is greater than the one we have just received from the node	
-	if(!inWindowOfBeaconSeqNos[nodeId].empty() && inWindowOfBeaconSeqNos[nodeId].front() >= seqNo)
+	// First check if the first stored seqNo (if any) is greater than the one we have just received from the node	
+	if(neighbour.inWindowBeaconsReceived > 0 && neighbour.inWindowFirstSeqNo >= seqNo)
 	{
 		// If it is, this must mean the node which sent the beacon has restarted (restart causes seqNo to be reset)
 		trace() << "WARNING - received beacon " << seqNo << " from node " << nodeId << " which is less than last known beacon number "
-			<< inWindowOfBeaconSeqNos[nodeId].front() << ". This can happen if a neighbouring node has restarted, "
+			<< neighbour.inWindowFirstSeqNo << ". This can happen if a neighbouring node has restarted, "
 			<< "and its sequence number has restarted from zero. If a neighbour hasn't just restarted, something went wrong!";
 
 		// Therefore, we should clear the old stored seqNos for this node
-		inWindowOfBeaconSeqNos[nodeId].clear();
+		neighbour.inWindowBeaconsReceived = 0;
 	}
 
 	// Add the new beacon's sequence number to the specified node's window of stored beacons	
-	inWindowOfBeaconSeqNos[nodeId].push_back(seqNo);
+	if(neighbour.inWindowBeaconsReceived == 0) {
+		neighbour.inWindowFirstSeqNo = seqNo;
+	}
+	neighbour.inWindowLastSeqNo = seqNo;
+	neighbour.inWindowBeaconsReceived++;
 
 	// Is the beacon window now full?
-	if(inWindowOfBeaconSeqNos[nodeId].size() >= inBeaconWindowSize)
+	if(neighbour.inWindowBeaconsReceived >= inBeaconWindowSize)
 	{
 		// If it's full, we need to recalculate the specified node's incoming LQ
 
 		// First calculate 'number of beacons received' / 'number of beacons broadcast'
 		// Number of beacons broadcast is calculated as (difference between first and last beacon sequence numbers) + 1
-		numberBeaconsBroadcast = (inWindowOfBeaconSeqNos[nodeId].back() - inWindowOfBeaconSeqNos[nodeId].front()) + 1;
+		numberBeaconsBroadcast = (neighbour.inWindowLastSeqNo - neighbour.inWindowFirstSeqNo) + 1;
 
 		if(numberBeaconsBroadcast <= 0) {
 			opp_error("Error calculating number of beacons broadcast - result was negative");
@@ -178,38 +333,65 @@ void CtpRoutingLinkEstimator::updateIncomingLinkQuality(int nodeId, unsigned int
 		newInLq =  (double) numberBeaconsBroadcast / (double) inBeaconWindowSize; // inBeaconWindowSize is the number of beacons received in this window
 		trace() << "Beacons broadcast (" << numberBeaconsBroadcast << ") / beacons received (" << inBeaconWindowSize << ") = " << newInLq;
 
-		// Has there been a previously calculated incoming LQ for the specified node?
-		if(previousInLqs.count(nodeId) > 0)
+		// Has there been a previously calculated incoming LQ for the specified node? (-1 means none)
+		if(neighbour.previousInLq != -1)
 		{
 			// If yes, we need to apply the exponential smoothing filter using previous value
-			newInLq = (inLqSmoothingConst * newInLq) + ((1 - inLqSmoothingConst) * previousInLqs[nodeId]);
+			newInLq = (inLqSmoothingConst * newInLq) + ((1 - inLqSmoothingConst) * neighbour.previousInLq);
 			trace() << "After smoothing: " << newInLq;
 		}
 
 		// Update ETX using the incoming link quality as the metric
-		updateEtx(nodeId, newInLq);
+		updateEtx(nodeId, neighbour, newInLq);
 
 		// Clear the window of beacons for the specified node ready for the next window
-		inWindowOfBeaconSeqNos[nodeId].clear();
+		neighbour.inWindowBeaconsReceived = 0;
 		// Update the 'previous' incoming LQ as this one
-		previousInLqs[nodeId] = newInLq;
+		neighbour.previousInLq = newInLq;
 	}
 }
 
-void CtpRoutingLinkEstimator::updateOutgoingLinkQuality(int nodeId, bool wasAcked)
+bool CtpRoutingLinkEstimator::seedEtxFromFirstBeacon(int nodeId, CtpNeighbour_t &neighbour, CtpRoutingPacket *beacon)
+{
+	// Until the first beacon window is full, a neighbour has no ETX and can't be chosen as parent. If the first
+	// beacon was received strongly (the "white bit"), seed the ETX from its RSSI instead: from 1 at
+	// fastAdmissionRssiGood and above, up to fastAdmissionMaxSeedEtx at fastAdmissionRssiThreshold. The seed is
+	// smoothed with the first window's estimate like any previous ETX. Weaker links wait for the window, as RSSI
+	// says little about links in the grey region. Only called for the first beacon from each neighbour
+	if(!fastAdmission || neighbour.previousEtx != -1) {
+		return false;
+	}
+
+	double rssi = beacon->getNetMacInfoExchange().RSSI;
+	if(rssi < fastAdmissionRssiThreshold)
+	{
+		collectOutput(OUTPUT_FAST_ADMISSION, "weak first beacon");
+		return false;
+	}
+
+	double weakness = std::min(1.0, (fastAdmissionRssiGood - rssi) / (fastAdmissionRssiGood - fastAdmissionRssiThreshold));
+	double seedEtx = 1 + std::max(0.0, weakness) * (fastAdmissionMaxSeedEtx - 1);
+	trace() << "Seeding ETX of node " << nodeId << " from first beacon RSSI " << rssi << ": " << seedEtx;
+	collectOutput(OUTPUT_FAST_ADMISSION, "seeded");
+	neighbour.previousEtx = seedEtx;
+	return true;
+}
+
+void CtpRoutingLinkEstimator::updateOutgoingLinkQuality(int nodeId, CtpNeighbour_t &neighbour, bool wasAcked)
 {
 	double newOutLq;
 
-	// Add the new message result to this node's window of stored beacons
-	outWindowOfMessagesSent[nodeId].push_back((int) wasAcked); // true = 1, false = 0
+	// Add the new message result to this node's window of messages sent
+	neighbour.outWindowMessagesSent++;
+	if(wasAcked) {
+		neighbour.outWindowMessagesAcked++;
+	}
 
-	// Is the beacon window now full?
-	if(outWindowOfMessagesSent[nodeId].size() >= outMessageWindowSize)
+	// Is the message window now full?
+	if(neighbour.outWindowMessagesSent >= outMessageWindowSize)
 	{
 		// If it's full, we need to recalculate the specified node's outgoing LQ
-		// Count the number of true results (sum all the 1s).
-		// note for accumulate: the 0 at the end is the initial sum value, and is used for the return type (int)
-		int numberOfAckedMsgs = std::accumulate(outWindowOfMessagesSent[nodeId].begin(), outWindowOfMessagesSent[nodeId].end(), 0); 
+		int numberOfAckedMsgs = neighbour.outWindowMessagesAcked;
 		
 		// If the number of ACKs is zero, the link quality is calculated as the number of unsuccessful delivery attempts 
 		// since the last successful delivery
@@ -232,20 +414,21 @@ void CtpRoutingLinkEstimator::updateOutgoingLinkQuality(int nodeId, bool wasAcke
 		}
 
 		// Update ETX using the outgoing link quality as the metric
-		updateEtx(nodeId, newOutLq);
+		updateEtx(nodeId, neighbour, newOutLq);
 
 		// Clear the window of messages sent for the specified node ready for the next window
-		outWindowOfMessagesSent[nodeId].clear();
+		neighbour.outWindowMessagesSent = 0;
+		neighbour.outWindowMessagesAcked = 0;
 	}
 }
 
-void CtpRoutingLinkEstimator::updateEtx(int nodeId, double newEtx)
+void CtpRoutingLinkEstimator::updateEtx(int nodeId, CtpNeighbour_t &neighbour, double newEtx)
 {
-	// Has there been a previously calculated ETX for this node (using either incoming our outgoing LQ)?
-	if(previousEtxs.count(nodeId) > 0)
+	// Has there been a previously calculated ETX for this node (using either incoming our outgoing LQ)? (-1 means none)
+	if(neighbour.previousEtx != -1)
 	{
 		// If yes, we need to apply exponential smoothing using previous ETX
-		newEtx = (etxSmoothingConst * newEtx) + ((1 - etxSmoothingConst) * previousEtxs[nodeId]);
+		newEtx = (etxSmoothingConst * newEtx) + ((1 - etxSmoothingConst) * neighbour.previousEtx);
 		trace() << "Updated (smoothed) ETX for node " << nodeId << ": " << newEtx;
 	}
 	else
@@ -256,15 +439,22 @@ void CtpRoutingLinkEstimator::updateEtx(int nodeId, double newEtx)
 	// Collect stats
 	collectHistogram(OUTPUT_LINK_QUALITY, newEtx);
 
-	// send the new ETX to the routing table manager
-	TableManagerControlMessage *updateMsg = new TableManagerControlMessage("Update node ETX message", TABLE_MANAGER_CONTROL_COMMAND);
-	updateMsg->setTableManagerControlMessageKind(TABLE_MANAGER_UPDATE_NODE_ETX);
-	updateMsg->setNodeId(nodeId);
-	updateMsg->setValue(newEtx);
-	send(updateMsg, "toTableManager");
-
 	// Update the 'previous' ETX as this one
-	previousEtxs[nodeId] = newEtx;
+	neighbour.previousEtx = newEtx;
+
+	// send the new ETX to the routing table manager
+	if(directSubmoduleCalls)
+	{
+		tableManager->updateNodeEtx(nodeId, newEtx);
+	}
+	else
+	{
+		TableManagerControlMessage *updateMsg = new TableManagerControlMessage("Update node ETX message", TABLE_MANAGER_CONTROL_COMMAND);
+		updateMsg->setTableManagerControlMessageKind(TABLE_MANAGER_UPDATE_NODE_ETX);
+		updateMsg->setNodeId(nodeId);
+		updateMsg->setValue(newEtx);
+		send(updateMsg, "toTableManager");
+	}
 }
 
 
@@ -1,19 +1,23 @@
 #ifndef _CTPROUTINGLINKESTIMATOR_H_
 #define _CTPROUTINGLINKESTIMATOR_H_
 
-#include <map>
-#include <numeric>
 #include "CastaliaModule.h"
 #include "TimerService.h"
 #include "ResourceManager.h"
 #include "CtpRoutingPacket_m.h"
 #include "RoutingControlMessage_m.h"
 #include "TableManagerControlMessage_m.h"
+#include "CtpNeighbourTable.h"
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <sstream>
 
 enum linkEstimatorTimers {
 	
 };
 
+class CtpRoutingTableManager;
 
 
 class CtpRoutingLinkEstimator : public CastaliaModule, public TimerService
@@ -24,26 +28,45 @@ class CtpRoutingLinkEstimator : public CastaliaModule, public TimerService
 		double etxSmoothingConst;
 		unsigned int inBeaconWindowSize;
 		unsigned int outMessageWindowSize;
+		bool fastAdmission;
+		double fastAdmissionRssiThreshold;
+		double fastAdmissionRssiGood;
+		double fastAdmissionMaxSeedEtx;
 
 		// Other private variables:
 		// Output names:
 		static const char *OUTPUT_LINK_QUALITY;
+		static const char *OUTPUT_FAST_ADMISSION;
 
-		// For storing the last beacon seqNo we receive from each node - used to detect and drop duplciates
-		std::map<int, int> lastSeqNoReceivedFromNode;
-
-		// For calculating incoming link quality based on beacons received:
-		std::map<int, vector<int> > inWindowOfBeaconSeqNos;
-		std::map<int, double> previousInLqs;
-		std::map<int, double> previousEtxs;
-		// For calculating outgoing link quality based on messages sent / not ACKed
-		std::map<int, vector<int> > outWindowOfMessagesSent;
-		int noUnsuccessfulDeliveriesSinceLastSuccessful; // Used to calculate outgoin LQ if we get zero ACKs in a window
+		// Per-neighbour link estimation state (last beacon seqNo, beacon and message windows, previous LQ / ETX)
+		// is held in the neighbour table shared with the table manager
+		CtpNeighbourTable *neighbourTable;
+		int noUnsuccessfulDeliveriesSinceLastSuccessful;
+		// For calling the table manager directly instead of sending it control messages
+		bool directSubmoduleCalls;
+		CtpRoutingTableManager *tableManager; // Used to calculate outgoin LQ if we get zero ACKs in a window
 
 		// Private member functions:
-		void updateIncomingLinkQuality(int nodeId, unsigned int seqNo);
-		void updateOutgoingLinkQuality(int nodeId, bool wasAcked);
-		void updateEtx(int nodeId, double newEtx);
+		void updateIncomingLinkQuality(int nodeId, CtpNeighbour_t &neighbour, unsigned int seqNo);
+		void updateOutgoingLinkQuality(int nodeId, CtpNeighbour_t &neighbour, bool wasAcked);
+		void updateEtx(int nodeId, CtpNeighbour_t &neighbour, double newEtx);
+		bool seedEtxFromFirstBeacon(int nodeId, CtpNeighbour_t &neighbour, CtpRoutingPacket *beacon);
+
+	public:
+
+		// Direct calls from the controller (used instead of messages when the CtpRouting directSubmoduleCalls
+		// parameter is set). Packets are only read, and remain owned by the caller
+		void beaconReceived(CtpRoutingPacket *beacon);
+		void dataPacketReceived(CtpRoutingPacket *dataPacket);
+		void sendingResult(int nodeId, bool wasAcked);
+		// Called directly by the controller when it gives up on sending to a node for now
+		void penaliseLink(int nodeId, unsigned int failures);
+		void outOfEnergy();
+
+		// Link estimate snapshot, one record per neighbour: "<nodeId> <incoming LQ> <ETX>". Beacon and message
+		// windows are not included, as they only make sense with the sequence numbers of the run they came from
+		std::vector<std::string> getLinkEstimateRecords();
+		void restoreLinkEstimates(const std::vector<std::string> &records);
 
 	protected:
 		
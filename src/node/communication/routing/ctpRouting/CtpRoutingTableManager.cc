@@ -1,4 +1,6 @@
 #include "CtpRoutingTableManager.h"
+#include "CtpRoutingBeaconSender.h"
+#include "CtpRoutingController.h"
 
 // Register the module with Omnet
 Define_Module(CtpRoutingTableManager);
@@ -6,6 +8,8 @@ Define_Module(CtpRoutingTableManager);
 const char * CtpRoutingTableManager::OUTPUT_SH_ETX_TO_PARENT = "CtpRouting SH-ETX to parent";
 const char * CtpRoutingTableManager::OUTPUT_MH_ETX = "CtpRouting MH-ETX";
 const char * CtpRoutingTableManager::OUTPUT_TIMES_SWITCHED_PARENT = "CtpRouting Times switched parent";
+const char * CtpRoutingTableManager::OUTPUT_SWITCHED_FROM_CONGESTED_PARENT = "CtpRouting Switched from congested parent";
+const char * CtpRoutingTableManager::OUTPUT_FAST_ADMISSION_EVICTIONS = "CtpRouting Fast admission evictions";
 
 void CtpRoutingTableManager::initialize()
 {
@@ -14,6 +18,7 @@ void CtpRoutingTableManager::initialize()
 	evictionEtxThreshold = par("evictionEtxThreshold");
 	newParentSwitchAdditionalMhEtx = par("newParentSwitchAdditionalMhEtx");
 	unreachableNodeShEtxThreshold = par("unreachableNodeShEtxThreshold");
+	congestedParentSwitchMargin = par("congestedParentSwitchMargin");
 
 	// Initialise private variables
 	invalidateParent(false); // (re)initialises current parent and MHETX variables 
@@ -40,11 +45,25 @@ void CtpRoutingTableManager::initialize()
 		->getParentModule()  // Node module
 		->getIndex();
 
+	// The direct call switch is in the containing compound module, as it applies to all CTP submodules
+	directSubmoduleCalls = getParentModule()->par("directSubmoduleCalls");
+	beaconSender = check_and_cast<CtpRoutingBeaconSender*>(getParentModule()->getSubmodule("BeaconSender"));
+	controller = check_and_cast<CtpRoutingController*>(getParentModule()->getSubmodule("Controller"));
+
+	// Allocate a neighbour table entry for every node in the network
+	neighbourTable.initialise(getParentModule() // Routing container module
+		->getParentModule()  // Communication module
+		->getParentModule()  // Node module
+		->getParentModule()  // Network module
+		->par("numNodes"));
+
 	// Declare stats outputs
 	// declareHistogram(name, min value, max value, number of buckets)
 	declareHistogram(OUTPUT_SH_ETX_TO_PARENT, 1, 10, 10);
 	declareHistogram(OUTPUT_MH_ETX, 1, 10, 10);
 	declareOutput(OUTPUT_TIMES_SWITCHED_PARENT);
+	declareOutput(OUTPUT_SWITCHED_FROM_CONGESTED_PARENT);
+	declareOutput(OUTPUT_FAST_ADMISSION_EVICTIONS);
 }
 
 void CtpRoutingTableManager::handleMessage(cMessage *msg)
@@ -66,30 +85,26 @@ void CtpRoutingTableManager::handleMessage(cMessage *msg)
 			switch(controlMsg->getTableManagerControlMessageKind())
 			{
 				case TABLE_MANAGER_UPDATE_NODE_ETX: {
-					// If we are the sink, we don't need the routing table so don't do anything
-					if(!isSink)
-					{
-						trace() << "Received single-hop ETX for node " << controlMsg->getNodeId() << ": " << controlMsg->getValue();
-						updateEtxLinkQualityToNode(controlMsg->getNodeId(), controlMsg->getValue());
-					}
+					updateNodeEtx(controlMsg->getNodeId(), controlMsg->getValue());
 					break;
 				}
 
 				case TABLE_MANAGER_UPDATE_REMOTE_NODE_ROUTING_TABLE_INFO: {
-					// If we are the sink, we don't need the routing table so don't do anything
-					if(!isSink)
-					{
-						trace() << "Received remote routing table info for node " << controlMsg->getNodeId() 
-							<< ", MH-ETX: " << controlMsg->getValue() << ", Parent node ID: " << controlMsg->getParentNodeId();
-						updateParentAndMultihopEtxToRootForRemoteNode(
-							controlMsg->getNodeId(), 
-							controlMsg->getValue(),	// Value is MH-ETX
-							controlMsg->getParentNodeId());
-					}
-					else
-					{
-						trace() << "This is sink node so ignoring routing table info";
-					}
+					updateRemoteNodeRoutingInfo(
+						controlMsg->getNodeId(), 
+						controlMsg->getValue(),	// Value is MH-ETX
+						controlMsg->getParentNodeId(),
+						controlMsg->getCongested());
+					break;
+				}
+
+				case TABLE_MANAGER_FAST_ADMIT_NEIGHBOUR: {
+					fastAdmitNeighbour(
+						controlMsg->getNodeId(),
+						controlMsg->getSingleHopEtx(),
+						controlMsg->getValue(),	// Value is MH-ETX
+						controlMsg->getParentNodeId(),
+						controlMsg->getCongested());
 					break;
 				}
 
@@ -107,17 +122,7 @@ void CtpRoutingTableManager::handleMessage(cMessage *msg)
 			switch(controlMsg->getRoutingControlMessageKind()) {
 
 				case ROUTING_MSG_SINK_NODE_UPDATE: {
-
-					sinkNodeId = controlMsg->getValue();
-					if(sinkNodeId == selfNodeId) {
-						trace() << "This node is sink";
-						isSink = true;
-
-						// The sink always has multihop ETX to root value of zero
-						currentMultihopEtxToRoot = 0;
-						// Update the beacon sender with the zero multihop ETX
-						notifyBeaconSenderMultihopEtx();
-					}
+					updateSinkNode(controlMsg->getValue());
 					break;
 				}
 
@@ -131,15 +136,7 @@ void CtpRoutingTableManager::handleMessage(cMessage *msg)
 
 		case OUT_OF_ENERGY:
 		{
-			// We need to simulate what happens when a node runs out of energy - all state will be lost
-
-			// Reinitialise private variables
-			currentMultihopEtxToRoot = -1; 	// -1 means invalid
-			currentParentNodeId = -1;		// -1 means no parent
-			// Clear routing state
-			nodeRoutingTable.clear();
-			// Cancel any pending timers
-			cancelAllTimers();
+			outOfEnergy();
 			break;
 		}
 
@@ -152,9 +149,184 @@ void CtpRoutingTableManager::handleMessage(cMessage *msg)
 	cancelAndDelete(msg);
 }
 
+void CtpRoutingTableManager::updateNodeEtx(int nodeId, double singleHopEtx)
+{
+	Enter_Method_Silent();
+	// If we are the sink, we don't need the routing table so don't do anything
+	if(!isSink)
+	{
+		trace() << "Received single-hop ETX for node " << nodeId << ": " << singleHopEtx;
+		updateEtxLinkQualityToNode(nodeId, singleHopEtx);
+	}
+}
+
+void CtpRoutingTableManager::updateRemoteNodeRoutingInfo(int nodeId, double multihopEtxToRoot, int parentNodeId, bool isCongested)
+{
+	Enter_Method_Silent();
+	// If we are the sink, we don't need the routing table so don't do anything
+	if(!isSink)
+	{
+		trace() << "Received remote routing table info for node " << nodeId 
+			<< ", MH-ETX: " << multihopEtxToRoot << ", Parent node ID: " << parentNodeId << ", congested: " << isCongested;
+		updateParentAndMultihopEtxToRootForRemoteNode(nodeId, multihopEtxToRoot, parentNodeId, isCongested);
+	}
+	else
+	{
+		trace() << "This is sink node so ignoring routing table info";
+	}
+}
+
+void CtpRoutingTableManager::fastAdmitNeighbour(int nodeId, double seedShEtx, double multihopEtxToRoot, int parentNodeId, bool isCongested)
+{
+	Enter_Method_Silent();
+	if(isSink)
+	{
+		trace() << "This is sink node so ignoring routing table info";
+		return;
+	}
+
+	trace() << "Fast admission of node " << nodeId << " with seed single hop ETX " << seedShEtx;
+
+	// Compare bit: if the table is full, the neighbour takes the place of the entry with the highest MH-ETX if it
+	// offers a better route. Entries without a link estimate yet are counted as perfect links
+	if(!neighbourTable.isInRoutingTable(nodeId) && neighbourTable.getRoutingTableSize() >= nodeRoutingTableMaxSize
+		&& multihopEtxToRoot != -1)
+	{
+		int worstNodeId = highestMhEtxNodes.top();
+		if(worstNodeId != -1)
+		{
+			CtpNeighbour_t &worst = neighbourTable.getNeighbour(worstNodeId);
+			if(multihopEtxToRoot + seedShEtx < worst.nodeMultihopEtxToRoot + std::max(worst.etxLinkQualityToNode, 1.0))
+			{
+				trace() << "Routing table full, evicting node " << worstNodeId << " to make way for better route via node " << nodeId;
+				collectOutput(OUTPUT_FAST_ADMISSION_EVICTIONS);
+				removeNodeFromTable(worstNodeId);
+			}
+		}
+	}
+
+	// Then add / update the entry as for any routing info
+	updateParentAndMultihopEtxToRootForRemoteNode(nodeId, multihopEtxToRoot, parentNodeId, isCongested);
+
+	// The seed only stands in until the link estimator has a real estimate
+	if(neighbourTable.isInRoutingTable(nodeId) && neighbourTable.getNeighbour(nodeId).etxLinkQualityToNode == -1)
+	{
+		neighbourTable.getNeighbour(nodeId).etxLinkQualityToNode = seedShEtx;
+		reindexNode(nodeId);
+		updateParentAndMultihopEtxToRoot();
+	}
+}
+
+int CtpRoutingTableManager::getFallbackParent(double &pathEtx)
+{
+	Enter_Method_Silent();
+	int candidateNodeId = findBestParentCandidate(true);
+	if(candidateNodeId == -1) {
+		candidateNodeId = findBestParentCandidate(false);
+	}
+	if(candidateNodeId != -1) {
+		pathEtx = getPathEtx(candidateNodeId);
+	}
+	return candidateNodeId;
+}
+
+void CtpRoutingTableManager::updateSinkNode(int newSinkNodeId)
+{
+	Enter_Method_Silent();
+	// There may be several roots, each announced by its own update
+	knownRootNodeIds.insert(newSinkNodeId);
+	// Roots are not eligible for eviction
+	reindexNode(newSinkNodeId);
+
+	if(newSinkNodeId == selfNodeId) {
+		trace() << "This node is sink";
+		isSink = true;
+
+		// The sink always has multihop ETX to root value of zero
+		currentMultihopEtxToRoot = 0;
+		// Update the beacon sender with the zero multihop ETX
+		notifyBeaconSenderMultihopEtx();
+	}
+}
+
+void CtpRoutingTableManager::outOfEnergy()
+{
+	Enter_Method_Silent();
+	// We need to simulate what happens when a node runs out of energy - all state will be lost
+
+	// Reinitialise private variables
+	currentMultihopEtxToRoot = -1; 	// -1 means invalid
+	currentParentNodeId = -1;		// -1 means no parent
+	currentParentIsCongested = false;
+	// Clear routing state (the link estimator clears its own state in the table)
+	neighbourTable.clearRoutingTable();
+	uncongestedParentCandidates.clear();
+	congestedParentCandidates.clear();
+	highestShEtxNodes.clear();
+	highestMhEtxNodes.clear();
+	// Cancel any pending timers
+	cancelAllTimers();
+}
+
+std::vector<std::string> CtpRoutingTableManager::getRoutingTableRecords()
+{
+	Enter_Method_Silent();
+	std::vector<std::string> records;
+	for(int nodeId = 0; nodeId < neighbourTable.size(); nodeId++)
+	{
+		if(neighbourTable.isInRoutingTable(nodeId))
+		{
+			CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+			std::ostringstream record;
+			record << nodeId << " " << neighbour.nodeMultihopEtxToRoot << " " << neighbour.etxLinkQualityToNode
+				<< " " << neighbour.parentNodeId << " " << neighbour.isCongested;
+			records.push_back(record.str());
+		}
+	}
+	return records;
+}
+
+bool CtpRoutingTableManager::restoreRoutingTable(const std::vector<std::string> &records)
+{
+	Enter_Method_Silent();
+	// The sink doesn't keep a routing table (and so never saves one)
+	if(isSink) {
+		return false;
+	}
+
+	for(unsigned int i = 0; i < records.size() && neighbourTable.getRoutingTableSize() < nodeRoutingTableMaxSize; i++)
+	{
+		std::istringstream record(records[i]);
+		int nodeId;
+		CtpNeighbour_t restored;
+		if(!(record >> nodeId >> restored.nodeMultihopEtxToRoot >> restored.etxLinkQualityToNode >> restored.parentNodeId
+			>> restored.isCongested)) {
+			opp_error("Malformed CTP routing table snapshot record: %s", records[i].c_str());
+		}
+
+		neighbourTable.addToRoutingTable(nodeId);
+		CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+		neighbour.nodeMultihopEtxToRoot = restored.nodeMultihopEtxToRoot;
+		neighbour.etxLinkQualityToNode = restored.etxLinkQualityToNode;
+		neighbour.parentNodeId = restored.parentNodeId;
+		neighbour.isCongested = restored.isCongested;
+		reindexNode(nodeId);
+	}
+	trace() << "Restored " << neighbourTable.getRoutingTableSize() << " routing table entries from snapshot";
+
+	// Choose our parent from the restored table, which also tells the beacon sender and controller
+	updateParentAndMultihopEtxToRoot();
+	return currentParentNodeId != -1;
+}
+
 void CtpRoutingTableManager::notifyBeaconSenderMultihopEtx()
 {
 	trace() << "New multihop ETX to root: " << currentMultihopEtxToRoot;
+	if(directSubmoduleCalls)
+	{
+		beaconSender->updateMultihopEtxToRoot(currentMultihopEtxToRoot);
+		return;
+	}
 	BeaconSenderControlMessage *updateMhEtxMsg = new BeaconSenderControlMessage("Update beacon sender MH-ETX to root", BEACON_SENDER_CONTROL_COMMAND);
 	updateMhEtxMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_UPDATE_MULTIHOP_ETX_TO_ROOT);
 	updateMhEtxMsg->setMultihopEtxToRoot(currentMultihopEtxToRoot);
@@ -164,25 +336,43 @@ void CtpRoutingTableManager::notifyBeaconSenderMultihopEtx()
 void CtpRoutingTableManager::notifyControllerMultihopEtxAndParent()
 {
 	//trace() << "Updating controller with parent: " << currentParentNodeId << " and multihop ETX " << currentMultihopEtxToRoot;
+	if(directSubmoduleCalls)
+	{
+		controller->updateRouteInfo(currentParentNodeId, currentMultihopEtxToRoot, currentParentIsCongested);
+		return;
+	}
 	CtpRoutingControlMessage *updateMultihopEtxParentMsg = new CtpRoutingControlMessage("Update controller parent", CTP_NETWORK_CONTROL_COMMAND);
 	updateMultihopEtxParentMsg->setCtpRoutingControlMessageKind(CTP_ROUTING_MSG_UPDATE_ROUTE_INFO);
 	updateMultihopEtxParentMsg->setValue(currentParentNodeId);
 	// We update the controller with multihop ETX for routing loop detection 
 	updateMultihopEtxParentMsg->setMultihopEtx(currentMultihopEtxToRoot);
+	updateMultihopEtxParentMsg->setParentCongested(currentParentIsCongested);
 	send(updateMultihopEtxParentMsg, "toController");
 }
 
+void CtpRoutingTableManager::notifyBeaconSenderResetTrickleAndPull()
+{
+	if(directSubmoduleCalls)
+	{
+		beaconSender->requestTrickleReset(true);
+		return;
+	}
+	BeaconSenderControlMessage *resetTrickleAndPullMsg = new BeaconSenderControlMessage("Reset trickle and pull message", BEACON_SENDER_CONTROL_COMMAND);
+	resetTrickleAndPullMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_RESET_TRICKLE_AND_PULL);
+	send(resetTrickleAndPullMsg, "toBeaconSender");
+}
+
 void CtpRoutingTableManager::updateEtxLinkQualityToNode(int nodeId, double singleHopEtx)
 {
 	// If we already have an entry for this node
-	if(nodeRoutingTable.count(nodeId) > 0)
+	if(neighbourTable.isInRoutingTable(nodeId))
 	{
 		// Check if the SH ETX has risen above the maximum threshold, which would
 		// indicate the node is unreachable
 		if(singleHopEtx > unreachableNodeShEtxThreshold)
 		{
 			// If it is, we need to remove this node from the routing table
-			nodeRoutingTable.erase(nodeId);
+			removeNodeFromTable(nodeId);
 			
 			// If it was our parent
 			if(currentParentNodeId == nodeId)
@@ -191,16 +381,15 @@ void CtpRoutingTableManager::updateEtxLinkQualityToNode(int nodeId, double singl
 	
 				// Also, trigger a pull request so we get updated routing info from
 				// neighbours
-				BeaconSenderControlMessage *resetTrickleAndPullMsg = new BeaconSenderControlMessage("Reset trickle and pull message", BEACON_SENDER_CONTROL_COMMAND);
-				resetTrickleAndPullMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_RESET_TRICKLE_AND_PULL);
-				send(resetTrickleAndPullMsg, "toBeaconSender");
+				notifyBeaconSenderResetTrickleAndPull();
 			}
 		}
 		else
 		{
 			// Update the existing entry
 			trace() << "Updating existing routing table entry for node " << nodeId << " with single hop ETX " << singleHopEtx;
-			nodeRoutingTable[nodeId].etxLinkQualityToNode = singleHopEtx;
+			neighbourTable.getNeighbour(nodeId).etxLinkQualityToNode = singleHopEtx;
+			reindexNode(nodeId);
 		}
 	}
 	else
@@ -211,7 +400,8 @@ void CtpRoutingTableManager::updateEtxLinkQualityToNode(int nodeId, double singl
 		{
 			// Update the new entry
 			trace() << "Adding new routing table entry for node " << nodeId << " with single hop ETX " << singleHopEtx;
-			nodeRoutingTable[nodeId].etxLinkQualityToNode = singleHopEtx;
+			neighbourTable.getNeighbour(nodeId).etxLinkQualityToNode = singleHopEtx;
+			reindexNode(nodeId);
 		}
 	}
 
@@ -224,6 +414,7 @@ void CtpRoutingTableManager::invalidateParent(bool notifyOtherModules)
 	// we need to record our current parent as now invalid
 	currentMultihopEtxToRoot = -1;
 	currentParentNodeId = -1;
+	currentParentIsCongested = false;
 
 	if(notifyOtherModules)
 	{
@@ -235,17 +426,20 @@ void CtpRoutingTableManager::invalidateParent(bool notifyOtherModules)
 	}
 }
 
-void CtpRoutingTableManager::updateParentAndMultihopEtxToRootForRemoteNode(int nodeId, double multihopEtxToRoot, int parentNodeId)
+void CtpRoutingTableManager::updateParentAndMultihopEtxToRootForRemoteNode(int nodeId, double multihopEtxToRoot, int parentNodeId, bool isCongested)
 {
 	// If we already have an entry for this node
-	if(nodeRoutingTable.count(nodeId) > 0)
+	if(neighbourTable.isInRoutingTable(nodeId))
 	{
 		// Update the existing entry
 		trace() << "Updating existing routing table entry for node " << nodeId 
 			<< " with multihop ETX to root " << multihopEtxToRoot
 			<< " and parent " << parentNodeId;
-		nodeRoutingTable[nodeId].nodeMultihopEtxToRoot = multihopEtxToRoot;
-		nodeRoutingTable[nodeId].parentNodeId = parentNodeId;
+		CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+		neighbour.nodeMultihopEtxToRoot = multihopEtxToRoot;
+		neighbour.parentNodeId = parentNodeId;
+		neighbour.isCongested = isCongested;
+		reindexNode(nodeId);
 	}
 	else
 	{
@@ -256,8 +450,11 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRootForRemoteNode(int n
 			trace() << "Adding new routing table entry for node " << nodeId 
 				<< " with multihop ETX to root " << multihopEtxToRoot
 				<< " and parent " << parentNodeId;
-			nodeRoutingTable[nodeId].nodeMultihopEtxToRoot = multihopEtxToRoot;
-			nodeRoutingTable[nodeId].parentNodeId = parentNodeId;
+			CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+			neighbour.nodeMultihopEtxToRoot = multihopEtxToRoot;
+			neighbour.parentNodeId = parentNodeId;
+			neighbour.isCongested = isCongested;
+			reindexNode(nodeId);
 		}
 	}
 
@@ -268,20 +465,22 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRootForRemoteNode(int n
 bool CtpRoutingTableManager::attemptAddNodeToTable(int nodeId, double newNodeMultihopEtxToRoot)
 {
 	// If there is space in the table
-	if(nodeRoutingTable.size() < nodeRoutingTableMaxSize)
+	if(neighbourTable.getRoutingTableSize() < nodeRoutingTableMaxSize)
 	{
 		// simply add the new node
-		nodeRoutingTable[nodeId] = NodeRoutingInfo_t();
+		neighbourTable.addToRoutingTable(nodeId);
+		reindexNode(nodeId);
 		return true;
 	}
 	else
 	{
 		// Otherwise, we need to see if we can evict a node
-		// we set force to true if the node we want to add is root
+		// we set force to true if the node we want to add is a root
 		// Pass the new node's multihop etx to root as this may be used when choosing a node to evict
-		if(attemptEvictNode(nodeId == sinkNodeId ? true: false, newNodeMultihopEtxToRoot))
+		if(attemptEvictNode(knownRootNodeIds.count(nodeId) > 0 || newNodeMultihopEtxToRoot == 0, newNodeMultihopEtxToRoot))
 		{
-			nodeRoutingTable[nodeId] = NodeRoutingInfo_t();
+			neighbourTable.addToRoutingTable(nodeId);
+			reindexNode(nodeId);
 			return true;
 		}
 		else
@@ -296,74 +495,40 @@ bool CtpRoutingTableManager::attemptEvictNode(bool force, double newNodeMultihop
 {
 	bool foundNodeEligibleForEviction = false;
 	int eligibleNodeId = -1;
-	double eligibleNodeEtx = -1;
-	std::map<int, NodeRoutingInfo_t>::iterator it;
 
 	// First, check if there are any entries with one-hop ETX above eviction threshold
-	// If there are any, choose the one with highest ETX
-	for (it = nodeRoutingTable.begin(); it != nodeRoutingTable.end(); ++it)
+	// If there are any, choose the one with highest ETX (roots are not in the index, as we never evict a root)
+	int highestShEtxNodeId = highestShEtxNodes.top();
+	if(highestShEtxNodeId != -1 && neighbourTable.getNeighbour(highestShEtxNodeId).etxLinkQualityToNode >= evictionEtxThreshold)
 	{
-		// it->first is the key (int nodeId)
-		// it->second is the value (NodeRoutingInfo_t)
-
-		// If the single hop ETX link quality to node is above threshold, and the node is not the root (we never evict root)
-		if(it->second.etxLinkQualityToNode >= evictionEtxThreshold && it->first != sinkNodeId)
-		{
-			// If we have already found an eligible node
-			if(foundNodeEligibleForEviction)
-			{
-				// Replace it if we have found a new one with an even higher ETX
-				if(it->second.etxLinkQualityToNode > eligibleNodeEtx)
-				{
-					eligibleNodeId = it->first;
-					eligibleNodeEtx = it->second.etxLinkQualityToNode;
-				}
-				// Otherwise don't replace - do nothing
-			}
-			else // Otherwise we have found the first eligible node
-			{
-				foundNodeEligibleForEviction = true;
-				// Store the node details
-				eligibleNodeId = it->first;
-				eligibleNodeEtx = it->second.etxLinkQualityToNode;
-			}
-		}
-
-		if(foundNodeEligibleForEviction) {
-			trace () << "Found node eligible for eviction due to high ETX above threshold: " << eligibleNodeId;
-		}
+		foundNodeEligibleForEviction = true;
+		eligibleNodeId = highestShEtxNodeId;
+		trace () << "Found node eligible for eviction due to high ETX above threshold: " << eligibleNodeId;
 	}
 
-	// If we haven't found an eligible node yet, check again to see if any node has a higher multihop ETX to root than the one we want to add
+	// If we haven't found an eligible node yet, check to see if any node has a higher multihop ETX to root than the one we want to add
+	// (we choose the node with the highest multihop ETX to root)
 	if(!foundNodeEligibleForEviction)
 	{
-		for (it = nodeRoutingTable.begin(); it != nodeRoutingTable.end(); ++it)
+		int highestMhEtxNodeId = highestMhEtxNodes.top();
+		if(highestMhEtxNodeId != -1 && neighbourTable.getNeighbour(highestMhEtxNodeId).nodeMultihopEtxToRoot > newNodeMultihopEtxToRoot)
 		{
-			// it->first is the key (int nodeId)
-			// it->second is the value (NodeRoutingInfo_t)
-
-			// If the node's multihop ETX to root is higher than the new one we want to add, and it's not the root (we never evict root)
-			if(it->second.nodeMultihopEtxToRoot > newNodeMultihopEtxToRoot && it->first != sinkNodeId)
-			{
-				// We can evict the node
-				foundNodeEligibleForEviction = true;
-				eligibleNodeId = it->first;
-				trace () << "Found node eligible for eviction (node id " << eligibleNodeId << ") because it had a lower multihop ETX to root(" 
-					<< it->second.nodeMultihopEtxToRoot << " compared to " << newNodeMultihopEtxToRoot << ")";
-			}
+			// We can evict the node
+			foundNodeEligibleForEviction = true;
+			eligibleNodeId = highestMhEtxNodeId;
+			trace () << "Found node eligible for eviction (node id " << eligibleNodeId << ") because it had a higher multihop ETX to root(" 
+				<< neighbourTable.getNeighbour(eligibleNodeId).nodeMultihopEtxToRoot << " compared to " << newNodeMultihopEtxToRoot << ")";
 		}
 	}
 
 	// Finally, if we haven't found an eligible node, and force eviction if flag is set (e.g. because we are adding root node)
-	if((!foundNodeEligibleForEviction) && force)
+	if((!foundNodeEligibleForEviction) && force && highestShEtxNodes.size() > 0)
 	{
 		// we need to force an eviction of a random node
-		it = nodeRoutingTable.begin();
-		// Advance through the table a random number of places
-		std::advance(it, intrand(nodeRoutingTable.size()));
+		// (every routing table entry apart from roots is in the SH-ETX index, so pick a random position in it)
+		eligibleNodeId = highestShEtxNodes.getNodeIdAt(intrand(highestShEtxNodes.size()));
 		// Evict the unlucky node
 		foundNodeEligibleForEviction = true;
-		eligibleNodeId = it->first;
 		trace() << "Forcing eviction of randomly chosen node " << eligibleNodeId;
 	}
 	
@@ -371,7 +536,7 @@ bool CtpRoutingTableManager::attemptEvictNode(bool force, double newNodeMultihop
 	if(foundNodeEligibleForEviction)
 	{
 		trace() << "Evicting node " << eligibleNodeId;
-		nodeRoutingTable.erase(eligibleNodeId);
+		removeNodeFromTable(eligibleNodeId);
 		return true;
 	}
 	else
@@ -380,6 +545,52 @@ bool CtpRoutingTableManager::attemptEvictNode(bool force, double newNodeMultihop
 	}
 }
 
+void CtpRoutingTableManager::removeNodeFromTable(int nodeId)
+{
+	neighbourTable.removeFromRoutingTable(nodeId);
+	reindexNode(nodeId);
+}
+
+void CtpRoutingTableManager::reindexNode(int nodeId)
+{
+	// Must be called whenever a routing table entry is added, removed or changed, to keep the indexes in step
+	uncongestedParentCandidates.remove(nodeId);
+	congestedParentCandidates.remove(nodeId);
+
+	if(!neighbourTable.isInRoutingTable(nodeId))
+	{
+		highestShEtxNodes.remove(nodeId);
+		highestMhEtxNodes.remove(nodeId);
+		return;
+	}
+
+	CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+	if(isRootNode(nodeId))
+	{
+		highestShEtxNodes.remove(nodeId);
+		highestMhEtxNodes.remove(nodeId);
+	}
+	else
+	{
+		highestShEtxNodes.update(nodeId, -neighbour.etxLinkQualityToNode);
+		highestMhEtxNodes.update(nodeId, -neighbour.nodeMultihopEtxToRoot);
+	}
+
+	// A parent candidate must have a valid multihop ETX to root, a valid singlehop ETX to the node,
+	// and must not have us as their parent (this would create a parent-parent loop)
+	if(neighbour.nodeMultihopEtxToRoot != -1
+		&& neighbour.etxLinkQualityToNode != -1
+		&& neighbour.parentNodeId != selfNodeId)
+	{
+		if(neighbour.isCongested) {
+			congestedParentCandidates.update(nodeId, getPathEtx(nodeId));
+		}
+		else {
+			uncongestedParentCandidates.update(nodeId, getPathEtx(nodeId));
+		}
+	}
+}
+
 void CtpRoutingTableManager::updateParentAndMultihopEtxToRoot()
 {
 	// Keep track of if anything has changed which requires sending an update message to other modules
@@ -390,7 +601,8 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRoot()
 
 	// First find the most suitable potential parent (if any)
 	// If there are no suitable candidates this returns -1
-	int potentialNewParentNodeId = findBestParentCandidate();
+	// When we already have a parent, we never switch to a congested node
+	int potentialNewParentNodeId = findBestParentCandidate(currentParentNodeId != -1);
 
 	// Have we found a valid candidate?
 	if(potentialNewParentNodeId != -1)
@@ -406,8 +618,8 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRoot()
 		}
 		// Otherwise if we have a valid parent, only switch to the candidate parent if it has
 		// (multihop ETX to root + newParentSwitchAdditionalMhEtx) lower than the existing parent
-		else if(nodeRoutingTable[potentialNewParentNodeId].nodeMultihopEtxToRoot + newParentSwitchAdditionalMhEtx <
-			nodeRoutingTable[currentParentNodeId].nodeMultihopEtxToRoot)
+		else if(neighbourTable.getNeighbour(potentialNewParentNodeId).nodeMultihopEtxToRoot + newParentSwitchAdditionalMhEtx <
+			neighbourTable.getNeighbour(currentParentNodeId).nodeMultihopEtxToRoot)
 		{
 			trace() << "Switching to a better parent: " << potentialNewParentNodeId;
 			plotTrace() << "#ROU_PARENT " << potentialNewParentNodeId;
@@ -419,12 +631,31 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRoot()
 			collectOutput(OUTPUT_TIMES_SWITCHED_PARENT);
 		}
 	}
+
+	// If our parent is congested, move to a non-congested node with a similar path ETX if there is one
+	if(!parentHasChanged && currentParentNodeId != -1 && neighbourTable.getNeighbour(currentParentNodeId).isCongested)
+	{
+		int uncongestedCandidateNodeId = findBestParentCandidate(true);
+		if(uncongestedCandidateNodeId != -1 &&
+			getPathEtx(uncongestedCandidateNodeId) <= getPathEtx(currentParentNodeId) + congestedParentSwitchMargin)
+		{
+			trace() << "Parent " << currentParentNodeId << " is congested, switching to " << uncongestedCandidateNodeId;
+			plotTrace() << "#ROU_PARENT " << uncongestedCandidateNodeId;
+			currentParentNodeId = uncongestedCandidateNodeId;
+			notifyBeaconSenderNewParent();
+			parentHasChanged = true;
+
+			// Collect stats
+			collectOutput(OUTPUT_TIMES_SWITCHED_PARENT);
+			collectOutput(OUTPUT_SWITCHED_FROM_CONGESTED_PARENT);
+		}
+	}
 	
 	if(currentParentNodeId != -1)
 	{
 		// If we have a valid parent, calculate our multihop ETX as parent's multihop ETX plus our single-hop link quality to the parent
-		double updatedNodeMultihopEtxToRoot = nodeRoutingTable[currentParentNodeId].nodeMultihopEtxToRoot + 
-										nodeRoutingTable[currentParentNodeId].etxLinkQualityToNode;
+		CtpNeighbour_t &parent = neighbourTable.getNeighbour(currentParentNodeId);
+		double updatedNodeMultihopEtxToRoot = parent.nodeMultihopEtxToRoot + parent.etxLinkQualityToNode;
 		
 		// For performance reasons, test if this has actually changed
 		if(currentMultihopEtxToRoot != updatedNodeMultihopEtxToRoot)
@@ -432,13 +663,13 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRoot()
 			currentMultihopEtxToRoot = updatedNodeMultihopEtxToRoot;
 			mhEtxHasChanged = true;
 
-			trace() << "Our multihop ETX to root is our parent's MH-ETX(" << nodeRoutingTable[currentParentNodeId].nodeMultihopEtxToRoot
-			<< ") + SH-ETX to parent (" << nodeRoutingTable[currentParentNodeId].etxLinkQualityToNode
+			trace() << "Our multihop ETX to root is our parent's MH-ETX(" << parent.nodeMultihopEtxToRoot
+			<< ") + SH-ETX to parent (" << parent.etxLinkQualityToNode
 			<< ") = " << currentMultihopEtxToRoot;
 			plotTrace() << "#ROU_MHETX " << currentParentNodeId << " " << currentMultihopEtxToRoot;
 
 			// Collect stats
-			collectHistogram(OUTPUT_SH_ETX_TO_PARENT, nodeRoutingTable[currentParentNodeId].etxLinkQualityToNode);
+			collectHistogram(OUTPUT_SH_ETX_TO_PARENT, parent.etxLinkQualityToNode);
 		} 
 	}
 	
@@ -454,7 +685,16 @@ void CtpRoutingTableManager::updateParentAndMultihopEtxToRoot()
 		}
 	}
 
-	if(mhEtxHasChanged || parentHasChanged) {
+	// The controller backs off sending while the parent is congested
+	bool parentCongestionHasChanged = false;
+	bool parentIsCongested = currentParentNodeId != -1 && neighbourTable.getNeighbour(currentParentNodeId).isCongested;
+	if(parentIsCongested != currentParentIsCongested)
+	{
+		currentParentIsCongested = parentIsCongested;
+		parentCongestionHasChanged = true;
+	}
+
+	if(mhEtxHasChanged || parentHasChanged || parentCongestionHasChanged) {
 		// Notify controller with our new parent and/or MHETX so it sends data packets to the correct node
 		notifyControllerMultihopEtxAndParent();
 	}
@@ -465,43 +705,50 @@ void CtpRoutingTableManager::notifyBeaconSenderNewParent()
 	// When we have selected a new parent, we need to reset the trickle algorithm 
 	// so we quickly send the updated routing into to neighbours
 	// Also allow the beacon sender to send the new parent node ID in beacons
+	if(directSubmoduleCalls)
+	{
+		beaconSender->updateParent(currentParentNodeId);
+		return;
+	}
 	BeaconSenderControlMessage *newParentMsg = new BeaconSenderControlMessage("Reset trickle message", BEACON_SENDER_CONTROL_COMMAND);
 	newParentMsg->setBeaconSenderControlMessageKind(BEACON_SENDER_NEW_PARENT);
 	newParentMsg->setParentNodeId(currentParentNodeId);
 	send(newParentMsg, "toBeaconSender");
 }
 
-int CtpRoutingTableManager::findBestParentCandidate()
+double CtpRoutingTableManager::getPathEtx(int nodeId)
 {
-	int neighbourNodeIdWithLowestMhEtxToRoot = -1; // We return -1 if no neighbour found with a valid mh ETX to root
-	double lowestNeighboursMultihopEtxToRootPlusSingleHopToNeighbour = 999; // Start with a really stupidly large number
+	// Our cost to the root via the node
+	CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+	return neighbour.nodeMultihopEtxToRoot + neighbour.etxLinkQualityToNode;
+}
+
+bool CtpRoutingTableManager::isRootNode(int nodeId)
+{
+	// Any number of nodes can be roots. Each advertises MH-ETX 0, so we route to whichever gives the lowest path ETX
+	return knownRootNodeIds.count(nodeId) > 0
+		|| (neighbourTable.isInRoutingTable(nodeId) && neighbourTable.getNeighbour(nodeId).nodeMultihopEtxToRoot == 0);
+}
 
-	// Search all neighbours looking for the one with the lowest (multihop ETX to root + our single hop ETX to it)
+int CtpRoutingTableManager::findBestParentCandidate(bool excludeCongested)
+{
+	// Find the candidate with the lowest (multihop ETX to root + our single hop ETX to it)
 	// We may not find any, in which case we return -1
 	// Ignore the current parent node as we are looking for a potential new / better parent
-	for (std::map<int, NodeRoutingInfo_t>::iterator it = nodeRoutingTable.begin(); it != nodeRoutingTable.end(); ++it)
+	int bestCandidateNodeId = uncongestedParentCandidates.top(currentParentNodeId);
+
+	if(!excludeCongested)
 	{
-		// it->first is the key (int nodeId)
-		// it->second is the value (NodeRoutingInfo_t)
-		
-		// If it has a valid multihop ETX to root,
-		// and it has a valid singlehop ETX to the node,
-		// and it has the lowest (multihop ETX to root + our single hop ETX to it) so far, 
-		// and it's not the current parent,
-		// and it does not have us as their parent (this would create a parent-parent loop)
-		if(it->second.nodeMultihopEtxToRoot != -1
-			&& it->second.etxLinkQualityToNode != -1
-			&& ((it->second.nodeMultihopEtxToRoot + it->second.etxLinkQualityToNode) < lowestNeighboursMultihopEtxToRootPlusSingleHopToNeighbour)
-			&& it->first != currentParentNodeId
-			&& it->second.parentNodeId != selfNodeId)
+		int bestCongestedCandidateNodeId = congestedParentCandidates.top(currentParentNodeId);
+		if(bestCongestedCandidateNodeId != -1 && (bestCandidateNodeId == -1
+			|| getPathEtx(bestCongestedCandidateNodeId) < getPathEtx(bestCandidateNodeId)
+			|| (getPathEtx(bestCongestedCandidateNodeId) == getPathEtx(bestCandidateNodeId) && bestCongestedCandidateNodeId < bestCandidateNodeId)))
 		{
-			// Store the candidate node
-			neighbourNodeIdWithLowestMhEtxToRoot = it->first;
-			lowestNeighboursMultihopEtxToRootPlusSingleHopToNeighbour = it->second.nodeMultihopEtxToRoot;
+			bestCandidateNodeId = bestCongestedCandidateNodeId;
 		}
 	}
 
-	return neighbourNodeIdWithLowestMhEtxToRoot;
+	return bestCandidateNodeId;
 }
 
 void CtpRoutingTableManager::timerFiredCallback(int index)
@@ -523,10 +770,12 @@ void CtpRoutingTableManager::finishSpecific()
 	trace() << "Routing table (parent is " << currentParentNodeId << "):";
 	trace() << "nodeid:  SH-ETX  MH-ETX";
 	// Print the routing table
-	for (std::map<int, NodeRoutingInfo_t>::iterator it = nodeRoutingTable.begin(); it != nodeRoutingTable.end(); ++it)
+	for (int nodeId = 0; nodeId < neighbourTable.size(); nodeId++)
 	{
-		// it->first is the key (int nodeId)
-		// it->second is the value (NodeRoutingInfo_t)
-		trace() << it->first << ":\t" << it->second.etxLinkQualityToNode << "\t" << it->second.nodeMultihopEtxToRoot;
+		CtpNeighbour_t &neighbour = neighbourTable.getNeighbour(nodeId);
+		if(!neighbour.isInRoutingTable) {
+			continue;
+		}
+		trace() << nodeId << ":\t" << neighbour.etxLinkQualityToNode << "\t" << neighbour.nodeMultihopEtxToRoot;
 	}
 }
\ No newline at end of file
@@ -8,18 +8,20 @@
 #include "RoutingControlMessage_m.h"
 #include "CtpRoutingControlMessage_m.h"
 #include "BeaconSenderControlMessage_m.h"
+#include "CtpNeighbourTable.h"
+#include "IndexedMinHeap.h"
+#include <set>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sstream>
 
 enum tableManagerTimers {
 
 };
 
-struct NodeRoutingInfo_t {
-	// default Constructor: initialise with an invalid MHETX, SHETX and parent (-1 means invalid)
-	NodeRoutingInfo_t(): nodeMultihopEtxToRoot(-1), etxLinkQualityToNode(-1), parentNodeId(-1) { }   
-	double nodeMultihopEtxToRoot;
-	double etxLinkQualityToNode;
-	int parentNodeId;
-};
+class CtpRoutingBeaconSender;
+class CtpRoutingController;
 
 class CtpRoutingTableManager : public CastaliaModule, public TimerService
 {
@@ -29,30 +31,75 @@ class CtpRoutingTableManager : public CastaliaModule, public TimerService
 		double evictionEtxThreshold;
 		double newParentSwitchAdditionalMhEtx;
 		double unreachableNodeShEtxThreshold;
+		double congestedParentSwitchMargin;
 		
 		// Other private variables:
 		static const char *OUTPUT_SH_ETX_TO_PARENT;
 		static const char *OUTPUT_MH_ETX;
 		static const char *OUTPUT_TIMES_SWITCHED_PARENT;
+		static const char *OUTPUT_SWITCHED_FROM_CONGESTED_PARENT;
+		static const char *OUTPUT_FAST_ADMISSION_EVICTIONS;
 		int selfNodeId;
-		int sinkNodeId;
+		// Roots (sinks) we have been told about by the application. Any neighbour advertising MH-ETX 0 is also a root
+		std::set<int> knownRootNodeIds;
 		bool isSink;
 		double currentMultihopEtxToRoot;
 		int currentParentNodeId;
-		std::map<int, NodeRoutingInfo_t> nodeRoutingTable;
+		bool currentParentIsCongested;
+		// The routing table is held in the neighbour table, which is shared with the link estimator
+		CtpNeighbourTable neighbourTable;
+		// Indexes over the routing table, so that parent selection and eviction don't scan the table.
+		// Parent candidates (valid MH-ETX and SH-ETX, and not our child) are keyed by path ETX (MH-ETX + SH-ETX),
+		// and split by congestion so non-congested candidates can be found directly.
+		// The eviction indexes hold every routing table entry except roots (we never evict a root), keyed by negated
+		// SH-ETX / MH-ETX (highest first)
+		IndexedMinHeap uncongestedParentCandidates;
+		IndexedMinHeap congestedParentCandidates;
+		IndexedMinHeap highestShEtxNodes;
+		IndexedMinHeap highestMhEtxNodes;
+		// For calling the beacon sender and controller directly instead of sending them control messages
+		bool directSubmoduleCalls;
+		CtpRoutingBeaconSender *beaconSender;
+		CtpRoutingController *controller;
 
 		// Private member functions:
 		
 		void invalidateParent(bool notifyOtherModules);
 		void updateEtxLinkQualityToNode(int nodeId, double singleHopEtx);
-		void updateParentAndMultihopEtxToRootForRemoteNode(int nodeId, double multihopEtxToRoot, int parentNodeId);
+		void updateParentAndMultihopEtxToRootForRemoteNode(int nodeId, double multihopEtxToRoot, int parentNodeId, bool isCongested);
 		bool attemptAddNodeToTable(int nodeId, double newNodeMultihopEtxToRoot);
+		void removeNodeFromTable(int nodeId);
+		void reindexNode(int nodeId);
 		bool attemptEvictNode(bool force, double newNodeMultihopEtxToRoot);
 		void updateParentAndMultihopEtxToRoot();
-		int findBestParentCandidate();
+		int findBestParentCandidate(bool excludeCongested);
+		double getPathEtx(int nodeId);
+		bool isRootNode(int nodeId);
 		void notifyBeaconSenderNewParent();
 		void notifyBeaconSenderMultihopEtx();
 		void notifyControllerMultihopEtxAndParent();
+		void notifyBeaconSenderResetTrickleAndPull();
+
+	public:
+
+		CtpNeighbourTable &getNeighbourTable() { return neighbourTable; }
+
+		// Direct calls from the controller and link estimator (used instead of control messages when the
+		// CtpRouting directSubmoduleCalls parameter is set)
+		void updateNodeEtx(int nodeId, double singleHopEtx);
+		void updateRemoteNodeRoutingInfo(int nodeId, double multihopEtxToRoot, int parentNodeId, bool isCongested);
+		// Routing info of a neighbour with a good first beacon, and the SH-ETX the link estimator seeded for it
+		void fastAdmitNeighbour(int nodeId, double seedShEtx, double multihopEtxToRoot, int parentNodeId, bool isCongested);
+		void updateSinkNode(int newSinkNodeId);
+		// Called directly by the controller. The best parent candidate other than our parent, preferring uncongested
+		// ones, or -1 if there is none
+		int getFallbackParent(double &pathEtx);
+		void outOfEnergy();
+
+		// Routing table snapshot, one record per entry: "<nodeId> <MH-ETX> <SH-ETX> <parentNodeId> <congested>"
+		std::vector<std::string> getRoutingTableRecords();
+		// Returns true if we have a parent from the restored table
+		bool restoreRoutingTable(const std::vector<std::string> &records);
 
 	protected:
 		
@@ -3,6 +3,8 @@
 // Register the module with Omnet
 Define_Module(MmbcrBeaconSender);
 
+const char * MmbcrBeaconSender::OUTPUT_BEACONS_SUPPRESSED = "Mmbcr beacons suppressed";
+
 void MmbcrBeaconSender::initialize()
 {
 	// Store NED parameters
@@ -10,12 +12,16 @@ void MmbcrBeaconSender::initialize()
 	trickleFrequencyCoefficientMin = par("trickleFrequencyCoefficientMin");
 	staticFrequency = par("staticFrequency");
 	beaconFrameSizeBits = par("beaconFrameSizeBits");
+	trickleRedundancyConstant = par("trickleRedundancyConstant");
+	trickleConsistencyTolerance = par("trickleConsistencyTolerance");
 	
 	// Initialise private variables
 	currentBeaconSequenceNumber = 0;
 	currentMultihopEtxToRoot = -1;	// -1 represents invalid
 	currentParentNodeId = -1;		// -1 represents no parent
+	parentMultihopEtxToRoot = -1;
 	setPullFlag = false;
+	consistentBeaconsHeard = 0;
 	isSink = false;
 	
 	// Get the Node ID - we need this for setting the origin / source of beacons
@@ -53,6 +59,9 @@ void MmbcrBeaconSender::initialize()
 
 	// Set the timer drift for the timer service. If we do not do this all timers will return immediately!
 	setTimerDrift(resMgrModule->getCPUClockDrift());
+
+	// Declare stats outputs
+	declareOutput(OUTPUT_BEACONS_SUPPRESSED);
 }
 
 void MmbcrBeaconSender::handleMessage(cMessage *msg)
@@ -91,11 +100,18 @@ void MmbcrBeaconSender::handleMessage(cMessage *msg)
 				{
 					trace() << "Updating parent, trickle reset";
 					currentParentNodeId = controlMsg->getParentNodeId();
+					parentMultihopEtxToRoot = -1;
 					// Also reset trickle
 					resetTrickle();
 					break;
 				}
 
+				case MMBCR_BEACON_SENDER_BEACON_HEARD:
+				{
+					beaconHeard(controlMsg->getNodeId(), controlMsg->getParentNodeId(), controlMsg->getMultihopEtxToRoot());
+					break;
+				}
+
 				case MMBCR_BEACON_SENDER_RESET_TRICKLE: 
 				{
 					trace() << "Trickle reset";
@@ -164,7 +180,9 @@ void MmbcrBeaconSender::handleMessage(cMessage *msg)
 			// DO NOT RESET currentBeaconSequenceNumber - no need, and will break duplicate packet checking when other nodes restart
 			currentMultihopEtxToRoot = -1;	// -1 represents invalid
 			currentParentNodeId = -1;		// -1 represents no parent
+			parentMultihopEtxToRoot = -1;
 			setPullFlag = false;
+			consistentBeaconsHeard = 0;
 			// Reset trickle coefficient
 			trickleFrequencyCoefficientCurrent = trickleFrequencyCoefficientMin;
 			// Cancel any pending timers
@@ -229,13 +247,16 @@ void MmbcrBeaconSender::sendNextBeacon()
 	// Calculate the next sending interval
 	calculateSendingInterval();
 
+	// Start counting consistent beacons for the next interval
+	consistentBeaconsHeard = 0;
+
 	// Send the beacon
 	
 	MmbcrPacket *beacon = new MmbcrPacket("Mmbcr beacon", NETWORK_LAYER_PACKET);
 	beacon->setRoutingPacketKind(MMBCR_PACKET_TYPE_BEACON);
 	beacon->setDestination(BROADCAST_NETWORK_ADDRESS);
 	beacon->setSource(std::to_string(selfNodeId).c_str());
-	beacon->setOrigin(std::to_string(selfNodeId).c_str());
+	beacon->setOrigin(selfNodeId);
 	beacon->setHopCount(0);
 	beacon->setSequenceNumber(currentBeaconSequenceNumber++);
 	beacon->setMultihopEtxToRoot(currentMultihopEtxToRoot);
@@ -270,6 +291,66 @@ void MmbcrBeaconSender::sendNextBeacon()
 	advanceNextTrickleStep();
 }
 
+bool MmbcrBeaconSender::isNextBeaconRedundant()
+{
+	// A beacon with the pull flag is never suppressed
+	return trickleRedundancyConstant > 0 && !setPullFlag && consistentBeaconsHeard >= trickleRedundancyConstant;
+}
+
+void MmbcrBeaconSender::suppressNextBeacon()
+{
+	trace() << "Suppressing beacon, heard " << consistentBeaconsHeard << " consistent beacons this interval";
+	plotTrace() << "#ROU_SUPPRESS_BEACON";
+	collectOutput(OUTPUT_BEACONS_SUPPRESSED);
+
+	// The beacon sequence number is not advanced, so neighbours' link estimators do not count a lost beacon
+
+	// Carry on with the next interval as if the beacon had been sent
+	calculateSendingInterval();
+	consistentBeaconsHeard = 0;
+	setTimer(MMBCR_BEACON_SENDER_TIMER_SEND_NEXT_BEACON, trickleSendingIntervalCurrent);
+	advanceNextTrickleStep();
+}
+
+void MmbcrBeaconSender::beaconHeard(int fromNodeId, int sendersParentNodeId, double multihopEtxToRoot)
+{
+	if(trickleRedundancyConstant <= 0) {
+		return;
+	}
+
+	// Inconsistencies which matter to routing reset trickle, so that neighbours soon hear our up to date route. 
+	// A plain MH-ETX mismatch is not one: nodes at different depths always advertise different MH-ETXs.
+	// Our parent's MH-ETX moving beyond the tolerance moves ours with it
+	if(fromNodeId == currentParentNodeId)
+	{
+		bool hasParentMoved = parentMultihopEtxToRoot != -1 
+			&& fabs(multihopEtxToRoot - parentMultihopEtxToRoot) > trickleConsistencyTolerance;
+		parentMultihopEtxToRoot = multihopEtxToRoot;
+		if(hasParentMoved)
+		{
+			trace() << "Parent " << fromNodeId << " now advertises MH-ETX " << multihopEtxToRoot << ", trickle reset";
+			resetTrickle();
+			return;
+		}
+	}
+	// A child routing through us must have a higher MH-ETX than ours, otherwise it has out of date information about us
+	if(sendersParentNodeId == selfNodeId && currentMultihopEtxToRoot != -1 && multihopEtxToRoot != -1
+		&& multihopEtxToRoot < currentMultihopEtxToRoot)
+	{
+		trace() << "Child " << fromNodeId << " advertises MH-ETX " << multihopEtxToRoot << " lower than ours, trickle reset";
+		resetTrickle();
+		return;
+	}
+
+	// Otherwise, a neighbour's beacon is consistent if it advertises the same MH-ETX as us (within the tolerance)
+	if(currentMultihopEtxToRoot != -1
+		&& multihopEtxToRoot != -1
+		&& fabs(multihopEtxToRoot - currentMultihopEtxToRoot) <= trickleConsistencyTolerance)
+	{
+		consistentBeaconsHeard++;
+	}
+}
+
 void MmbcrBeaconSender::calculateSendingInterval()
 {
 	// The interval used in the Trickle algorithm is a random value
@@ -299,7 +380,14 @@ void MmbcrBeaconSender::timerFiredCallback(int index)
 {
 	switch(index) {
 		case MMBCR_BEACON_SENDER_TIMER_SEND_NEXT_BEACON: {
-			sendNextBeacon();
+			if(isNextBeaconRedundant())
+			{
+				suppressNextBeacon();
+			}
+			else
+			{
+				sendNextBeacon();
+			}
 			break;
 		}
 
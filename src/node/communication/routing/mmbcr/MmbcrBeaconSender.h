@@ -22,8 +22,11 @@ class MmbcrBeaconSender : public CastaliaModule, public TimerService
 		double trickleFrequencyCoefficientMax;
 		double trickleFrequencyCoefficientMin;
 		int beaconFrameSizeBits;
+		int trickleRedundancyConstant;
+		double trickleConsistencyTolerance;
 
 		// Other private variables:
+		static const char *OUTPUT_BEACONS_SUPPRESSED;
 		double trickleFrequencyCoefficientCurrent;
 		double trickleSendingIntervalCurrent;
 		bool staticFrequency;
@@ -31,7 +34,9 @@ class MmbcrBeaconSender : public CastaliaModule, public TimerService
 		int currentBeaconSequenceNumber;
 		double currentMultihopEtxToRoot;
 		int currentParentNodeId;
+		double parentMultihopEtxToRoot;	// As last advertised in our parent's beacons, -1 if not heard yet
 		bool setPullFlag;
+		int consistentBeaconsHeard;
 		bool isSink;
 		BatteryCapacityVector_t currentParentBatteryCapacitiesOfPathToSink;
 		BatteryCapacityVector_t thisNodesBatteryCapacitiesOfPathToSink;
@@ -40,9 +45,12 @@ class MmbcrBeaconSender : public CastaliaModule, public TimerService
 		// Private member functions:
 		void resetTrickle();
 		void sendNextBeacon();
+		void suppressNextBeacon();
+		bool isNextBeaconRedundant();
 		void calculateSendingInterval();
 		void advanceNextTrickleStep();
 		void updateThisNodesBatteryCapacitiesOfPathToSink();
+		void beaconHeard(int fromNodeId, int sendersParentNodeId, double multihopEtxToRoot);
 
 	protected:
 		
@@ -1,4 +1,6 @@
 #include "MmbcrController.h"
+#include "MmbcrLinkEstimator.h"
+#include "MmbcrTableManager.h"
 
 // Register the module in Omnet++
 Define_Module(MmbcrController);
@@ -8,9 +10,13 @@ const char * MmbcrController::OUTPUT_MMBCR_DROPPED_OUT_OF_ENERGY = "Mmbcr droppe
 const char * MmbcrController::OUTPUT_MMBCR_SENDING_RETRY = "Mmbcr retrying send";
 const char * MmbcrController::OUTPUT_MMBCR_FORWARDING = "Mmbcr received packet for forwarding";
 const char * MmbcrController::OUTPUT_MMBCR_HOP_COUNT = "Mmbcr hop count";
+const char * MmbcrController::OUTPUT_MMBCR_NV_BYTES_WRITTEN = "Mmbcr non-volatile bytes written";
 
 void MmbcrController::startup()
 {
+	// Only a restart (after running out of energy) has retained state to restore
+	bool isRestart = hasStartedUpOnce;
+
 	// Check if we have already started up once already
 	if(!hasStartedUpOnce)
 	{
@@ -22,17 +28,74 @@ void MmbcrController::startup()
 		repairLoopWaitTimeRange = par("repairLoopWaitTimeMax").doubleValue() - par("repairLoopWaitTimeMin").doubleValue();
 		implementRetries = par("implementRetries");
 		delayBeforeRouteDiscoveryPropagation = par("delayBeforeRouteDiscoveryPropagation");
+		loadRoutingSnapshotFile = par("loadRoutingSnapshotFile").stringValue();
+		saveRoutingSnapshotFile = par("saveRoutingSnapshotFile").stringValue();
+		saveRoutingSnapshotTime = par("saveRoutingSnapshotTime");
+		if(saveRoutingSnapshotFile != "" && saveRoutingSnapshotTime < 0) {
+			opp_error("saveRoutingSnapshotTime must be set to save a routing snapshot");
+		}
+		nvStateRetention = par("nvStateRetention");
+		nvRetainRoutes = false;
+		nvRetainLinks = false;
+		std::vector<std::string> retainedState = cStringTokenizer(par("nvRetainedState")).asVector();
+		for(unsigned int i = 0; i < retainedState.size(); i++)
+		{
+			if(retainedState[i] == "routes") {
+				nvRetainRoutes = true;
+			}
+			else if(retainedState[i] == "links") {
+				nvRetainLinks = true;
+			}
+			else {
+				opp_error("Unknown MMBCR retained state '%s', expected routes and / or links", retainedState[i].c_str());
+			}
+		}
+		nvCheckpointInterval = par("nvCheckpointInterval");
+		nvWriteEnergyPerByte = par("nvWriteEnergyPerByte").doubleValue() * 1e-9; // nJ to J
+
+		// The beacon sender only needs to hear about neighbours' beacons if it suppresses redundant beacons
+		trickleSuppression = (int) getParentModule()->getSubmodule("BeaconSender")->par("trickleRedundancyConstant") > 0;
 
 		// The net data frame overhead is in the containing compound module, so it can be defined in the base module
 		// and used in other routing modules
 		networkDataFrameOverheadBits = getParentModule()->par("networkDataFrameOverheadBits");
 
+		// Node IDs are 0 .. numNodes-1, so size the duplicate detection buffer to hold all of them in a flat array
+		duplicateDetectionBuffer.initialise(getParentModule() // Routing module
+			->getParentModule() // Communication module
+			->getParentModule() // Node module
+			->getParentModule() // Network module
+			->par("numNodes"));
+
 		// Declare stats outputs
 		declareOutput(OUTPUT_MMBCR_DROPPED_AFTER_MAX_RETRIES);
 		declareOutput(OUTPUT_MMBCR_DROPPED_OUT_OF_ENERGY);
 		declareOutput(OUTPUT_MMBCR_SENDING_RETRY);
 		declareOutput(OUTPUT_MMBCR_FORWARDING);
 		declareHistogram(OUTPUT_MMBCR_HOP_COUNT, 1, 10, 10);
+		declareOutput(OUTPUT_MMBCR_NV_BYTES_WRITTEN);
+
+		linkEstimator = check_and_cast<MmbcrLinkEstimator*>(getParentModule()->getSubmodule("LinkEstimator"));
+		tableManager = check_and_cast<MmbcrTableManager*>(getParentModule()->getSubmodule("TableManager"));
+		node = getParentModule() // Routing module
+			->getParentModule() // Communication module
+			->getParentModule(); // Node module
+		if(nvStateRetention) {
+			NonVolatileStorage::open(node);
+		}
+
+		// A snapshot is only restored at the very first startup: a restart after running out of energy loses
+		// everything, as usual. Restored by a timer because on first startup this is called during initialisation,
+		// before the other submodules have been initialised
+		if(loadRoutingSnapshotFile != "")
+		{
+			RoutingStateSnapshot::open(loadRoutingSnapshotFile);
+			setTimer(MMBCR_CONTROLLER_TIMER_RESTORE_SNAPSHOT, 0);
+		}
+		if(saveRoutingSnapshotFile != "")
+		{
+			RoutingStateSnapshot::open(saveRoutingSnapshotFile);
+		}
 
 		hasStartedUpOnce = true;
 	}
@@ -46,6 +109,18 @@ void MmbcrController::startup()
 	currentParentNodeId = -1; 		// -1 indicates invalid / no parent
 	currentMultihopEtxToRoot = -1; 	// -1 indicates invalid / no parent
 	currentPacketSendingAttempts = 0;
+	routeRestoredOnRestart = false;
+
+	if(nvStateRetention)
+	{
+		if(isRestart)
+		{
+			routeRestoredOnRestart = restoreRoutingState(
+				nvRetainLinks ? NonVolatileStorage::read(node, "mmbcrLink") : std::vector<std::string>(),
+				nvRetainRoutes ? NonVolatileStorage::read(node, "mmbcrRoute") : std::vector<std::string>());
+		}
+		setTimer(MMBCR_CONTROLLER_TIMER_NV_CHECKPOINT, nvCheckpointInterval);
+	}
 
 	// An optional delay before initiating route discovery and propogation with beacons
 	// May be useful, e.g. to enable time / beacon synced MAC layers to settle 
@@ -57,6 +132,57 @@ void MmbcrController::startup()
 	{
 		setTimer(MMBCR_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION, delayBeforeRouteDiscoveryPropagation);
 	}
+
+	// (Re)schedule the snapshot, unless we restarted after it was due
+	if(saveRoutingSnapshotFile != "" && saveRoutingSnapshotTime >= simTime().dbl())
+	{
+		setTimer(MMBCR_CONTROLLER_TIMER_SAVE_SNAPSHOT, saveRoutingSnapshotTime - simTime().dbl());
+	}
+}
+
+bool MmbcrController::restoreRoutingState(const std::vector<std::string> &linkRecords, const std::vector<std::string> &routeRecords)
+{
+	// Link estimates first, so that they are in place when the routing table is restored and a parent chosen
+	linkEstimator->restoreLinkEstimates(linkRecords);
+	return tableManager->restoreRoutingTable(routeRecords);
+}
+
+void MmbcrController::restoreRoutingSnapshot()
+{
+	restoreRoutingState(RoutingStateSnapshot::load(loadRoutingSnapshotFile, self, "mmbcrLink"),
+		RoutingStateSnapshot::load(loadRoutingSnapshotFile, self, "mmbcrRoute"));
+}
+
+void MmbcrController::writeNonVolatileCheckpoint()
+{
+	unsigned int bytesWritten = 0;
+	if(nvRetainRoutes)
+	{
+		bytesWritten += NonVolatileStorage::write(node, "mmbcrRoute", tableManager->getRoutingTableRecords(),
+			NV_ROUTE_RECORD_BYTES, nvWriteEnergyPerByte);
+	}
+	if(nvRetainLinks)
+	{
+		bytesWritten += NonVolatileStorage::write(node, "mmbcrLink", linkEstimator->getLinkEstimateRecords(),
+			NV_LINK_RECORD_BYTES, nvWriteEnergyPerByte);
+	}
+	if(bytesWritten > 0)
+	{
+		trace() << "Wrote " << bytesWritten << " bytes of routing state to non-volatile memory";
+		collectOutput(OUTPUT_MMBCR_NV_BYTES_WRITTEN, "", bytesWritten);
+	}
+}
+
+void MmbcrController::saveRoutingSnapshot()
+{
+	trace() << "Saving routing snapshot, parent " << currentParentNodeId;
+	// The parent on its own, so that other protocols (e.g. StaticRouting) can use the same routes
+	if(currentParentNodeId != -1)
+	{
+		RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "parent", std::vector<std::string>(1, std::to_string(currentParentNodeId)));
+	}
+	RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "mmbcrRoute", tableManager->getRoutingTableRecords());
+	RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "mmbcrLink", linkEstimator->getLinkEstimateRecords());
 }
 
 void MmbcrController::initiateRouteDiscoveryAndPropagation()
@@ -66,6 +192,15 @@ void MmbcrController::initiateRouteDiscoveryAndPropagation()
 	// neighbous that we want to quickly receive up to date routing info
 	// (this is useful if a node startup is delayed with respect to the rest of the network,
 	// which may be mature and established and therefore sending beacons very infrequently)
+	if(routeRestoredOnRestart)
+	{
+		// We already have a route from non-volatile memory, so only advertise it. Neighbours don't all need to
+		// send us their routing info, it is revalidated as it comes
+		MmbcrBeaconSenderControlMessage *resetTrickleMsg = new MmbcrBeaconSenderControlMessage("Reset trickle message", BEACON_SENDER_CONTROL_COMMAND);
+		resetTrickleMsg->setBeaconSenderControlMessageKind(MMBCR_BEACON_SENDER_RESET_TRICKLE);
+		send(resetTrickleMsg, "toBeaconSender");
+		return;
+	}
 	MmbcrBeaconSenderControlMessage *resetTrickleMsg = new MmbcrBeaconSenderControlMessage("Reset trickle and pull message", BEACON_SENDER_CONTROL_COMMAND);
 	resetTrickleMsg->setBeaconSenderControlMessageKind(MMBCR_BEACON_SENDER_RESET_TRICKLE_AND_PULL);
 	send(resetTrickleMsg, "toBeaconSender");
@@ -124,7 +259,7 @@ void MmbcrController::fromApplicationLayer(cPacket *pkt, const char *destination
 	// THEN set packet fields (encapsulate function sets some fields, e.g. sequenceNumber)
 	networkPacket->setRoutingPacketKind(MMBCR_PACKET_TYPE_DATA);
 	networkPacket->setSource(SELF_NETWORK_ADDRESS);
-	networkPacket->setOrigin(SELF_NETWORK_ADDRESS);
+	networkPacket->setOrigin(self);
 	networkPacket->setHopCount(0);
 	// Set the multihop ETX of this node, for use in detecting routing loops:
 	networkPacket->setMultihopEtxToRoot(currentMultihopEtxToRoot);
@@ -262,6 +397,16 @@ void MmbcrController::fromMacLayer(cPacket *pkt, int srcMacAddress, double rssi,
 				resetTrickleMsg->setBeaconSenderControlMessageKind(MMBCR_BEACON_SENDER_RESET_TRICKLE);
 				send(resetTrickleMsg, "toBeaconSender");
 			}
+			// Otherwise let the beacon sender count it towards Trickle suppression, or reset trickle if it is inconsistent
+			else if(trickleSuppression)
+			{
+				MmbcrBeaconSenderControlMessage *beaconHeardMsg = new MmbcrBeaconSenderControlMessage("Beacon heard message", BEACON_SENDER_CONTROL_COMMAND);
+				beaconHeardMsg->setBeaconSenderControlMessageKind(MMBCR_BEACON_SENDER_BEACON_HEARD);
+				beaconHeardMsg->setNodeId(ctpPkt->getNetMacInfoExchange().lastHop);
+				beaconHeardMsg->setParentNodeId(ctpPkt->getParentNodeId());
+				beaconHeardMsg->setMultihopEtxToRoot(ctpPkt->getMultihopEtxToRoot());
+				send(beaconHeardMsg, "toBeaconSender");
+			}
 			
 			break;
 		}
@@ -378,53 +523,23 @@ bool MmbcrController::isDuplicate(MmbcrPacket *pkt)
 	// We also compare routingPacketKind, as broadcast beacons and unicast data
 	// have different runs of sequence number (so it would be possible for
 	// a beacon and data packet from the same node to have the same seqNo) 
-
-	//extract fields from packet
-	mmbcrPacket_type type = (mmbcrPacket_type) pkt->getRoutingPacketKind();
-	unsigned int seqNo = pkt->getSequenceNumber();
-	int origin = std::stoi(pkt->getOrigin());
-	unsigned int hopCount = pkt->getHopCount();
-
-	//resize packet history vector if necessary
-	if (origin >= (int)duplicateDetectionBuffer.size())
-		duplicateDetectionBuffer.resize(origin + 1);
-
-	//search for this packet from this origin in the list
-	list<duplicatePacketBufferEntry>::iterator iter;
-	for (iter = duplicateDetectionBuffer[origin].begin(); iter != duplicateDetectionBuffer[origin].end(); iter++) 
+	if(duplicateDetectionBuffer.isDuplicateOtherwiseRecord(pkt->getOrigin(), pkt->getRoutingPacketKind(), 
+		pkt->getSequenceNumber(), pkt->getHopCount()))
 	{
-		// Same type (beacon / data), seq no and hop count means it's the same
-		// no need to check origin - using separate list in vector for each origin node 
-		if((*iter).type == (mmbcrPacket_type) pkt->getRoutingPacketKind()
-		&& (*iter).seqNo == pkt->getSequenceNumber()
-		&& (*iter).hopCount == pkt->getHopCount())
-		{
-			// This is a duplicate.
-			trace() << "Dropping duplicate packet type " << type << 
-				" seqNo " << seqNo << 
-				" from origin node " << origin <<
-			 	", hop count " << hopCount;
-			return true;
-		}
+		// This is a duplicate.
+		trace() << "Dropping duplicate packet type " << pkt->getRoutingPacketKind() << 
+			" seqNo " << pkt->getSequenceNumber() << 
+			" from origin node " << pkt->getOrigin() <<
+		 	", hop count " << pkt->getHopCount();
+		return true;
 	}
 
-	// this is new packet, not a duplicate, add to duplicate buffer for this origin
-	struct duplicatePacketBufferEntry entry;
-	entry.type =  (mmbcrPacket_type) pkt->getRoutingPacketKind();
-	entry.seqNo =  pkt->getSequenceNumber();
-	entry.hopCount =  pkt->getHopCount();
-	duplicateDetectionBuffer[origin].push_front(entry);
-
-	// Rotate buffer
-	if (duplicateDetectionBuffer[origin].size() > duplicateDetectionBufferSize)
-		duplicateDetectionBuffer[origin].pop_back();
-
 	return false;
 }
 
 void MmbcrController::clearDuplicateBuffer()
 {
-	// Delete any remiaining messages in the duplicate check buffer (avoids undisposed object warning)
+	// Forget all packets seen
 	duplicateDetectionBuffer.clear();
 }
 
@@ -595,6 +710,22 @@ void MmbcrController::timerFiredCallback(int index)
 			break;
 		}
 
+		case MMBCR_CONTROLLER_TIMER_RESTORE_SNAPSHOT: {
+			restoreRoutingSnapshot();
+			break;
+		}
+
+		case MMBCR_CONTROLLER_TIMER_SAVE_SNAPSHOT: {
+			saveRoutingSnapshot();
+			break;
+		}
+
+		case MMBCR_CONTROLLER_TIMER_NV_CHECKPOINT: {
+			writeNonVolatileCheckpoint();
+			setTimer(MMBCR_CONTROLLER_TIMER_NV_CHECKPOINT, nvCheckpointInterval);
+			break;
+		}
+
 		default: {
 			opp_error("Unknown timer type");
 		}
@@ -604,4 +735,17 @@ void MmbcrController::timerFiredCallback(int index)
 void MmbcrController::finishSpecific()
 {
 	clearDuplicateBuffer();
+
+	if(hasStartedUpOnce)
+	{
+		if(loadRoutingSnapshotFile != "") {
+			RoutingStateSnapshot::release(loadRoutingSnapshotFile);
+		}
+		if(saveRoutingSnapshotFile != "") {
+			RoutingStateSnapshot::release(saveRoutingSnapshotFile);
+		}
+		if(nvStateRetention) {
+			NonVolatileStorage::release(node);
+		}
+	}
 }
\ No newline at end of file
@@ -3,6 +3,9 @@
 
 // Header for the virtual base Castalia MAC module 
 #include "VirtualRouting.h"
+#include "DuplicatePacketDetector.h"
+#include "RoutingStateSnapshot.h"
+#include "NonVolatileStorage.h"
 #include "MmbcrControlMessage_m.h"
 #include "RoutingControlMessage_m.h"
 #include "MmbcrPacket_m.h"
@@ -10,14 +13,14 @@
 
 enum MmbcrControllerTimers {
 	MMBCR_CONTROLLER_TIMER_LOOP_REPAIR = 1,
-	MMBCR_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION = 2
+	MMBCR_CONTROLLER_TIMER_DELAY_ROUTE_DISCOVERY_PROPAGATION = 2,
+	MMBCR_CONTROLLER_TIMER_RESTORE_SNAPSHOT = 3,
+	MMBCR_CONTROLLER_TIMER_SAVE_SNAPSHOT = 4,
+	MMBCR_CONTROLLER_TIMER_NV_CHECKPOINT = 5
 };
 
-struct duplicatePacketBufferEntry {
-	mmbcrPacket_type type;
-	unsigned int seqNo;
-	unsigned int hopCount;
-};
+class MmbcrLinkEstimator;
+class MmbcrTableManager;
 
 class MmbcrController : public VirtualRouting
 {
@@ -28,6 +31,14 @@ class MmbcrController : public VirtualRouting
 		int networkDataFrameOverheadBits;
 		double repairLoopWaitTimeMin;
 		double repairLoopWaitTimeRange;
+		std::string loadRoutingSnapshotFile;
+		std::string saveRoutingSnapshotFile;
+		double saveRoutingSnapshotTime;
+		bool nvStateRetention;
+		bool nvRetainRoutes;
+		bool nvRetainLinks;
+		double nvCheckpointInterval;
+		double nvWriteEnergyPerByte;
 		
 		//=========== Other private variables ============
 		static const char *OUTPUT_MMBCR_DROPPED_AFTER_MAX_RETRIES;
@@ -35,19 +46,29 @@ class MmbcrController : public VirtualRouting
 		static const char *OUTPUT_MMBCR_SENDING_RETRY;
 		static const char *OUTPUT_MMBCR_FORWARDING;
 		static const char *OUTPUT_MMBCR_HOP_COUNT;
+		static const char *OUTPUT_MMBCR_NV_BYTES_WRITTEN;
+		// Size of the entries a mote would keep in non-volatile memory. Route entries have room for the battery
+		// capacities of up to 8 hops (1 byte each)
+		static const unsigned int NV_ROUTE_RECORD_BYTES = 16;
+		static const unsigned int NV_LINK_RECORD_BYTES = 6;
 		bool isSink;
 		double delayBeforeRouteDiscoveryPropagation;
 		bool implementRetries;
+		bool trickleSuppression;
 		int sinkNodeId;
 		int currentParentNodeId;
 		double currentMultihopEtxToRoot;
 		bool isSending;
 		bool waitingForLoopRepair;
 		int currentPacketSendingAttempts;
-		// The buffer size in TinyOS is 4. Doubling to 8 because beacons and data packets
-		// have separate seqNo streams, so need to account for both types separately
-		const unsigned int duplicateDetectionBufferSize = 4;	
-		vector<list<duplicatePacketBufferEntry>> duplicateDetectionBuffer;
+		// The buffer size in TinyOS is 4 packets per origin. Beacons and data packets have separate seqNo streams,
+		// so the packet kind is also compared
+		DuplicatePacketDetector<4> duplicateDetectionBuffer;
+		// Only called directly to save and restore snapshots
+		MmbcrLinkEstimator *linkEstimator;
+		MmbcrTableManager *tableManager;
+		cModule *node;
+		bool routeRestoredOnRestart;
 
 		//=========== Private member functions ===========
 		void initiateRouteDiscoveryAndPropagation();
@@ -56,6 +77,10 @@ class MmbcrController : public VirtualRouting
 		void repairLoop();
 		void forwardPacket(MmbcrPacket *pkt);
 		void clearDuplicateBuffer();
+		bool restoreRoutingState(const std::vector<std::string> &linkRecords, const std::vector<std::string> &routeRecords);
+		void restoreRoutingSnapshot();
+		void writeNonVolatileCheckpoint();
+		void saveRoutingSnapshot();
 
 	protected:
 
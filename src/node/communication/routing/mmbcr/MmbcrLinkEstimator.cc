@@ -141,6 +141,40 @@ void MmbcrLinkEstimator::handleMessage(cMessage *msg)
 	cancelAndDelete(msg);
 }
 
+std::vector<std::string> MmbcrLinkEstimator::getLinkEstimateRecords()
+{
+	Enter_Method_Silent();
+	// A neighbour may have an ETX without an incoming LQ (from outgoing LQ alone), but not the other way round
+	std::vector<std::string> records;
+	for(std::map<int, double>::iterator it = previousEtxs.begin(); it != previousEtxs.end(); ++it)
+	{
+		std::ostringstream record;
+		record << it->first << " " << (previousInLqs.count(it->first) > 0 ? previousInLqs[it->first] : -1) << " " << it->second;
+		records.push_back(record.str());
+	}
+	return records;
+}
+
+void MmbcrLinkEstimator::restoreLinkEstimates(const std::vector<std::string> &records)
+{
+	Enter_Method_Silent();
+	for(unsigned int i = 0; i < records.size(); i++)
+	{
+		std::istringstream record(records[i]);
+		int nodeId;
+		double previousInLq, previousEtx;
+		if(!(record >> nodeId >> previousInLq >> previousEtx)) {
+			opp_error("Malformed MMBCR link estimate snapshot record: %s", records[i].c_str());
+		}
+		// New estimates are smoothed with the restored ones, as if the estimator had been running all along
+		if(previousInLq != -1) {
+			previousInLqs[nodeId] = previousInLq;
+		}
+		previousEtxs[nodeId] = previousEtx;
+	}
+	trace() << "Restored " << records.size() << " link estimates from snapshot";
+}
+
 void MmbcrLinkEstimator::updateIncomingLinkQuality(int nodeId, unsigned int seqNo)
 { 
 	double newInLq;
@@ -3,6 +3,9 @@
 
 #include <map>
 #include <numeric>
+#include <string>
+#include <vector>
+#include <sstream>
 #include "CastaliaModule.h"
 #include "TimerService.h"
 #include "ResourceManager.h"
@@ -40,6 +43,14 @@ class MmbcrLinkEstimator : public CastaliaModule, public TimerService
 		void updateOutgoingLinkQuality(int nodeId, bool wasAcked);
 		void updateEtx(int nodeId, double newEtx);
 
+	public:
+
+		// Link estimate snapshot, one record per neighbour: "<nodeId> <incoming LQ> <ETX>" (-1 if there is none).
+		// Beacon and message windows are not included, as they only make sense with the sequence numbers of the
+		// run they came from
+		std::vector<std::string> getLinkEstimateRecords();
+		void restoreLinkEstimates(const std::vector<std::string> &records);
+
 	protected:
 		
 		// Virtual methods from CastaliaModule / TimerService class
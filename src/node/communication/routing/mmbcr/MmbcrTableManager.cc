@@ -208,6 +208,59 @@ void MmbcrTableManager::updateNodeBatteryCapacitiesToSink(int nodeId, BatteryCap
 	updateParentAndMultihopEtxToRoot();
 }
 
+std::vector<std::string> MmbcrTableManager::getRoutingTableRecords()
+{
+	Enter_Method_Silent();
+	std::vector<std::string> records;
+	for(std::map<int, NodeRoutingInfo_t>::iterator it = nodeRoutingTable.begin(); it != nodeRoutingTable.end(); ++it)
+	{
+		std::ostringstream record;
+		record << it->first << " " << it->second.nodeMultihopEtxToRoot << " " << it->second.etxLinkQualityToNode
+			<< " " << it->second.parentNodeId << " " << it->second.batteryCapacitiesOfPathToSink.size();
+		for(BatteryCapacityVector_t::iterator capacity = it->second.batteryCapacitiesOfPathToSink.begin();
+			capacity != it->second.batteryCapacitiesOfPathToSink.end(); ++capacity)
+		{
+			record << " " << *capacity;
+		}
+		records.push_back(record.str());
+	}
+	return records;
+}
+
+bool MmbcrTableManager::restoreRoutingTable(const std::vector<std::string> &records)
+{
+	Enter_Method_Silent();
+	// The sink doesn't keep a routing table (and so never saves one)
+	if(isSink) {
+		return false;
+	}
+
+	for(unsigned int i = 0; i < records.size() && nodeRoutingTable.size() < nodeRoutingTableMaxSize; i++)
+	{
+		std::istringstream record(records[i]);
+		int nodeId;
+		unsigned int numberOfBatteries;
+		NodeRoutingInfo_t restored;
+		if(!(record >> nodeId >> restored.nodeMultihopEtxToRoot >> restored.etxLinkQualityToNode >> restored.parentNodeId
+			>> numberOfBatteries)) {
+			opp_error("Malformed MMBCR routing table snapshot record: %s", records[i].c_str());
+		}
+		restored.batteryCapacitiesOfPathToSink.resize(numberOfBatteries);
+		for(unsigned int j = 0; j < numberOfBatteries; j++)
+		{
+			if(!(record >> restored.batteryCapacitiesOfPathToSink[j])) {
+				opp_error("Malformed MMBCR routing table snapshot record: %s", records[i].c_str());
+			}
+		}
+		nodeRoutingTable[nodeId] = restored;
+	}
+	trace() << "Restored " << nodeRoutingTable.size() << " routing table entries from snapshot";
+
+	// Choose our parent from the restored table, which also tells the beacon sender and controller
+	updateParentAndMultihopEtxToRoot();
+	return currentParentNodeId != -1;
+}
+
 void MmbcrTableManager::notifyBeaconSenderMultihopEtx()
 {
 	//trace() << "Updating beacon sender with multihop ETX to root: " << currentMultihopEtxToRoot;
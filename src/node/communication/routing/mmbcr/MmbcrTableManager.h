@@ -2,6 +2,9 @@
 #define _MMBCRTABLEMANAGER_H_
 
 #include <algorithm> // std::min_element
+#include <string>
+#include <vector>
+#include <sstream>
 #include "CastaliaModule.h"
 #include "TimerService.h"
 #include "ResourceManager.h"
@@ -68,6 +71,14 @@ class MmbcrTableManager : public CastaliaModule, public TimerService
 		void notifyBeaconSenderParentBatteryCapacitiesToSink();
 		void notifyControllerMultihopEtxAndParent();
 
+	public:
+
+		// Routing table snapshot, one record per entry:
+		// "<nodeId> <MH-ETX> <SH-ETX> <parentNodeId> <number of batteries> <battery capacities of path to sink...>"
+		std::vector<std::string> getRoutingTableRecords();
+		// Returns true if we have a parent from the restored table
+		bool restoreRoutingTable(const std::vector<std::string> &records);
+
 	protected:
 		
 		// Virtual methods from CastaliaModule / TimerService class
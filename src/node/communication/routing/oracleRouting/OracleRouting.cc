@@ -0,0 +1,379 @@
+#include "OracleRouting.h"
+
+Define_Module(OracleRouting);
+
+void OracleRouting::startup()
+{
+	trace() << "Startup";
+
+	if(!hasStartedUpOnce)
+	{
+		// Store NED parameters
+		implementRetries = par("implementRetries");
+		oracleRoutingFrameSizeBits = par("oracleRoutingFrameSizeBits");
+		maxPacketSendRetries = par("maxPacketSendRetries");
+		noRouteRetryInterval = par("noRouteRetryInterval");
+		noiseFloor = par("noiseFloor");
+		rxSensitivity = par("rxSensitivity");
+		noiseBandwidth = par("noiseBandwidth");
+		phyDataRate = par("phyDataRate");
+		linkEtxFrameSizeBits = par("linkEtxFrameSizeBits");
+		minLinkPrr = par("minLinkPrr");
+
+		network = getParentModule() // Communication module
+			->getParentModule() // Node module
+			->getParentModule(); // Network module
+
+		// The first node to start works out the link ETXs for everyone
+		tree = &OracleRoutingTree::getTree(network);
+		if(!tree->hasLinkEtx()) {
+			tree->setLinkEtx(calculateLinkEtx());
+		}
+
+		hasStartedUpOnce = true;
+	}
+
+	currentPacketSendingAttempts = 0;
+	isSending = false;
+	lastParentNodeId = -1;
+
+	// Everyone's parent is recomputed to include us
+	tree->setNodeUp(self, true);
+}
+
+vector<vector<double> > OracleRouting::calculateLinkEtx()
+{
+	cModule *wirelessChannel = network->getSubmodule("wirelessChannel");
+	double pathLossExponent = wirelessChannel->par("pathLossExponent");
+	double PLd0 = wirelessChannel->par("PLd0");
+	double d0 = wirelessChannel->par("d0");
+	int numNodes = network->par("numNodes");
+
+	vector<NodeLocation_type> locations(numNodes);
+	vector<double> txPowers(numNodes);
+	for(int i = 0; i < numNodes; i++)
+	{
+		cModule *node = network->getSubmodule("node", i);
+		locations[i] = check_and_cast<VirtualMobilityManager*>(node->getSubmodule("MobilityManager"))->getLocation();
+		// e.g. "-0dBm"
+		txPowers[i] = atof(node->getSubmodule("Communication")->getSubmodule("Radio")->par("TxOutputPower").stringValue());
+	}
+
+	vector<vector<double> > linkEtx(numNodes, vector<double>(numNodes, -1));
+	for(int i = 0; i < numNodes; i++)
+	{
+		for(int j = 0; j < numNodes; j++)
+		{
+			if(i == j) {
+				continue;
+			}
+
+			double distance = sqrt(pow(locations[i].x - locations[j].x, 2) + pow(locations[i].y - locations[j].y, 2)
+				+ pow(locations[i].z - locations[j].z, 2));
+			// Mean path loss of the channel's log-distance model
+			double pathLoss = PLd0 + 10.0 * pathLossExponent * log10(max(distance, d0) / d0);
+
+			// A link is used in both directions - for the frame, and for its ACK
+			double forwardPrr = calculateLinkPrr(txPowers[i], pathLoss);
+			double reversePrr = calculateLinkPrr(txPowers[j], pathLoss);
+			if(forwardPrr >= minLinkPrr && reversePrr >= minLinkPrr) {
+				linkEtx[i][j] = 1.0 / (forwardPrr * reversePrr);
+			}
+		}
+	}
+	return linkEtx;
+}
+
+double OracleRouting::calculateLinkPrr(double txPower, double pathLoss)
+{
+	double rxPower = txPower - pathLoss;
+	if(rxPower < rxSensitivity) {
+		return 0;
+	}
+
+	// Bit error rate of PSK at this SNR, as for the CC2420 in Castalia's radio model
+	double snr = pow(10.0, (rxPower - noiseFloor) / 10.0);
+	double bitErrorRate = 0.5 * erfc(sqrt(snr * noiseBandwidth / phyDataRate));
+	return pow(1.0 - bitErrorRate, linkEtxFrameSizeBits);
+}
+
+void OracleRouting::handleOutOfEnergy(cMessage *outOfEnergyMsg)
+{
+	// We need to simulate what happens when a node runs out of energy - all state will be lost
+
+	// It's unlikely but possible that a node may set a timer, then run out of energy,
+	// then restart, and pick up the expired timer message from before shutting down. So
+	// just in case, cancel all pending timers
+	cancelAllTimers();
+
+	// Empty buffers
+	pktHistory.clear();
+	clearPacketBuffer();
+
+	// DO NOT RESET THE PACKET SEQUENCE NUMBER - OTHERWISE DUPLICATE PACKET CHECKING WILL ERRONEOUSLY DISCARD PACKETS WHEN NODES RESTART
+
+	// Everyone's parent is recomputed without us
+	tree->setNodeUp(self, false);
+
+	// No need to reinitialise private variables set in startup() - startup will be called when node restarts
+
+	cancelAndDelete(outOfEnergyMsg);
+}
+
+void OracleRouting::fromApplicationLayer(cPacket * pkt, const char *destination)
+{
+	trace() << "fromApplicationLayer";
+
+	if(tree->isSink(self))
+	{
+		trace() << "We are a sink, not sending packet from application";
+		delete pkt;
+		return;
+	}
+
+	OracleRoutingPacket *netPacket = new OracleRoutingPacket("OracleRouting packet", NETWORK_LAYER_PACKET);
+	// Important: set bit length before encapsulation
+	netPacket->setBitLength(oracleRoutingFrameSizeBits);
+	encapsulatePacket(netPacket, pkt);
+	netPacket->setSource(SELF_NETWORK_ADDRESS);
+	netPacket->setOrigin(SELF_NETWORK_ADDRESS);
+
+	// Buffer the packet
+	bufferPacket(netPacket);
+
+	// Start sending packets
+	// Check if not already sending to avoid conflicting with current send (e.g. we may be waiting for a reply / retransmission of a previous packet)
+	if(!isSending)
+	{
+		sendPackets();
+	}
+}
+
+int OracleRouting::getParent()
+{
+	int parentNodeId = tree->getParent(self);
+	if(parentNodeId != lastParentNodeId)
+	{
+		trace() << "Parent is now " << parentNodeId << " with path ETX " << tree->getPathEtx(self);
+		if(parentNodeId != -1) {
+			plotTrace() << "#ROU_PARENT " << parentNodeId;
+		}
+		lastParentNodeId = parentNodeId;
+	}
+	return parentNodeId;
+}
+
+void OracleRouting::sendPackets()
+{
+	if(TXBuffer.size() > 0)
+	{
+		isSending = true;
+
+		// Our parent may have changed since the last attempt
+		int parentNodeId = getParent();
+		if(parentNodeId == -1)
+		{
+			trace() << "No route to a sink, trying again in " << noRouteRetryInterval;
+			setTimer(ORACLE_ROUTING_TIMER_NO_ROUTE, noRouteRetryInterval);
+			return;
+		}
+		string parentAddress = std::to_string(parentNodeId);
+
+		if(implementRetries)
+		{
+			if(currentPacketSendingAttempts < maxPacketSendRetries)
+			{
+				// Send the packet to the MAC layer. Send a duplicate because we hold the
+				// message in the buffer in case we need to retry (only the header is copied, the
+				// encapsulated application packet is shared)
+				plotTrace() << "#ROU_SEND";
+				OracleRoutingPacket *networkPacket = check_and_cast<OracleRoutingPacket*>(TXBuffer.front()->dup());
+				networkPacket->setDestination(parentAddress.c_str());
+				trace() << "Sending packet (attempt number " << currentPacketSendingAttempts << ", " <<
+					"sequenceNo " << networkPacket->getSequenceNumber() <<
+					" to node " << parentNodeId;
+				toMacLayer(networkPacket, parentNodeId);
+			}
+			else // Max number of retries attempted - drop the packet
+			{
+				trace() << "Reached maximum retries for transmitting packet (" << maxPacketSendRetries << "), dropping packet";
+				// Remove from the buffer
+				cancelAndDelete(TXBuffer.front());
+				TXBuffer.pop();
+				// Reset sending attempts counter
+				currentPacketSendingAttempts = 0;
+
+				// Recall send packets in case we have more in the buffer to send
+				sendPackets();
+			}
+		}
+		else
+		{
+			// No retries. Just send the packet. Don't take a duplicate from the buffer - only sending once.
+			plotTrace() << "#ROU_SEND";
+			OracleRoutingPacket *networkPacket = check_and_cast<OracleRoutingPacket*>(TXBuffer.front());
+			TXBuffer.pop();
+			networkPacket->setDestination(parentAddress.c_str());
+			trace() << "Sending packet sequenceNo " << networkPacket->getSequenceNumber() <<
+					" to node " << parentNodeId;
+			toMacLayer(networkPacket, parentNodeId);
+
+			// Recall send packets in case we have more in the buffer to send
+			sendPackets();
+		}
+	}
+	else
+	{
+		// Finished sending
+		isSending = false;
+	}
+}
+
+void OracleRouting::timerFiredCallback(int index)
+{
+	switch(index)
+	{
+		case ORACLE_ROUTING_TIMER_NO_ROUTE: {
+			sendPackets();
+			break;
+		}
+
+		default: {
+			opp_error("Unknown timer type");
+		}
+	}
+}
+
+void OracleRouting::fromMacLayer(cPacket * pkt, int srcMacAddress, double rssi, double lqi)
+{
+	OracleRoutingPacket *receivedPacket = dynamic_cast <OracleRoutingPacket*>(pkt);
+	if (receivedPacket)
+	{
+		//If addressed to this node, and not a duplicate
+		if(strcmp(receivedPacket->getDestination(), SELF_NETWORK_ADDRESS) == 0)
+		{
+			if(isNotDuplicatePacket(receivedPacket))
+			{
+				if(tree->isSink(self))
+				{
+					toApplicationLayer(decapsulatePacket(receivedPacket));
+				}
+				else
+				{
+					trace() << "Received packet from node " << srcMacAddress << " origin " << receivedPacket->getOrigin()
+						<< ", forwarding";
+					// Take a duplciate because original will be deleted (shares the application packet with the original)
+					OracleRoutingPacket *packetToForward = receivedPacket->dup();
+					packetToForward->setSource(SELF_NETWORK_ADDRESS);
+
+					bufferPacket(packetToForward);
+
+					// Initiate packet sending
+					if(!isSending)
+					{
+						sendPackets();
+					}
+				}
+			}
+			else
+			{
+				trace() << "Discarding duplicate packet from " << receivedPacket->getSource() << " origin "
+					<< receivedPacket->getOrigin() << " sequence no " << receivedPacket->getSequenceNumber();
+			}
+		}
+		else
+		{
+			trace() << "Ignoring packet from " << receivedPacket->getSource() << " origin " << receivedPacket->getOrigin()
+				<< " not addressed to us, addressed to " << receivedPacket->getDestination();
+		}
+	}
+	else
+	{
+		opp_error("Failed to cast routing packet");
+	}
+}
+
+void OracleRouting::handleNetworkControlCommand(cMessage *msg)
+{
+	switch(msg->getKind())
+	{
+		case NETWORK_CONTROL_COMMAND:
+		{
+			RoutingControlMessage *controlMsg = check_and_cast<RoutingControlMessage*>(msg);
+
+			switch(controlMsg->getRoutingControlMessageKind()) {
+
+				case ROUTING_MSG_MAC_SENDING_ACKED: {
+
+					trace() << "Message ACKed";
+					// Message sending succeeded
+
+					// If we're implementing retires
+					if(implementRetries)
+					{
+						// Remove the current message from the TX buffer
+						// (if we are not implementing retires, the packet is already taken out
+						// of the buffer, since we are only sending to MAC layer once)
+						if(TXBuffer.size() > 0)
+						{
+							cancelAndDelete(TXBuffer.front());
+							TXBuffer.pop();
+						}
+
+						// Reset the number of retries
+						currentPacketSendingAttempts = 0;
+					}
+
+					// Call send packets again in case there are more packets to send in buffer
+					sendPackets();
+
+					break;
+				}
+
+				case ROUTING_MSG_MAC_SENDING_FAILED_NO_ACK: {
+
+					// Message sending failed.
+					trace() << "Message not ACKed";
+
+					if(implementRetries)
+					{
+						// Increment the number of retries
+						currentPacketSendingAttempts++;
+						trace() << "Sending attempts counter incremented to " << currentPacketSendingAttempts;
+					}
+
+					// Attempt to send again
+					sendPackets();
+
+					break;
+				}
+
+				// The application layer is telling us which node is a sink. There may be several,
+				// each node routes to whichever gives it the lowest path ETX
+				case ROUTING_MSG_SINK_NODE_UPDATE:
+				{
+					tree->addSink(controlMsg->getValue());
+					cancelAndDelete(controlMsg);
+					break;
+				}
+
+				default: {
+					opp_error("Unknown network control message type");
+				}
+			}
+
+			break;
+		}
+
+		default: {
+			opp_error("Expected network control command");
+		}
+	}
+}
+
+void OracleRouting::finishSpecific()
+{
+	if(hasStartedUpOnce) {
+		OracleRoutingTree::releaseTree(network);
+	}
+}
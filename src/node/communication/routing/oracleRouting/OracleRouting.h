@@ -0,0 +1,54 @@
+#ifndef _ORACLEROUTING_H_
+#define _ORACLEROUTING_H_
+
+#include <vector>
+#include <math.h>
+#include "VirtualRouting.h"
+#include "VirtualMobilityManager.h"
+#include "OracleRoutingPacket_m.h"
+#include "OracleRoutingTree.h"
+#include "RoutingControlMessage_m.h"
+
+using namespace std;
+
+enum OracleRoutingTimers {
+	ORACLE_ROUTING_TIMER_NO_ROUTE = 1
+};
+
+class OracleRouting: public VirtualRouting
+{
+	private:
+		bool isSending;
+		bool implementRetries;
+		int currentPacketSendingAttempts;
+		int maxPacketSendRetries;
+		int oracleRoutingFrameSizeBits;
+		double noRouteRetryInterval;
+		double noiseFloor;
+		double rxSensitivity;
+		double noiseBandwidth;
+		double phyDataRate;
+		int linkEtxFrameSizeBits;
+		double minLinkPrr;
+
+		cModule *network;
+		// Shared by all nodes in the network
+		OracleRoutingTree *tree;
+		int lastParentNodeId;
+
+		void sendPackets();
+		int getParent();
+		vector<vector<double> > calculateLinkEtx();
+		double calculateLinkPrr(double txPower, double pathLoss);
+
+ 	protected:
+	 	void startup();
+		void finishSpecific();
+		void fromApplicationLayer(cPacket *, const char *);
+		void fromMacLayer(cPacket *, int, double, double);
+		void handleNetworkControlCommand(cMessage *msg);
+		void handleOutOfEnergy(cMessage *outOfEnergyMsg);
+		void timerFiredCallback(int index);
+};
+
+#endif //_ORACLEROUTING_H_
@@ -0,0 +1,141 @@
+#ifndef _ORACLEROUTINGTREE_H_
+#define _ORACLEROUTINGTREE_H_
+
+#include <map>
+#include <set>
+#include <vector>
+#include <omnetpp.h>
+#include "SharedRegistry.h"
+
+// The minimum ETX collection tree of a network, shared by the OracleRouting modules of all its nodes.
+// Link ETXs are given once (by the first node to start up) and only nodes which are up are used in the tree.
+// Whenever a node starts, dies, or a sink is added, the tree is marked out of date, and recomputed the next time
+// a node asks for its parent - so parents change everywhere at once, with no control traffic.
+class OracleRoutingTree
+{
+	public:
+
+		// The tree for the given network module, created on first use (see SharedRegistry)
+		static OracleRoutingTree &getTree(cModule *network)
+		{
+			return Registry_t::open(network);
+		}
+
+		static void releaseTree(cModule *network)
+		{
+			Registry_t::release(network);
+		}
+
+		OracleRoutingTree(): isUpToDate(false) { }
+
+		bool hasLinkEtx() const { return !linkEtx.empty(); }
+
+		// linkEtx[from][to] is the ETX of sending from one node to another, or -1 if there is no usable link
+		void setLinkEtx(const std::vector<std::vector<double> > &linkEtx)
+		{
+			this->linkEtx = linkEtx;
+			isUp.assign(linkEtx.size(), false);
+			isUpToDate = false;
+		}
+
+		void setNodeUp(int nodeId, bool up)
+		{
+			if(isUp[nodeId] != up)
+			{
+				isUp[nodeId] = up;
+				isUpToDate = false;
+			}
+		}
+
+		void addSink(int nodeId)
+		{
+			if(sinkNodeIds.insert(nodeId).second) {
+				isUpToDate = false;
+			}
+		}
+
+		bool isSink(int nodeId) const { return sinkNodeIds.count(nodeId) > 0; }
+
+		// The node's next hop towards its nearest sink (by path ETX), or -1 if it has no route.
+		// A sink is its own parent
+		int getParent(int nodeId)
+		{
+			update();
+			return parents[nodeId];
+		}
+
+		// Path ETX from the node to its sink, or -1 if it has no route
+		double getPathEtx(int nodeId)
+		{
+			update();
+			return pathEtx[nodeId];
+		}
+
+	private:
+
+		typedef SharedRegistry<OracleRoutingTree, cModule*, OracleRoutingTree> Registry_t;
+
+		std::vector<std::vector<double> > linkEtx;
+		std::vector<bool> isUp;
+		std::set<int> sinkNodeIds;
+		bool isUpToDate;
+		std::vector<int> parents;
+		std::vector<double> pathEtx;
+
+		// Dijkstra from all live sinks at once, over live nodes. Networks are small enough (tens of nodes) that
+		// the simple O(n^2) version is fine, and it only runs when the set of live nodes changes
+		void update()
+		{
+			if(isUpToDate) {
+				return;
+			}
+
+			int numNodes = linkEtx.size();
+			parents.assign(numNodes, -1);
+			pathEtx.assign(numNodes, -1);
+			std::vector<bool> isDone(numNodes, false);
+
+			for(std::set<int>::iterator it = sinkNodeIds.begin(); it != sinkNodeIds.end(); ++it)
+			{
+				if(*it < numNodes && isUp[*it])
+				{
+					parents[*it] = *it;
+					pathEtx[*it] = 0;
+				}
+			}
+
+			while(true)
+			{
+				// The nearest node not yet done
+				int nearest = -1;
+				for(int i = 0; i < numNodes; i++)
+				{
+					if(!isDone[i] && pathEtx[i] != -1 && (nearest == -1 || pathEtx[i] < pathEtx[nearest])) {
+						nearest = i;
+					}
+				}
+				if(nearest == -1) {
+					break;
+				}
+				isDone[nearest] = true;
+
+				// Route any live node which can reach it through it, if that is better than its current route
+				for(int i = 0; i < numNodes; i++)
+				{
+					if(isDone[i] || !isUp[i] || linkEtx[i][nearest] == -1) {
+						continue;
+					}
+					double etxViaNearest = pathEtx[nearest] + linkEtx[i][nearest];
+					if(pathEtx[i] == -1 || etxViaNearest < pathEtx[i])
+					{
+						pathEtx[i] = etxViaNearest;
+						parents[i] = nearest;
+					}
+				}
+			}
+
+			isUpToDate = true;
+		}
+};
+
+#endif //_ORACLEROUTINGTREE_H_
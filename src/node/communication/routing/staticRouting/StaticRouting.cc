@@ -6,13 +6,43 @@ void StaticRouting::startup()
 {
 	trace() << "Startup";
 
-	if(hasPar("routeToNode"))
+	if(!hasStartedUpOnce)
 	{
+		loadRoutingSnapshotFile = par("loadRoutingSnapshotFile").stringValue();
+		saveRoutingSnapshotFile = par("saveRoutingSnapshotFile").stringValue();
+		saveRoutingSnapshotTime = par("saveRoutingSnapshotTime");
+		if(saveRoutingSnapshotFile != "" && saveRoutingSnapshotTime < 0) {
+			opp_error("saveRoutingSnapshotTime must be set to save a routing snapshot");
+		}
+
 		routeToNode = par("routeToNode").stringValue();
+		if(loadRoutingSnapshotFile != "")
+		{
+			// Kept open until we finish, so that the file is only read once for all nodes
+			RoutingStateSnapshot::open(loadRoutingSnapshotFile);
+			vector<string> parent = RoutingStateSnapshot::load(loadRoutingSnapshotFile, self, "parent");
+			if(routeToNode == "" && parent.size() > 0) {
+				routeToNode = parent[0];
+			}
+		}
+		if(routeToNode == "")
+		{
+			opp_error("Need to set a route destination for every node in static routing (routeToNode, or a parent in the routing snapshot)");
+		}
+		trace() << "Routing to node " << routeToNode;
+
+		if(saveRoutingSnapshotFile != "")
+		{
+			RoutingStateSnapshot::open(saveRoutingSnapshotFile);
+		}
+
+		hasStartedUpOnce = true;
 	}
-	else
+
+	// (Re)schedule the snapshot, unless we restarted after it was due
+	if(saveRoutingSnapshotFile != "" && saveRoutingSnapshotTime >= simTime().dbl())
 	{
-		opp_error("Need to set a route destination for every node in static routing");
+		setTimer(STATIC_ROUTING_TIMER_SAVE_SNAPSHOT, saveRoutingSnapshotTime - simTime().dbl());
 	}
 
 	implementRetries = par("implementRetries");
@@ -42,6 +72,34 @@ void StaticRouting::handleOutOfEnergy(cMessage *outOfEnergyMsg)
 	cancelAndDelete(outOfEnergyMsg);
 }
 
+void StaticRouting::timerFiredCallback(int index)
+{
+	switch(index)
+	{
+		case STATIC_ROUTING_TIMER_SAVE_SNAPSHOT: {
+			RoutingStateSnapshot::save(saveRoutingSnapshotFile, self, "parent", vector<string>(1, routeToNode));
+			break;
+		}
+
+		default: {
+			opp_error("Unknown timer type");
+		}
+	}
+}
+
+void StaticRouting::finishSpecific()
+{
+	if(hasStartedUpOnce)
+	{
+		if(loadRoutingSnapshotFile != "") {
+			RoutingStateSnapshot::release(loadRoutingSnapshotFile);
+		}
+		if(saveRoutingSnapshotFile != "") {
+			RoutingStateSnapshot::release(saveRoutingSnapshotFile);
+		}
+	}
+}
+
 void StaticRouting::fromApplicationLayer(cPacket * pkt, const char *destination)
 {
 	trace() << "fromApplicationLayer";
@@ -76,7 +134,8 @@ void StaticRouting::sendPackets()
 			{
 				
 				// Send the packet to the MAC layer. Send a duplicate because we hold the
-				// message in the buffer in case we need to retry
+				// message in the buffer in case we need to retry (only the header is copied, the
+				// encapsulated application packet is shared)
 				//trace() << "Transmission attempt number " << currentPacketSendingAttempts;
 				plotTrace() << "#ROU_SEND";
 				StaticRoutingPacket *networkPacket = check_and_cast<StaticRoutingPacket*>(TXBuffer.front()->dup());
@@ -141,7 +200,7 @@ void StaticRouting::fromMacLayer(cPacket * pkt, int srcMacAddress, double rssi,
 				{
 					trace() << "Received packet from node " << srcMacAddress << " origin " << receivedPacket->getOrigin() 
 						<< ", forwarding to " << routeToNode.c_str();
-					// Take a duplciate because original will be deleted
+					// Take a duplciate because original will be deleted (shares the application packet with the original)
 					StaticRoutingPacket *packetToForward = receivedPacket->dup();
 					packetToForward->setSource(SELF_NETWORK_ADDRESS);
 					packetToForward->setDestination(routeToNode.c_str());
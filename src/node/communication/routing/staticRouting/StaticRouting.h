@@ -2,11 +2,16 @@
 #define _STATICROUTING_H_
 
 #include "VirtualRouting.h"
+#include "RoutingStateSnapshot.h"
 #include "StaticRoutingPacket_m.h"
 #include "RoutingControlMessage_m.h"
 
 using namespace std;
 
+enum StaticRoutingTimers {
+	STATIC_ROUTING_TIMER_SAVE_SNAPSHOT = 1
+};
+
 class StaticRouting: public VirtualRouting 
 {
 	private:
@@ -16,15 +21,20 @@ class StaticRouting: public VirtualRouting
 		int currentPacketSendingAttempts;
 		int maxPacketSendRetries;
 		int staticRoutingFrameSizeBits;
+		string loadRoutingSnapshotFile;
+		string saveRoutingSnapshotFile;
+		double saveRoutingSnapshotTime;
 
 		void sendPackets();
 
  	protected:
 	 	void startup();
+		void finishSpecific();
 		void fromApplicationLayer(cPacket *, const char *);
 		void fromMacLayer(cPacket *, int, double, double);
 		void handleNetworkControlCommand(cMessage *msg);
 		void handleOutOfEnergy(cMessage *outOfEnergyMsg);
+		void timerFiredCallback(int index);
 };
 
 #endif				//STATICROUTINGMODULE